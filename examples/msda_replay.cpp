@@ -0,0 +1,487 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <acl/acl.h>
+#include "aclnn_multi_scale_deformable_attn_func_v2.h"
+#include "aclnn_multi_scale_deformable_attn_grad_v2.h"
+#include "multi_scale_deformable_attn_v2_capture.h"
+
+#define CHECK_RET(cond, return_expr) do { if (!(cond)) { return_expr; } } while (0)
+#define LOG_PRINT(msg, ...) do { printf(msg, ##__VA_ARGS__); fflush(stdout); } while (0)
+
+// Replays a capture written under MSDA_CAPTURE=<prefix> (see simu_one_layer.cpp):
+//   msda_replay <file.msdacap> [--iters N] [--cpu]
+// Prints the sampling statistics that drive kernel performance, then runs forward and backward N times on the
+// NPU, or with --cpu a host reference forward for machines without one. Both replay the captured call's attrs.
+struct ReplayShape {
+    int64_t batchSize, numSources, numHeads, numKeys, embedDims, numQueries, numLevels, numPoints;
+    // sampling_locations / attention_weights rows as addressed by the captured view attrs: row (b, q) starts at
+    // offset + (b * Q + q) * rowStride of the recorded storage
+    int64_t locationRowStride, locationOffset, weightRowStride, weightOffset;
+};
+
+struct ReplayInputs {
+    const msda_capture::TensorRecord *value, *spatialShapes, *levelStartIndex, *location, *attnWeight, *gradOutput;
+};
+
+static uint64_t ElementNum(const msda_capture::TensorRecord &record) {
+    uint64_t num = 1;
+    for (uint32_t d = 0; d < record.dimNum; d++) {
+        num *= record.dims[d];
+    }
+    return num;
+}
+
+// Resolves one captured input row view the way the tiling functions do (0 stride: dense rows) and checks that
+// its rows lie inside the recorded storage.
+static bool ResolveView(const msda_capture::TensorRecord &record, int64_t rows, int64_t rowNum, int64_t rowStride,
+                        int64_t rowOffset, int64_t &stride, int64_t &offset) {
+    stride = rowStride == 0 ? rowNum : rowStride;
+    offset = rowOffset;
+    uint64_t storageNum = record.bytes / sizeof(float);
+    return rowStride >= 0 && rowOffset >= 0 && stride >= rowNum &&
+           (rows == 0 || static_cast<uint64_t>(offset + (rows - 1) * stride + rowNum) <= storageNum);
+}
+
+static int LoadInputs(const msda_capture::MappedFile &file, ReplayInputs &inputs, ReplayShape &shape) {
+    inputs.value = file.Find("value");
+    inputs.spatialShapes = file.Find("value_spatial_shapes");
+    inputs.levelStartIndex = file.Find("value_level_start_index");
+    inputs.location = file.Find("sampling_locations");
+    inputs.attnWeight = file.Find("attention_weights");
+    inputs.gradOutput = file.Find("grad_output");
+    CHECK_RET(inputs.value != nullptr && inputs.spatialShapes != nullptr && inputs.levelStartIndex != nullptr &&
+              inputs.location != nullptr && inputs.attnWeight != nullptr,
+              LOG_PRINT("Capture lacks a forward input\n"); return -1);
+    CHECK_RET(inputs.value->dimNum == 4 && inputs.location->dimNum == 6,
+              LOG_PRINT("Unexpected value / sampling_locations rank\n"); return -1);
+    // value (num_sources * bs, num_heads, num_keys, embed_dims), sampling_locations (bs, Q, num_heads, L, P, 2)
+    shape.batchSize = inputs.location->dims[0];
+    CHECK_RET(shape.batchSize > 0 && inputs.value->dims[0] % shape.batchSize == 0,
+              LOG_PRINT("value batch is not a multiple of the sampling_locations batch\n"); return -1);
+    shape.numSources = inputs.value->dims[0] / shape.batchSize;
+    shape.numHeads = inputs.value->dims[1];
+    shape.numKeys = inputs.value->dims[2];
+    shape.embedDims = inputs.value->dims[3];
+    shape.numQueries = inputs.location->dims[1];
+    shape.numLevels = inputs.location->dims[3];
+    shape.numPoints = inputs.location->dims[4];
+    uint64_t pointNum = shape.batchSize * shape.numQueries * shape.numHeads * shape.numLevels * shape.numPoints;
+    CHECK_RET(ElementNum(*inputs.location) == pointNum * 2 && ElementNum(*inputs.attnWeight) == pointNum &&
+              ElementNum(*inputs.spatialShapes) == static_cast<uint64_t>(shape.numLevels) * 2 &&
+              ElementNum(*inputs.levelStartIndex) == static_cast<uint64_t>(shape.numLevels),
+              LOG_PRINT("Inconsistent capture shapes\n"); return -1);
+    const msda_capture::CallAttrs &attrs = file.Attrs();
+    int64_t rows = shape.batchSize * shape.numQueries;
+    int64_t weightNum = shape.numHeads * shape.numLevels * shape.numPoints;
+    CHECK_RET(ResolveView(*inputs.location, rows, weightNum * 2, attrs.locationRowStride, attrs.locationOffset,
+                          shape.locationRowStride, shape.locationOffset) &&
+              ResolveView(*inputs.attnWeight, rows, weightNum, attrs.weightRowStride, attrs.weightOffset,
+                          shape.weightRowStride, shape.weightOffset),
+              LOG_PRINT("Captured row views exceed the recorded storage\n"); return -1);
+    return 0;
+}
+
+// (row, idx) of the point idx of row (b * Q + q) in the dense layout -> element of the recorded storage
+static uint64_t LocationIndex(const ReplayShape &shape, int64_t row, uint64_t idx) {
+    return shape.locationOffset + row * shape.locationRowStride + idx * 2;
+}
+
+static uint64_t WeightIndex(const ReplayShape &shape, int64_t row, uint64_t idx) {
+    return shape.weightOffset + row * shape.weightRowStride + idx;
+}
+
+// Out-of-range rate, attention weight sparsity and how much of the corner traffic the hottest 1% of the
+// value rows take, over the whole capture.
+static void PrintStatistics(const msda_capture::MappedFile &file, const ReplayInputs &inputs,
+                            const ReplayShape &shape) {
+    const int32_t *spatial = static_cast<const int32_t *>(file.Data(*inputs.spatialShapes));
+    const int32_t *levelStart = static_cast<const int32_t *>(file.Data(*inputs.levelStartIndex));
+    const float *location = static_cast<const float *>(file.Data(*inputs.location));
+    const float *attnWeight = static_cast<const float *>(file.Data(*inputs.attnWeight));
+
+    std::vector<uint64_t> keyHits(shape.numKeys, 0);
+    uint64_t pointNum = 0, outOfRange = 0, below1e3 = 0, below1e2 = 0, cornerNum = 0;
+    for (int64_t headRow = 0; headRow < shape.batchSize * shape.numQueries * shape.numHeads; headRow++) {
+        int64_t row = headRow / shape.numHeads;
+        int64_t head = headRow % shape.numHeads;
+        for (int64_t level = 0; level < shape.numLevels; level++) {
+            int32_t h = spatial[level * 2];
+            int32_t w = spatial[level * 2 + 1];
+            for (int64_t point = 0; point < shape.numPoints; point++) {
+                uint64_t idx = (head * shape.numLevels + level) * shape.numPoints + point;
+                float weight = attnWeight[WeightIndex(shape, row, idx)];
+                below1e3 += weight < 1e-3f ? 1 : 0;
+                below1e2 += weight < 1e-2f ? 1 : 0;
+                pointNum++;
+                // same corner convention as the kernels: (x1, y1) = floor(loc * size + 0.5), x0 = x1 - 1
+                const float *loc = &location[LocationIndex(shape, row, idx)];
+                int32_t x1 = static_cast<int32_t>(std::floor(loc[0] * w + 0.5f));
+                int32_t y1 = static_cast<int32_t>(std::floor(loc[1] * h + 0.5f));
+                if (x1 < 0 || x1 > w || y1 < 0 || y1 > h) {
+                    outOfRange++;
+                    continue;
+                }
+                for (int32_t y = y1 - 1; y <= y1; y++) {
+                    for (int32_t x = x1 - 1; x <= x1; x++) {
+                        if (0 <= x && x < w && 0 <= y && y < h) {
+                            keyHits[levelStart[level] + y * w + x]++;
+                            cornerNum++;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    std::sort(keyHits.begin(), keyHits.end(), [](uint64_t a, uint64_t b) { return a > b; });
+    size_t hotNum = std::max<size_t>(1, keyHits.size() / 100);
+    uint64_t hotCorners = 0;
+    for (size_t i = 0; i < hotNum; i++) {
+        hotCorners += keyHits[i];
+    }
+    LOG_PRINT("- shape: bs %lld, sources %lld, heads %lld, keys %lld, embed %lld, queries %lld, levels %lld, "
+              "points %lld\n", (long long)shape.batchSize, (long long)shape.numSources, (long long)shape.numHeads,
+              (long long)shape.numKeys, (long long)shape.embedDims, (long long)shape.numQueries,
+              (long long)shape.numLevels, (long long)shape.numPoints);
+    LOG_PRINT("- out-of-range points: %.2f%%\n", 100.0 * outOfRange / std::max<uint64_t>(pointNum, 1));
+    LOG_PRINT("- weights < 1e-3: %.2f%%, < 1e-2: %.2f%%\n", 100.0 * below1e3 / std::max<uint64_t>(pointNum, 1),
+              100.0 * below1e2 / std::max<uint64_t>(pointNum, 1));
+    LOG_PRINT("- corner reads on the hottest 1%% of keys: %.2f%%\n",
+              100.0 * hotCorners / std::max<uint64_t>(cornerNum, 1));
+}
+
+// Host reference of the forward op with the captured weight_threshold / renormalize_weights, output
+// (num_sources * bs, Q, num_heads * embed_dims) dense.
+static void ReferenceForward(const msda_capture::MappedFile &file, const ReplayInputs &inputs,
+                             const ReplayShape &shape, std::vector<float> &output) {
+    const msda_capture::CallAttrs &attrs = file.Attrs();
+    bool prune = attrs.weightThreshold > 0.0f;
+    const float *value = static_cast<const float *>(file.Data(*inputs.value));
+    const int32_t *spatial = static_cast<const int32_t *>(file.Data(*inputs.spatialShapes));
+    const int32_t *levelStart = static_cast<const int32_t *>(file.Data(*inputs.levelStartIndex));
+    const float *location = static_cast<const float *>(file.Data(*inputs.location));
+    const float *attnWeight = static_cast<const float *>(file.Data(*inputs.attnWeight));
+    int64_t embed = shape.embedDims;
+    int64_t valueBatch = shape.numSources * shape.batchSize;
+    output.assign(valueBatch * shape.numQueries * shape.numHeads * embed, 0.0f);
+    for (int64_t vb = 0; vb < valueBatch; vb++) {
+        // every source samples with the locations and weights of batch b
+        int64_t b = vb % shape.batchSize;
+        for (int64_t q = 0; q < shape.numQueries; q++) {
+            int64_t row = b * shape.numQueries + q;
+            for (int64_t head = 0; head < shape.numHeads; head++) {
+                float *out = &output[((vb * shape.numQueries + q) * shape.numHeads + head) * embed];
+                const float *headValue = value + (vb * shape.numHeads + head) * shape.numKeys * embed;
+                uint64_t headPoints = shape.numLevels * shape.numPoints;
+                // kept points: weight >= threshold when pruning; renormalizing divides by their sum
+                float headScale = 1.0f;
+                if (attrs.renormalizeWeights != 0) {
+                    float keptSum = 0.0f;
+                    for (uint64_t idx = head * headPoints; idx < (head + 1) * headPoints; idx++) {
+                        float weight = attnWeight[WeightIndex(shape, row, idx)];
+                        keptSum += (!prune || weight >= attrs.weightThreshold) ? weight : 0.0f;
+                    }
+                    headScale = keptSum > 0.0f ? 1.0f / keptSum : 0.0f;
+                }
+                for (int64_t level = 0; level < shape.numLevels; level++) {
+                    int32_t h = spatial[level * 2];
+                    int32_t w = spatial[level * 2 + 1];
+                    for (int64_t point = 0; point < shape.numPoints; point++) {
+                        uint64_t idx = (head * shape.numLevels + level) * shape.numPoints + point;
+                        float weight = attnWeight[WeightIndex(shape, row, idx)];
+                        if (prune && weight < attrs.weightThreshold) {
+                            continue;
+                        }
+                        weight *= headScale;
+                        const float *loc = &location[LocationIndex(shape, row, idx)];
+                        float x = loc[0] * w + 0.5f;
+                        float y = loc[1] * h + 0.5f;
+                        int32_t x1 = static_cast<int32_t>(std::floor(x));
+                        int32_t y1 = static_cast<int32_t>(std::floor(y));
+                        float fx = x - x1;
+                        float fy = y - y1;
+                        float cornerWeight[4] = {(1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy};
+                        int32_t cornerX[4] = {x1 - 1, x1, x1 - 1, x1};
+                        int32_t cornerY[4] = {y1 - 1, y1 - 1, y1, y1};
+                        for (int corner = 0; corner < 4; corner++) {
+                            if (cornerX[corner] < 0 || cornerX[corner] >= w || cornerY[corner] < 0 ||
+                                cornerY[corner] >= h) {
+                                continue;
+                            }
+                            float scale = weight * cornerWeight[corner];
+                            const float *row = headValue + (levelStart[level] + cornerY[corner] * w +
+                                                            cornerX[corner]) * embed;
+                            for (int64_t e = 0; e < embed; e++) {
+                                out[e] += scale * row[e];
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+static void PrintChecksum(const char *name, const std::vector<float> &data) {
+    double sum = 0, absSum = 0;
+    for (float v : data) {
+        sum += v;
+        absSum += std::fabs(v);
+    }
+    LOG_PRINT("- %s checksum: sum %.6e, abs sum %.6e\n", name, sum, absSum);
+}
+
+class NpuReplay {
+public:
+    ~NpuReplay() {
+        for (aclTensor *tensor : tensors) {
+            aclDestroyTensor(tensor);
+        }
+        for (void *buffer : buffers) {
+            aclrtFree(buffer);
+        }
+        if (workspace != nullptr) {
+            aclrtFree(workspace);
+        }
+        if (stream != nullptr) {
+            aclrtDestroyStream(stream);
+            aclrtResetDevice(0);
+        }
+        if (initialized) {
+            aclFinalize();
+        }
+    }
+
+    int Run(const msda_capture::MappedFile &file, const ReplayInputs &inputs, const ReplayShape &shape, int iters) {
+        CHECK_RET(aclInit(nullptr) == ACL_SUCCESS, LOG_PRINT("ACL init failed\n"); return -1);
+        initialized = true;
+        CHECK_RET(aclrtSetDevice(0) == ACL_SUCCESS, LOG_PRINT("SetDevice failed\n"); return -1);
+        CHECK_RET(aclrtCreateStream(&stream) == ACL_SUCCESS, LOG_PRINT("CreateStream failed\n"); return -1);
+
+        // inputs go straight from the mapping to the device
+        aclTensor *value = Upload(file, *inputs.value);
+        aclTensor *spatial = Upload(file, *inputs.spatialShapes);
+        aclTensor *levelStart = Upload(file, *inputs.levelStartIndex);
+        aclTensor *location = Upload(file, *inputs.location);
+        aclTensor *attn = Upload(file, *inputs.attnWeight);
+        const msda_capture::CallAttrs &attrs = file.Attrs();
+        // with an output row view, output is the (bs, Q, outputRowStride) buffer the rows are written into
+        int64_t rowNum = shape.numHeads * shape.embedDims;
+        std::vector<int64_t> outputShape = {shape.numSources * shape.batchSize, shape.numQueries,
+                                            attrs.outputRowStride > 0 ? attrs.outputRowStride : rowNum};
+        void *outputDevice = nullptr;
+        aclTensor *output = Allocate(outputShape, ACL_FLOAT, &outputDevice);
+        aclTensor *gradOutput = nullptr;
+        if (inputs.gradOutput != nullptr) {
+            gradOutput = Upload(file, *inputs.gradOutput);
+        } else {
+            std::vector<int64_t> gradOutputShape = {outputShape[0], outputShape[1],
+                attrs.gradOutputRowStride > 0 ? attrs.gradOutputRowStride : rowNum};
+            std::vector<float> ones(gradOutputShape[0] * gradOutputShape[1] * gradOutputShape[2], 1.0f);
+            void *gradOutputDevice = nullptr;
+            gradOutput = Allocate(gradOutputShape, ACL_FLOAT, &gradOutputDevice);
+            CHECK_RET(gradOutput != nullptr && aclrtMemcpy(gradOutputDevice, ones.size() * sizeof(float), ones.data(),
+                      ones.size() * sizeof(float), ACL_MEMCPY_HOST_TO_DEVICE) == ACL_SUCCESS, return -1);
+        }
+        std::vector<int64_t> valueShape(inputs.value->dims, inputs.value->dims + inputs.value->dimNum);
+        std::vector<int64_t> locationShape(inputs.location->dims, inputs.location->dims + inputs.location->dimNum);
+        std::vector<int64_t> attnShape(inputs.attnWeight->dims, inputs.attnWeight->dims + inputs.attnWeight->dimNum);
+        void *unused = nullptr;
+        aclTensor *gradValue = nullptr;
+        aclTensor *gradValueIndex = nullptr;
+        if (attrs.gradValueSparse != 0) {
+            // sparse_rows as documented for gradValueSparse
+            int64_t sparseRows = std::min(valueShape[0] * shape.numHeads * shape.numKeys,
+                                          4 * shape.batchSize * shape.numQueries * shape.numHeads *
+                                              shape.numLevels * shape.numPoints);
+            gradValue = Allocate({sparseRows, shape.embedDims}, ACL_FLOAT, &unused);
+            gradValueIndex = Allocate({sparseRows}, ACL_INT32, &unused);
+        } else {
+            gradValue = Allocate(valueShape, ACL_FLOAT, &unused);
+        }
+        aclTensor *gradLocation = Allocate(locationShape, ACL_FLOAT, &unused);
+        aclTensor *gradAttn = Allocate(attnShape, ACL_FLOAT, &unused);
+        CHECK_RET(value != nullptr && spatial != nullptr && levelStart != nullptr && location != nullptr &&
+                  attn != nullptr && output != nullptr && gradValue != nullptr && gradLocation != nullptr &&
+                  gradAttn != nullptr && (attrs.gradValueSparse == 0 || gradValueIndex != nullptr),
+                  LOG_PRINT("Device tensors failed\n"); return -1);
+
+        aclrtEvent start = nullptr, middle = nullptr, end = nullptr;
+        CHECK_RET(aclrtCreateEvent(&start) == ACL_SUCCESS && aclrtCreateEvent(&middle) == ACL_SUCCESS &&
+                  aclrtCreateEvent(&end) == ACL_SUCCESS, LOG_PRINT("CreateEvent failed\n"); return -1);
+        float forwardMs = 0, gradMs = 0;
+        int result = 0;
+        for (int iter = 0; iter < iters && result == 0; iter++) {
+            aclrtRecordEvent(start, stream);
+            result = Forward(attrs, value, spatial, levelStart, location, attn, output);
+            aclrtRecordEvent(middle, stream);
+            if (result == 0) {
+                result = Backward(attrs, value, spatial, levelStart, location, attn, gradOutput, gradValue,
+                                  gradLocation, gradAttn, gradValueIndex);
+            }
+            aclrtRecordEvent(end, stream);
+            if (result == 0 && aclrtSynchronizeStream(stream) != ACL_SUCCESS) {
+                LOG_PRINT("Sync failed\n");
+                result = -1;
+            }
+            float ms = 0;
+            aclrtEventElapsedTime(&ms, start, middle);
+            forwardMs += ms;
+            aclrtEventElapsedTime(&ms, middle, end);
+            gradMs += ms;
+        }
+        aclrtDestroyEvent(start);
+        aclrtDestroyEvent(middle);
+        aclrtDestroyEvent(end);
+        CHECK_RET(result == 0, return -1);
+        LOG_PRINT("- npu forward: %.3f ms, backward: %.3f ms (mean of %d)\n", forwardMs / iters, gradMs / iters,
+                  iters);
+
+        std::vector<float> bufferHost(outputShape[0] * outputShape[1] * outputShape[2]);
+        CHECK_RET(aclrtMemcpy(bufferHost.data(), bufferHost.size() * sizeof(float), outputDevice,
+                  bufferHost.size() * sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST) == ACL_SUCCESS,
+                  LOG_PRINT("Memcpy output failed\n"); return -1);
+        // only the view rows, dense, so the checksum compares with the cpu reference
+        std::vector<float> outputHost;
+        for (int64_t row = 0; row < outputShape[0] * outputShape[1]; row++) {
+            const float *begin = bufferHost.data() + attrs.outputOffset + row * outputShape[2];
+            outputHost.insert(outputHost.end(), begin, begin + rowNum);
+        }
+        PrintChecksum("npu output", outputHost);
+        return 0;
+    }
+
+private:
+    int Forward(const msda_capture::CallAttrs &attrs, aclTensor *value, aclTensor *spatial, aclTensor *levelStart,
+                aclTensor *location, aclTensor *attn, aclTensor *output) {
+        uint64_t size = 0;
+        aclOpExecutor *executor = nullptr;
+        auto ret = aclnnMultiScaleDeformableAttnFuncV2GetWorkspaceSize(
+            value, spatial, levelStart, location, attn, nullptr, nullptr, attrs.outputRowStride, attrs.outputOffset,
+            attrs.weightThreshold, attrs.renormalizeWeights != 0, attrs.locationRowStride, attrs.locationOffset,
+            attrs.weightRowStride, attrs.weightOffset, output, nullptr, &size, &executor);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward GetWorkspaceSize failed\n"); return -1);
+        CHECK_RET(ReserveWorkspace(size) == 0, return -1);
+        ret = aclnnMultiScaleDeformableAttnFuncV2(workspace, size, executor, stream);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward failed\n"); return -1);
+        return 0;
+    }
+
+    int Backward(const msda_capture::CallAttrs &attrs, aclTensor *value, aclTensor *spatial, aclTensor *levelStart,
+                 aclTensor *location, aclTensor *attn, aclTensor *gradOutput, aclTensor *gradValue,
+                 aclTensor *gradLocation, aclTensor *gradAttn, aclTensor *gradValueIndex) {
+        bool outputMaskHost[3] = {attrs.outputMask[0] != 0, attrs.outputMask[1] != 0, attrs.outputMask[2] != 0};
+        aclBoolArray *outputMask = aclCreateBoolArray(outputMaskHost, 3);
+        CHECK_RET(outputMask != nullptr, LOG_PRINT("Create outputMask failed\n"); return -1);
+        uint64_t size = 0;
+        aclOpExecutor *executor = nullptr;
+        auto ret = aclnnMultiScaleDeformableAttnGradV2GetWorkspaceSize(
+            value, spatial, levelStart, location, attn, gradOutput, outputMask, attrs.gradOutputRowStride,
+            attrs.gradOutputOffset, attrs.locationRowStride, attrs.locationOffset, attrs.weightRowStride,
+            attrs.weightOffset, attrs.gradValueSparse != 0, gradValue, gradLocation, gradAttn, gradValueIndex, &size,
+            &executor);
+        aclDestroyBoolArray(outputMask);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Grad GetWorkspaceSize failed\n"); return -1);
+        CHECK_RET(ReserveWorkspace(size) == 0, return -1);
+        ret = aclnnMultiScaleDeformableAttnGradV2(workspace, size, executor, stream);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Gradient failed\n"); return -1);
+        return 0;
+    }
+
+    // Dense device tensor of shape; storageNum > 0 backs it with that many elements of storage instead, for an
+    // input recorded as the storage of a row view.
+    aclTensor *Allocate(const std::vector<int64_t> &shape, aclDataType dataType, void **deviceAddr,
+                        int64_t storageNum = 0) {
+        size_t size = aclDataTypeSize(dataType);
+        for (int64_t d : shape) {
+            size *= d;
+        }
+        std::vector<int64_t> storageShape = shape;
+        if (storageNum > 0) {
+            size = aclDataTypeSize(dataType) * storageNum;
+            storageShape = {storageNum};
+        }
+        CHECK_RET(aclrtMalloc(deviceAddr, std::max<size_t>(size, 1), ACL_MEM_MALLOC_HUGE_FIRST) == ACL_SUCCESS,
+                  return nullptr);
+        buffers.push_back(*deviceAddr);
+        std::vector<int64_t> strides(shape.size(), 1);
+        for (int64_t i = static_cast<int64_t>(shape.size()) - 2; i >= 0; --i) {
+            strides[i] = shape[i + 1] * strides[i + 1];
+        }
+        aclTensor *tensor = aclCreateTensor(shape.data(), shape.size(), dataType, strides.data(), 0, ACL_FORMAT_ND,
+                                            storageShape.data(), storageShape.size(), *deviceAddr);
+        if (tensor != nullptr) {
+            tensors.push_back(tensor);
+        }
+        return tensor;
+    }
+
+    aclTensor *Upload(const msda_capture::MappedFile &file, const msda_capture::TensorRecord &record) {
+        std::vector<int64_t> shape(record.dims, record.dims + record.dimNum);
+        void *deviceAddr = nullptr;
+        size_t elementBytes = aclDataTypeSize(static_cast<aclDataType>(record.dtype));
+        int64_t storageNum = record.bytes / elementBytes != ElementNum(record) ? record.bytes / elementBytes : 0;
+        aclTensor *tensor = Allocate(shape, static_cast<aclDataType>(record.dtype), &deviceAddr, storageNum);
+        CHECK_RET(tensor != nullptr && aclrtMemcpy(deviceAddr, record.bytes, file.Data(record), record.bytes,
+                  ACL_MEMCPY_HOST_TO_DEVICE) == ACL_SUCCESS, LOG_PRINT("Upload %s failed\n", record.name);
+                  return nullptr);
+        return tensor;
+    }
+
+    int ReserveWorkspace(uint64_t size) {
+        if (size <= workspaceCapacity) {
+            return 0;
+        }
+        if (workspace != nullptr) {
+            CHECK_RET(aclrtSynchronizeStream(stream) == ACL_SUCCESS, return -1);
+            aclrtFree(workspace);
+            workspace = nullptr;
+        }
+        CHECK_RET(aclrtMalloc(&workspace, size, ACL_MEM_MALLOC_HUGE_FIRST) == ACL_SUCCESS,
+                  workspaceCapacity = 0; return -1);
+        workspaceCapacity = size;
+        return 0;
+    }
+
+    bool initialized = false;
+    aclrtStream stream = nullptr;
+    void *workspace = nullptr;
+    uint64_t workspaceCapacity = 0;
+    std::vector<void *> buffers;
+    std::vector<aclTensor *> tensors;
+};
+
+int main(int argc, char **argv) {
+    CHECK_RET(argc >= 2, LOG_PRINT("usage: %s <file.msdacap> [--iters N] [--cpu]\n", argv[0]); return -1);
+    int iters = 20;
+    bool cpu = false;
+    for (int i = 2; i < argc; i++) {
+        if (std::strcmp(argv[i], "--cpu") == 0) {
+            cpu = true;
+        } else if (std::strcmp(argv[i], "--iters") == 0 && i + 1 < argc) {
+            iters = std::max(1, std::atoi(argv[++i]));
+        }
+    }
+
+    msda_capture::MappedFile file;
+    CHECK_RET(file.Open(argv[1]), LOG_PRINT("Cannot map capture %s\n", argv[1]); return -1);
+    ReplayInputs inputs;
+    ReplayShape shape;
+    CHECK_RET(LoadInputs(file, inputs, shape) == 0, return -1);
+    PrintStatistics(file, inputs, shape);
+
+    if (cpu) {
+        std::vector<float> output;
+        auto begin = std::chrono::steady_clock::now();
+        ReferenceForward(file, inputs, shape, output);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+        LOG_PRINT("- cpu reference forward: %.3f ms\n", ms);
+        PrintChecksum("cpu output", output);
+        return 0;
+    }
+    NpuReplay replay;
+    return replay.Run(file, inputs, shape, iters);
+}
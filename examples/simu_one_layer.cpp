@@ -1,9 +1,15 @@
 #include <iostream>
 #include <vector>
 #include <random>
+#include <string>
 #include <acl/acl.h>
+#include "aclnnop/aclnn_add.h"
+#include "aclnnop/aclnn_mse_loss.h"
+#include "aclnnop/aclnn_mse_loss_backward.h"
 #include "aclnn_multi_scale_deformable_attn_func_v2.h"
 #include "aclnn_multi_scale_deformable_attn_grad_v2.h"
+#include "multi_scale_deformable_attn_v2_capture.h"
+#include "multi_scale_deformable_attn_v2_trace.h"
 
 #define CHECK_RET(cond, return_expr) do { if (!(cond)) { return_expr; } } while (0)
 #define LOG_PRINT(msg, ...) do { printf(msg, ##__VA_ARGS__); fflush(stdout); } while (0)
@@ -20,6 +26,7 @@ public:
         attnWeightShape  = {batchSize, numQueries, numLevels, 1, numPoints};
         outputShape      = {batchSize, numQueries, embedDims};
         levelStartIndexShape = {1};
+        lossShape        = {};
 
         CHECK_RET(aclInit(nullptr) == ACL_SUCCESS, throw std::runtime_error("ACL init failed\n"); );
         CHECK_RET(aclrtSetDevice(GetDeviceZero()) == ACL_SUCCESS, throw std::runtime_error("SetDevice failed\n"); );
@@ -67,7 +74,9 @@ public:
         gradLocationHost.resize(GetShapeSize(locationShape), 0.0f);
         gradAttnHost.resize(GetShapeSize(attnWeightShape), 0.0f);
         targetHost.resize(GetShapeSize(outputShape));
-        
+        lossHost.resize(1, 0.0f);
+        lossGradHost.resize(1, 1.0f);
+
         std::mt19937 gen(102); 
         std::uniform_real_distribution<float> val_dist(-1.0f, 1.0f);
         std::uniform_real_distribution<float> attn_dist(0.1f, 1.0f);
@@ -88,89 +97,214 @@ public:
         for(auto &t : targetHost) t = val_dist(gen);
     }
 
-    int ForwardComputation() {
+    // Every tensor of the training step lives on the device for the whole run; nothing is copied per step.
+    int AllocateDeviceTensors() {
         CHECK_RET(CreateAclTensor("value", valueHost, valueShape, &valueDevice, ACL_FLOAT, &value)==ACL_SUCCESS, return -1);
         CHECK_RET(CreateAclTensor("spatialShapes", spatialShapeHost, spatialShapeShape, &spatialDevice, ACL_INT32, &spatial)==ACL_SUCCESS, return -1);
         CHECK_RET(CreateAclTensor("levelStartIndex", levelStartIndexHost, levelStartIndexShape, &levelStartDevice, ACL_INT32, &levelStart)==ACL_SUCCESS, return -1);
         CHECK_RET(CreateAclTensor("samplingLocations", locationHost, locationShape, &locationDevice, ACL_FLOAT, &location)==ACL_SUCCESS, return -1);
         CHECK_RET(CreateAclTensor("attentionWeights", attnWeightHost, attnWeightShape, &attnDevice, ACL_FLOAT, &attn)==ACL_SUCCESS, return -1);
         CHECK_RET(CreateAclTensor("output", outputHost, outputShape, &outputDevice, ACL_FLOAT, &output)==ACL_SUCCESS, return -1);
+        CHECK_RET(CreateAclTensor("target", targetHost, outputShape, &targetDevice, ACL_FLOAT, &target)==ACL_SUCCESS, return -1);
+        CHECK_RET(CreateAclTensor("loss", lossHost, lossShape, &lossDevice, ACL_FLOAT, &loss)==ACL_SUCCESS, return -1);
+        CHECK_RET(CreateAclTensor("lossGrad", lossGradHost, lossShape, &lossGradDevice, ACL_FLOAT, &lossGrad)==ACL_SUCCESS, return -1);
+        CHECK_RET(CreateAclTensor("gradOutput", gradOutputHost, outputShape, &gradOutputDevice, ACL_FLOAT, &gradOutput)==ACL_SUCCESS, return -1);
+        CHECK_RET(CreateAclTensor("gradValue", gradValueHost, valueShape, &gradValueDevice, ACL_FLOAT, &gradValue)==ACL_SUCCESS, return -1);
+        CHECK_RET(CreateAclTensor("gradLocation", gradLocationHost, locationShape, &gradLocationDevice, ACL_FLOAT, &gradLocation)==ACL_SUCCESS, return -1);
+        CHECK_RET(CreateAclTensor("gradAttn", gradAttnHost, attnWeightShape, &gradAttnDevice, ACL_FLOAT, &gradAttn)==ACL_SUCCESS, return -1);
+        return 0;
+    }
 
-        auto ret = aclnnMultiScaleDeformableAttnFuncV2GetWorkspaceSize(value, spatial, levelStart, location, attn, output, &workspaceSize, &executor);
-        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward GetWorkspaceSize failed\n"); return -1);
-
-        if(workspaceSize>0){
-            aclrtMalloc(&workspace, workspaceSize, ACL_MEM_MALLOC_HUGE_FIRST);
-            CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward workspace malloc failed\n"); return -1);
+    // One training step, all of it queued on the stream: forward, MSE loss gradient, backward, SGD update.
+    // With readLoss the loss is computed as well and read back, the only sync and host copy of the step.
+    int TrainStep(float lr, bool readLoss) {
+        msda_trace::Scope stepTrace("TrainStep");
+        CHECK_RET(ForwardComputation() == 0, return -1);
+        if (readLoss) {
+            CHECK_RET(LossComputation() == 0, return -1);
+        }
+        CHECK_RET(GradientComputation() == 0, return -1);
+        CHECK_RET(UpdateParameter(lr) == 0, return -1);
+        if (readLoss) {
+            msda_trace::Scope trace("LossSync");
+            auto ret = aclrtSynchronizeStream(stream);
+            CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Step sync failed\n"); return -1);
+            ret = aclrtMemcpy(lossHost.data(), sizeof(float), lossDevice, sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+            CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Memcpy loss failed\n"); return -1);
         }
+        return 0;
+    }
 
-        ret = aclnnMultiScaleDeformableAttnFuncV2(workspace, workspaceSize, executor, stream);
-        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward failed\n"); return -1);
+    float LastLoss() const {
+        return lossHost[0];
+    }
 
-        ret = aclrtSynchronizeStream(stream);
-        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward sync failed\n"); return -1);
+    int ForwardComputation() {
+        // MSDA_TRACE=<prefix> records each stage below (and the op's tiling choice) as Chrome trace events
+        aclnnStatus ret;
+        {
+            msda_trace::Scope trace("FuncV2GetWorkspaceSize");
+            // outputRowStride / outputOffset: 0 / 0 writes output densely; a wider stride writes its rows into a slice of a larger buffer
+            ret = aclnnMultiScaleDeformableAttnFuncV2GetWorkspaceSize(
+                value, spatial, levelStart, location, attn, nullptr, nullptr, callAttrs.outputRowStride,
+                callAttrs.outputOffset, callAttrs.weightThreshold, callAttrs.renormalizeWeights != 0,
+                callAttrs.locationRowStride, callAttrs.locationOffset, callAttrs.weightRowStride,
+                callAttrs.weightOffset, output, nullptr, &workspaceSize, &executor);
+            trace.Args("\"value\":%s,\"location\":%s,\"workspace\":%llu", ShapeToJson(valueShape).c_str(),
+                       ShapeToJson(locationShape).c_str(), (unsigned long long)workspaceSize);
+        }
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward GetWorkspaceSize failed\n"); return -1);
+        CHECK_RET(ReserveWorkspace(workspaceSize) == 0, return -1);
 
-        ret = aclrtMemcpy(outputHost.data(), GetShapeSize(outputShape)*sizeof(float), outputDevice, GetShapeSize(outputShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
-        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Memcpy forward output failed\n"); return -1);
+        {
+            msda_trace::Scope trace("FuncV2Launch");
+            ret = aclnnMultiScaleDeformableAttnFuncV2(workspace, workspaceSize, executor, stream);
+        }
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Forward failed\n"); return -1);
+        return 0;
+    }
 
-        LOG_PRINT("* Forward Computation Done. \n");
-        PrintTensor("  Forward Output ", outputHost);
+    // mean((output - target)^2) into the device scalar loss, only queued on logging steps
+    int LossComputation() {
+        uint64_t lossWorkspaceSize = 0;
+        aclOpExecutor *lossExecutor = nullptr;
+        auto ret = aclnnMseLossGetWorkspaceSize(output, target, MSE_REDUCTION_MEAN, loss, &lossWorkspaceSize, &lossExecutor);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("MseLoss GetWorkspaceSize failed\n"); return -1);
+        CHECK_RET(ReserveWorkspace(lossWorkspaceSize) == 0, return -1);
+        ret = aclnnMseLoss(workspace, lossWorkspaceSize, lossExecutor, stream);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("MseLoss failed\n"); return -1);
         return 0;
     }
 
     int GradientComputation() {
-        // MSE Loss Gradient
-        float loss = 0.0f;
-        for (size_t i=0; i<outputHost.size(); ++i) {
-            float diff = outputHost[i] - targetHost[i];
-            loss += diff * diff;
+        // d(mean MSE)/d(output) = 2 * (output - target) / N, with the upstream gradient lossGrad = 1
+        uint64_t lossWorkspaceSize = 0;
+        aclOpExecutor *lossExecutor = nullptr;
+        auto ret = aclnnMseLossBackwardGetWorkspaceSize(lossGrad, output, target, MSE_REDUCTION_MEAN, gradOutput, &lossWorkspaceSize, &lossExecutor);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("MseLossBackward GetWorkspaceSize failed\n"); return -1);
+        CHECK_RET(ReserveWorkspace(lossWorkspaceSize) == 0, return -1);
+        ret = aclnnMseLossBackward(workspace, lossWorkspaceSize, lossExecutor, stream);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("MseLossBackward failed\n"); return -1);
+
+        // {grad_value, grad_sampling_loc, grad_attn_weight}: clear an entry of callAttrs.outputMask to skip that output
+        bool outputMaskHost[3] = {callAttrs.outputMask[0] != 0, callAttrs.outputMask[1] != 0,
+                                  callAttrs.outputMask[2] != 0};
+        aclBoolArray *outputMask = aclCreateBoolArray(outputMaskHost, 3);
+        CHECK_RET(outputMask != nullptr, LOG_PRINT("Create outputMask failed\n"); return -1);
+
+        CHECK_RET(CaptureInputs() == 0, aclDestroyBoolArray(outputMask); return -1);
+        {
+            msda_trace::Scope trace("GradV2GetWorkspaceSize");
+            ret = aclnnMultiScaleDeformableAttnGradV2GetWorkspaceSize(
+                value, spatial, levelStart, location, attn, gradOutput, outputMask, callAttrs.gradOutputRowStride,
+                callAttrs.gradOutputOffset, callAttrs.locationRowStride, callAttrs.locationOffset,
+                callAttrs.weightRowStride, callAttrs.weightOffset, callAttrs.gradValueSparse != 0, gradValue,
+                gradLocation, gradAttn, nullptr, &gradWorkspaceSize, &gradExecutor);
+            trace.Args("\"value\":%s,\"location\":%s,\"workspace\":%llu", ShapeToJson(valueShape).c_str(),
+                       ShapeToJson(locationShape).c_str(), (unsigned long long)gradWorkspaceSize);
         }
-        loss /= outputHost.size();
-        LOG_PRINT("* MSE Loss: %f\n", loss);
-        for(size_t i=0;i<outputHost.size();++i)
-            gradOutputHost[i] = 2.0f*(outputHost[i]-targetHost[i])/outputHost.size();
-
-        CHECK_RET(CreateAclTensor("gradOutput", gradOutputHost, outputShape, &gradOutputDevice, ACL_FLOAT, &gradOutput)==ACL_SUCCESS, return -1);
-        CHECK_RET(CreateAclTensor("gradValue", gradValueHost, valueShape, &gradValueDevice, ACL_FLOAT, &gradValue)==ACL_SUCCESS, return -1);
-        CHECK_RET(CreateAclTensor("gradLocation", gradLocationHost, locationShape, &gradLocationDevice, ACL_FLOAT, &gradLocation)==ACL_SUCCESS, return -1);
-        CHECK_RET(CreateAclTensor("gradAttn", gradAttnHost, attnWeightShape, &gradAttnDevice, ACL_FLOAT, &gradAttn)==ACL_SUCCESS, return -1);
-
-        auto ret = aclrtMemcpy(gradOutputDevice, GetShapeSize(outputShape)*sizeof(float), gradOutputHost.data(), GetShapeSize(outputShape)*sizeof(float), ACL_MEMCPY_HOST_TO_DEVICE);
-        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Memcpy gradOutput failed\n"); return -1);
-
-        ret = aclnnMultiScaleDeformableAttnGradV2GetWorkspaceSize( value, spatial, levelStart, location, attn, gradOutput, gradValue, gradLocation, gradAttn, &gradWorkspaceSize, &gradExecutor);
+        aclDestroyBoolArray(outputMask);
         CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Grad GetWorkspaceSize failed\n"); return -1);
+        CHECK_RET(ReserveWorkspace(gradWorkspaceSize) == 0, return -1);
 
-        if(gradWorkspaceSize>0) {
-            ret = aclrtMalloc(&gradWorkspace, gradWorkspaceSize, ACL_MEM_MALLOC_HUGE_FIRST);
-            CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Grad workspace malloc failed\n"); return -1);
+        {
+            msda_trace::Scope trace("GradV2Launch");
+            ret = aclnnMultiScaleDeformableAttnGradV2(workspace, gradWorkspaceSize, gradExecutor, stream);
         }
-
-        ret = aclnnMultiScaleDeformableAttnGradV2(gradWorkspace, gradWorkspaceSize, gradExecutor, stream);
         CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Gradient failed\n"); return -1);
+        return 0;
+    }
 
-        ret = aclrtSynchronizeStream(stream);
-        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Gradient sync failed\n"); return -1);
+    // MSDA_CAPTURE=<prefix> writes the grad op inputs of the first MSDA_CAPTURE_CALLS steps (a superset of the
+    // forward inputs) and callAttrs for examples/msda_replay; otherwise this is one branch per step.
+    int CaptureInputs() {
+        uint32_t seq = 0;
+        if (!msda_capture::Claim(&seq)) {
+            return 0;
+        }
+        msda_trace::Scope trace("Capture");
+        CHECK_RET(aclrtSynchronizeStream(stream) == ACL_SUCCESS, LOG_PRINT("Capture sync failed\n"); return -1);
+        std::vector<float> valueCopy, locationCopy, attnCopy, gradOutputCopy;
+        CHECK_RET(CopyToHost(valueDevice, valueShape, valueCopy) == ACL_SUCCESS &&
+                  CopyToHost(locationDevice, locationShape, locationCopy) == ACL_SUCCESS &&
+                  CopyToHost(attnDevice, attnWeightShape, attnCopy) == ACL_SUCCESS &&
+                  CopyToHost(gradOutputDevice, outputShape, gradOutputCopy) == ACL_SUCCESS,
+                  LOG_PRINT("Capture memcpy failed\n"); return -1);
+        msda_capture::TensorView views[] = {
+            {"value", msda_capture::CAPTURE_DT_FLOAT, (uint32_t)valueShape.size(), valueShape.data(),
+             valueCopy.data(), valueCopy.size() * sizeof(float)},
+            {"value_spatial_shapes", msda_capture::CAPTURE_DT_INT32, (uint32_t)spatialShapeShape.size(),
+             spatialShapeShape.data(), spatialShapeHost.data(), spatialShapeHost.size() * sizeof(int32_t)},
+            {"value_level_start_index", msda_capture::CAPTURE_DT_INT32, (uint32_t)levelStartIndexShape.size(),
+             levelStartIndexShape.data(), levelStartIndexHost.data(), levelStartIndexHost.size() * sizeof(int32_t)},
+            {"sampling_locations", msda_capture::CAPTURE_DT_FLOAT, (uint32_t)locationShape.size(),
+             locationShape.data(), locationCopy.data(), locationCopy.size() * sizeof(float)},
+            {"attention_weights", msda_capture::CAPTURE_DT_FLOAT, (uint32_t)attnWeightShape.size(),
+             attnWeightShape.data(), attnCopy.data(), attnCopy.size() * sizeof(float)},
+            {"grad_output", msda_capture::CAPTURE_DT_FLOAT, (uint32_t)outputShape.size(), outputShape.data(),
+             gradOutputCopy.data(), gradOutputCopy.size() * sizeof(float)},
+        };
+        CHECK_RET(msda_capture::Write(seq, callAttrs, views, sizeof(views) / sizeof(views[0])),
+                  LOG_PRINT("Capture write failed\n"); return -1);
+        return 0;
+    }
 
-        ret = aclrtMemcpy(gradValueHost.data(), GetShapeSize(valueShape)*sizeof(float), gradValueDevice, GetShapeSize(valueShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+    aclError CopyToHost(const void *deviceAddr, const std::vector<int64_t> &shape, std::vector<float> &host) {
+        host.resize(GetShapeSize(shape));
+        return aclrtMemcpy(host.data(), host.size() * sizeof(float), deviceAddr, host.size() * sizeof(float),
+                           ACL_MEMCPY_DEVICE_TO_HOST);
+    }
 
-        ret |= aclrtMemcpy(gradLocationHost.data(), GetShapeSize(locationShape)*sizeof(float), gradLocationDevice, GetShapeSize(locationShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+    // SGD in place on the device: param += (-lr) * grad
+    int UpdateParameter(float lr=0.01f){
+        float alphaValue = -lr;
+        aclScalar *alpha = aclCreateScalar(&alphaValue, ACL_FLOAT);
+        CHECK_RET(alpha != nullptr, LOG_PRINT("Create lr scalar failed\n"); return -1);
+        aclTensor *params[3] = {value, location, attn};
+        aclTensor *grads[3] = {gradValue, gradLocation, gradAttn};
+        int result = 0;
+        for (int i = 0; i < 3 && result == 0; ++i) {
+            result = InplaceSgd(params[i], grads[i], alpha);
+        }
+        aclDestroyScalar(alpha);
+        return result;
+    }
 
-        ret |= aclrtMemcpy(gradAttnHost.data(), GetShapeSize(attnWeightShape)*sizeof(float), gradAttnDevice, GetShapeSize(attnWeightShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+    int InplaceSgd(aclTensor *param, const aclTensor *grad, const aclScalar *alpha) {
+        uint64_t updateWorkspaceSize = 0;
+        aclOpExecutor *updateExecutor = nullptr;
+        auto ret = aclnnInplaceAddGetWorkspaceSize(param, grad, alpha, &updateWorkspaceSize, &updateExecutor);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("InplaceAdd GetWorkspaceSize failed\n"); return -1);
+        CHECK_RET(ReserveWorkspace(updateWorkspaceSize) == 0, return -1);
+        ret = aclnnInplaceAdd(workspace, updateWorkspaceSize, updateExecutor, stream);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("InplaceAdd failed\n"); return -1);
+        return 0;
+    }
 
-        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Memcpy backward output failed\n"); return -1);
+    // Copies the final output and gradients to the host once, after the last step.
+    int PrintResults() {
+        auto ret = aclrtSynchronizeStream(stream);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Final sync failed\n"); return -1);
+        ret = aclrtMemcpy(outputHost.data(), GetShapeSize(outputShape)*sizeof(float), outputDevice, GetShapeSize(outputShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+        ret |= aclrtMemcpy(gradValueHost.data(), GetShapeSize(valueShape)*sizeof(float), gradValueDevice, GetShapeSize(valueShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+        ret |= aclrtMemcpy(gradLocationHost.data(), GetShapeSize(locationShape)*sizeof(float), gradLocationDevice, GetShapeSize(locationShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+        ret |= aclrtMemcpy(gradAttnHost.data(), GetShapeSize(attnWeightShape)*sizeof(float), gradAttnDevice, GetShapeSize(attnWeightShape)*sizeof(float), ACL_MEMCPY_DEVICE_TO_HOST);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Memcpy results failed\n"); return -1);
 
-        LOG_PRINT("* Gradient Computation Done. \n");
+        PrintTensor("  Forward Output ", outputHost);
         PrintTensor("  Grad Value", gradValueHost);
         PrintTensor("  Grad Location", gradLocationHost);
         PrintTensor("  Grad Attention", gradAttnHost);
         return 0;
     }
 
-    void UpdateParameter(float lr=0.01f){
-        for(size_t i=0;i<valueHost.size();++i) valueHost[i] -= lr*gradValueHost[i];
-        for(size_t i=0;i<locationHost.size();++i) locationHost[i] -= lr*gradLocationHost[i];
-        for(size_t i=0;i<attnWeightHost.size();++i) attnWeightHost[i] -= lr*gradAttnHost[i];
+    std::string ShapeToJson(const std::vector<int64_t> &shape) {
+        std::string json = "[";
+        for (size_t i=0; i<shape.size(); ++i) {
+            json += std::to_string(shape[i]);
+            if (i != shape.size()-1) json += ",";
+        }
+        return json + "]";
     }
 
     template <typename T>
@@ -186,6 +320,26 @@ public:
     }
 
 private:
+    static const int64_t MSE_REDUCTION_MEAN = 1;
+
+    // All ops run in order on one stream, so they share a single workspace that only ever grows. Growing it
+    // waits for the queued ops that may still use the old buffer.
+    int ReserveWorkspace(uint64_t size) {
+        if (size <= workspaceCapacity) {
+            return 0;
+        }
+        msda_trace::Scope trace("WorkspaceMalloc");
+        if (workspace != nullptr) {
+            CHECK_RET(aclrtSynchronizeStream(stream) == ACL_SUCCESS, LOG_PRINT("Workspace sync failed\n"); return -1);
+            aclrtFree(workspace);
+            workspace = nullptr;
+        }
+        auto ret = aclrtMalloc(&workspace, size, ACL_MEM_MALLOC_HUGE_FIRST);
+        CHECK_RET(ret == ACL_SUCCESS, LOG_PRINT("Workspace malloc failed\n"); workspaceCapacity = 0; return -1);
+        workspaceCapacity = size;
+        return 0;
+    }
+
     template<typename T>
     aclError CreateAclTensor(const std::string &name, std::vector<T> &hostData, const std::vector<int64_t> &shape, void **deviceAddr, aclDataType dataType, aclTensor **tensor){
         size_t size = GetShapeSize(shape)*sizeof(T);
@@ -214,6 +368,9 @@ private:
         aclDestroyTensor(location); 
         aclDestroyTensor(attn); 
         aclDestroyTensor(output);
+        aclDestroyTensor(target);
+        aclDestroyTensor(loss);
+        aclDestroyTensor(lossGrad);
         aclDestroyTensor(gradOutput); 
         aclDestroyTensor(gradValue); 
         aclDestroyTensor(gradLocation); 
@@ -224,50 +381,61 @@ private:
         aclrtFree(locationDevice); 
         aclrtFree(attnDevice); 
         aclrtFree(outputDevice);
+        aclrtFree(targetDevice);
+        aclrtFree(lossDevice);
+        aclrtFree(lossGradDevice);
         aclrtFree(gradOutputDevice); 
         aclrtFree(gradValueDevice); 
         aclrtFree(gradLocationDevice); 
         aclrtFree(gradAttnDevice);
         if(workspace) aclrtFree(workspace); 
-        if(gradWorkspace) aclrtFree(gradWorkspace);
     }
 
 private:
     int batchSize, numHeads, mapHeight, mapWidth, numKeys, embedDims, numQueries, numLevels, numPoints;
-    std::vector<int64_t> valueShape, spatialShapeShape, locationShape, attnWeightShape, outputShape, levelStartIndexShape;
+    std::vector<int64_t> valueShape, spatialShapeShape, locationShape, attnWeightShape, outputShape, levelStartIndexShape, lossShape;
     std::vector<int32_t> spatialShapeHost, levelStartIndexHost;
     std::vector<float> valueHost, attnWeightHost, locationHost, outputHost;
-    std::vector<float> gradOutputHost, gradValueHost, gradLocationHost, gradAttnHost, targetHost;
+    std::vector<float> gradOutputHost, gradValueHost, gradLocationHost, gradAttnHost, targetHost, lossHost, lossGradHost;
 
     void *valueDevice=nullptr, *spatialDevice=nullptr, *levelStartDevice=nullptr;
     void *locationDevice=nullptr, *attnDevice=nullptr, *outputDevice=nullptr, *workspace=nullptr;
 
     aclTensor *value=nullptr, *spatial=nullptr, *levelStart=nullptr, *location=nullptr, *attn=nullptr, *output=nullptr;
-    uint64_t workspaceSize=0; 
+    uint64_t workspaceSize=0, workspaceCapacity=0; 
     aclOpExecutor* executor=nullptr; 
 
     void *gradOutputDevice=nullptr, *gradValueDevice=nullptr, *gradLocationDevice=nullptr; 
-    void *gradAttnDevice=nullptr, *gradWorkspace=nullptr;
+    void *gradAttnDevice=nullptr;
+    void *targetDevice=nullptr, *lossDevice=nullptr, *lossGradDevice=nullptr;
+    aclTensor *target=nullptr, *loss=nullptr, *lossGrad=nullptr;
     aclTensor *gradOutput=nullptr, *gradValue=nullptr, *gradLocation=nullptr, *gradAttn=nullptr;
     uint64_t gradWorkspaceSize=0; 
     aclOpExecutor* gradExecutor=nullptr; 
 
     aclrtStream stream=nullptr;
+    // the attrs of both op calls, recorded with a capture so the replay makes the same calls
+    msda_capture::CallAttrs callAttrs = msda_capture::DefaultAttrs();
 };
 
 int main(){
     try {
         MultiScaleDeformableAttnV2Simu msda_v2_simu(1,1,8,8,8,32,1,4);
         int epochs = 5; //100000;
+        // steps between loss readbacks, the only host round trips of the loop; the other steps stay on the device
+        int logInterval = epochs;
         float lr = 0.01f;
         msda_v2_simu.InitializeData(); 
+        CHECK_RET(msda_v2_simu.AllocateDeviceTensors() == 0, return -1);
         for(int e=0;e<epochs;++e){
-            LOG_PRINT("\n!!!! Epoch %d !!!!\n", e+1);
-            msda_v2_simu.ForwardComputation();
-            msda_v2_simu.GradientComputation();
-            msda_v2_simu.UpdateParameter(lr);
+            bool readLoss = (e + 1) % logInterval == 0 || e + 1 == epochs;
+            CHECK_RET(msda_v2_simu.TrainStep(lr, readLoss) == 0, LOG_PRINT("Epoch %d failed\n", e+1); return -1);
+            if (readLoss) {
+                LOG_PRINT("!!!! Epoch %d  MSE Loss: %f\n", e+1, msda_v2_simu.LastLoss());
+            }
         }
-        return 0;
+        LOG_PRINT("* Training Done. \n");
+        return msda_v2_simu.PrintResults();
     } catch (const std::exception &e) {
         LOG_PRINT("try Layer failed: %s\n", e.what());
         return -1;
@@ -1,4 +1,8 @@
+#include <cmath>
 #include "multi_scale_deformable_attn_func_v2.h"
+#include "multi_scale_deformable_attn_v2_tiling_common.h"
+#define MSDA_TRACE_MODULE "tiling"
+#include "multi_scale_deformable_attn_v2_trace.h"
 #include "register/op_def_registry.h"
 #include "tiling/tiling_api.h"
 #include "tiling/platform/platform_ascendc.h"
@@ -8,14 +12,121 @@ using namespace std;
 using namespace AscendC;
 
 namespace optiling {
-    const uint32_t BLOCK_DIM = 8;
-    const uint32_t TILE_NUM = 8;
+    const size_t FUNC_ATTR_OUTPUT_ROW_STRIDE_INDEX = 0;
+    const size_t FUNC_ATTR_OUTPUT_OFFSET_INDEX = 1;
+    const size_t FUNC_ATTR_WEIGHT_THRESHOLD_INDEX = 2;
+    const size_t FUNC_ATTR_RENORMALIZE_WEIGHTS_INDEX = 3;
+    const size_t FUNC_ATTR_LOCATION_ROW_STRIDE_INDEX = 4;
+    const size_t FUNC_ATTR_LOCATION_OFFSET_INDEX = 5;
+    const size_t FUNC_ATTR_WEIGHT_ROW_STRIDE_INDEX = 6;
+    const size_t FUNC_ATTR_WEIGHT_OFFSET_INDEX = 7;
+    const size_t FUNC_INPUT_SPATIAL_SHAPES_INDEX = 1;
+    const size_t FUNC_INPUT_LEVEL_START_INDEX_INDEX = 2;
+    const size_t FUNC_INPUT_SAMPLING_LOCATIONS_INDEX = 3;
+    const size_t FUNC_INPUT_ATTENTION_WEIGHTS_INDEX = 4;
+    const size_t FUNC_INPUT_PROJ_WEIGHT_INDEX = 5;
+    const size_t FUNC_INPUT_PROJ_BIAS_INDEX = 6;
+    const size_t FUNC_OUTPUT_SAMPLED_INDEX = 1;
+
+    // Host copy of an int32 value-depend input, nullptr when its values are not known at tiling time.
+    static const int32_t *GetHostInt32Input(gert::TilingContext *context, size_t index, uint64_t minSize) {
+        const gert::Tensor *tensor = context->GetInputTensor(index);
+        if (tensor == nullptr || static_cast<uint64_t>(tensor->GetShapeSize()) < minSize) {
+            return nullptr;
+        }
+        return tensor->GetData<int32_t>();
+    }
+
+    static int64_t GetIntAttr(const gert::RuntimeAttrs *attrs, size_t index) {
+        const int64_t *attr = attrs->GetAttrPointer<int64_t>(index);
+        return attr == nullptr ? 0 : *attr;
+    }
+
+    // Latency mode for fewer queries than cores: each query's (head, level) pairs are cut into querySplit parts
+    // that run as separate tasks, so bs=1 tracking-size calls keep every core busy. The parts meet in the output
+    // rows through the atomic adds the kernel already uses per point. Returns 1 (off) otherwise.
+    static uint32_t ChooseQuerySplit(const MsdaTilingShape &shape, uint32_t coreNum, MsdaTilingChoice &choice) {
+        uint32_t pairNum = shape.numHeads * shape.numLevels;
+        if (shape.numQueries == 0 || shape.numQueries >= coreNum || pairNum <= 1) {
+            return 1;
+        }
+        uint32_t split = (coreNum + shape.numQueries - 1) / shape.numQueries;
+        split = split < pairNum ? split : pairNum;
+        uint32_t taskNum = shape.numQueries * split;
+        choice.usedCoreNum = taskNum < coreNum ? taskNum : coreNum;
+        choice.taskNumPerCore = (taskNum + choice.usedCoreNum - 1) / choice.usedCoreNum;
+        return split;
+    }
+
+    // With output_proj_weight (D, H*E) the kernel runs mixed AIC/AIV: the AIV cores sample query rows into a
+    // per-core workspace slab and the cube cores write slab @ weight^T (+ bias) as the (bs, Q, D) output. A
+    // non-empty sampled output also gets the slab rows, for the projection's backward.
+    // Splits the queries over AIC/AIV groups, builds the per-slab matmul tiling and sizes the workspace.
+    static bool SetProjectionTiling(gert::TilingContext *context, const platform_ascendc::PlatformAscendC &platform,
+                                    const MsdaTilingShape &shape, MsdaTilingChoice &choice,
+                                    MultiScaleDeformableAttnFuncV2TilingData &tiling, size_t &workspaceSize) {
+        auto weightShape = context->GetOptionalInputTensor(FUNC_INPUT_PROJ_WEIGHT_INDEX)->GetStorageShape();
+        const gert::Tensor *bias = context->GetOptionalInputTensor(FUNC_INPUT_PROJ_BIAS_INDEX);
+        uint64_t rowNum = static_cast<uint64_t>(shape.numHeads) * shape.embedDims;
+        uint64_t projDims = weightShape.GetDim(0);
+        if (weightShape.GetDimNum() != 2 || static_cast<uint64_t>(weightShape.GetDim(1)) != rowNum || projDims == 0 ||
+            (bias != nullptr && static_cast<uint64_t>(bias->GetStorageShape().GetShapeSize()) != projDims)) {
+            return false;
+        }
+        uint64_t rows = static_cast<uint64_t>(shape.batchSize) * shape.numQueries;
+        if (MsdaIsLargeTensor(shape) || rows * projDims >= MSDA_INT32_ELEMENT_LIMIT) {
+            return false;
+        }
+        const gert::StorageShape *sampledShape = context->GetOutputShape(FUNC_OUTPUT_SAMPLED_INDEX);
+        uint64_t sampledSize = sampledShape == nullptr ? 0 : sampledShape->GetStorageShape().GetShapeSize();
+        if (sampledSize != 0 && sampledSize != rows * rowNum) {
+            return false;
+        }
+
+        uint32_t groupNum = (choice.usedCoreNum + MSDA_PROJ_AIV_PER_AIC - 1) / MSDA_PROJ_AIV_PER_AIC;
+        if (groupNum > platform.GetCoreNumAic()) {
+            groupNum = platform.GetCoreNumAic();
+        }
+        choice.usedCoreNum = groupNum * MSDA_PROJ_AIV_PER_AIC;
+        choice.taskNumPerCore = (shape.numQueries + choice.usedCoreNum - 1) / choice.usedCoreNum;
+        uint32_t chunk = choice.taskNumPerCore < MSDA_PROJ_CHUNK_QUERIES ? choice.taskNumPerCore
+                                                                        : MSDA_PROJ_CHUNK_QUERIES;
+        chunk = chunk > 0 ? chunk : 1;
+
+        matmul_tiling::MatmulApiTiling projTiling(platform);
+        projTiling.SetAType(matmul_tiling::TPosition::GM, matmul_tiling::CubeFormat::ND,
+                            matmul_tiling::DataType::DT_FLOAT);
+        projTiling.SetBType(matmul_tiling::TPosition::GM, matmul_tiling::CubeFormat::ND,
+                            matmul_tiling::DataType::DT_FLOAT, true);
+        projTiling.SetCType(matmul_tiling::TPosition::GM, matmul_tiling::CubeFormat::ND,
+                            matmul_tiling::DataType::DT_FLOAT);
+        projTiling.SetBiasType(matmul_tiling::TPosition::GM, matmul_tiling::CubeFormat::ND,
+                               matmul_tiling::DataType::DT_FLOAT);
+        projTiling.SetShape(chunk, projDims, rowNum);
+        projTiling.SetOrgShape(chunk, projDims, rowNum);
+        projTiling.SetBias(bias != nullptr);
+        projTiling.SetBufferSpace(-1, -1, -1);
+        if (projTiling.GetTiling(tiling.projTiling) == -1) {
+            return false;
+        }
+        tiling.set_projDims(projDims);
+        tiling.set_projChunk(chunk);
+        tiling.set_projBias(bias != nullptr ? 1 : 0);
+        tiling.set_projSampled(sampledSize != 0 ? 1 : 0);
+
+        context->SetBlockDim(groupNum);
+        workspaceSize = platform.GetLibApiWorkSpaceSize() +
+                        static_cast<size_t>(choice.usedCoreNum) * shape.batchSize * chunk * rowNum * sizeof(float);
+        return true;
+    }
 
     static ge::graphStatus TilingFuncForMultiScaleDeformableAttnFuncV2(gert::TilingContext *context) {
+        msda_trace::Scope trace("FuncV2Tiling");
         MultiScaleDeformableAttnFuncV2TilingData tiling;
 
         auto valueShape = context->GetInputTensor(0)->GetStorageShape();
-        auto samplingLocationsShape = context->GetInputTensor(3)->GetStorageShape();
+        // logical shape: sampling_locations may be a strided view whose storage is a wider buffer
+        auto samplingLocationsShape = context->GetInputTensor(FUNC_INPUT_SAMPLING_LOCATIONS_INDEX)->GetOriginShape();
 
         auto platformInfoptr = context->GetPlatformInfo();
         if (platformInfoptr == nullptr) {
@@ -23,32 +134,209 @@ namespace optiling {
         }
         auto ascendplatformInfo = platform_ascendc::PlatformAscendC(platformInfoptr);
         uint32_t coreNum = ascendplatformInfo.GetCoreNumAiv();
-        context->SetBlockDim(coreNum);
-
-        tiling.set_batchSize(valueShape.GetDim(0));
-        tiling.set_numKeys(valueShape.GetDim(2));
-        tiling.set_numHeads(samplingLocationsShape.GetDim(2));
-        tiling.set_embedDims(valueShape.GetDim(3));
-        tiling.set_numLevels(samplingLocationsShape.GetDim(3));
-        tiling.set_numQueries(samplingLocationsShape.GetDim(1));
-        tiling.set_numPoints(samplingLocationsShape.GetDim(4));
-        tiling.set_coreNum(coreNum);
+        uint64_t ubSize = 0;
+        ascendplatformInfo.GetCoreMemSize(platform_ascendc::CoreMemType::UB, ubSize);
+        uint64_t l2Size = 0;
+        ascendplatformInfo.GetCoreMemSize(platform_ascendc::CoreMemType::L2, l2Size);
+
+        MsdaTilingShape shape;
+        if (!MsdaSetSources(shape, valueShape.GetDim(0), samplingLocationsShape.GetDim(0))) {
+            return ge::GRAPH_FAILED;
+        }
+        shape.numKeys = valueShape.GetDim(2);
+        shape.numHeads = samplingLocationsShape.GetDim(2);
+        shape.embedDims = valueShape.GetDim(3);
+        shape.numLevels = samplingLocationsShape.GetDim(3);
+        shape.numQueries = samplingLocationsShape.GetDim(1);
+        shape.numPoints = samplingLocationsShape.GetDim(4);
+
+        // output may be a row view into a larger buffer, e.g. a slice of a concatenated feature tensor
+        auto attrs = context->GetAttrs();
+        if (attrs == nullptr) {
+            return ge::GRAPH_FAILED;
+        }
+        // the projected output is written dense; the sampled rows live in workspace, copied to sampled if given
+        bool projected = context->GetOptionalInputTensor(FUNC_INPUT_PROJ_WEIGHT_INDEX) != nullptr;
+        int64_t outputRowStride = GetIntAttr(attrs, FUNC_ATTR_OUTPUT_ROW_STRIDE_INDEX);
+        int64_t outputOffset = GetIntAttr(attrs, FUNC_ATTR_OUTPUT_OFFSET_INDEX);
+        uint64_t outputSize = projected ? static_cast<uint64_t>(shape.batchSize) * shape.numQueries *
+                                              shape.numHeads * shape.embedDims
+                                        : context->GetOutputShape(0)->GetStorageShape().GetShapeSize();
+        // the projection slabs hold one source's rows; only the fused path writes sampled
+        const gert::StorageShape *sampledShape = context->GetOutputShape(FUNC_OUTPUT_SAMPLED_INDEX);
+        if ((!projected && sampledShape != nullptr && sampledShape->GetStorageShape().GetShapeSize() != 0) ||
+            (projected && (outputRowStride != 0 || outputOffset != 0 || shape.numSources != 1)) ||
+            !MsdaSetRowView(shape, outputRowStride, outputOffset, outputSize)) {
+            return ge::GRAPH_FAILED;
+        }
+        // sampling_locations / attention_weights are usually slices of one fused projection; the kernel reads
+        // their rows in place instead of the framework copying each to a contiguous tensor first
+        uint64_t locationSize =
+            context->GetInputTensor(FUNC_INPUT_SAMPLING_LOCATIONS_INDEX)->GetStorageShape().GetShapeSize();
+        uint64_t weightSize =
+            context->GetInputTensor(FUNC_INPUT_ATTENTION_WEIGHTS_INDEX)->GetStorageShape().GetShapeSize();
+        if (!MsdaSetInputViews(shape, GetIntAttr(attrs, FUNC_ATTR_LOCATION_ROW_STRIDE_INDEX),
+                               GetIntAttr(attrs, FUNC_ATTR_LOCATION_OFFSET_INDEX), locationSize,
+                               GetIntAttr(attrs, FUNC_ATTR_WEIGHT_ROW_STRIDE_INDEX),
+                               GetIntAttr(attrs, FUNC_ATTR_WEIGHT_OFFSET_INDEX), weightSize)) {
+            return ge::GRAPH_FAILED;
+        }
+        // inference-time pruning: points whose attention weight is below the threshold are not sampled
+        const float *weightThreshold = attrs->GetAttrPointer<float>(FUNC_ATTR_WEIGHT_THRESHOLD_INDEX);
+        const bool *renormalizeWeights = attrs->GetAttrPointer<bool>(FUNC_ATTR_RENORMALIZE_WEIGHTS_INDEX);
+        float threshold = weightThreshold == nullptr ? 0.0f : *weightThreshold;
+        if (!std::isfinite(threshold) || threshold < 0.0f) {
+            return ge::GRAPH_FAILED;
+        }
+        MsdaTilingChoice choice = MsdaChooseTiling(MSDA_OP_FUNC, shape, coreNum, 1);
+        // the sources of a query share its coordinate stage, so they are not split apart
+        uint32_t querySplit = (projected || shape.numSources != 1) ? 1 : ChooseQuerySplit(shape, coreNum, choice);
+        // the head-packed path writes whole output rows, a split query needs the atomic per-point path; multiple
+        // sources reuse the per-head corner weights of the atomic path too
+        bool headPacked = querySplit == 1 && shape.numSources == 1 && MsdaUseHeadPacked(shape, ubSize);
+        bool renormalize = renormalizeWeights != nullptr && *renormalizeWeights;
+        MsdaLevelTable levelTable = {};
+        bool levelTableBaked = MsdaBuildLevelTable(
+            GetHostInt32Input(context, FUNC_INPUT_SPATIAL_SHAPES_INDEX, 2ULL * shape.numLevels),
+            GetHostInt32Input(context, FUNC_INPUT_LEVEL_START_INDEX_INDEX, shape.numLevels), shape, levelTable);
+        uint64_t sliceKeys = levelTableBaked ? 0 : shape.numKeys;
+        for (uint32_t level = 0; levelTableBaked && level < shape.numLevels; level++) {
+            uint64_t levelKeys = static_cast<uint64_t>(levelTable.height[level]) * levelTable.width[level];
+            sliceKeys = levelKeys > sliceKeys ? levelKeys : sliceKeys;
+        }
+        // the slice order zeroes and revisits whole output rows, and renormalizing needs a query's full weight row
+        uint32_t forwardOrder = MsdaChooseForwardOrder(
+            shape, coreNum, sliceKeys, l2Size,
+            !projected && querySplit == 1 && !headPacked && shape.numSources == 1 && !renormalize);
+        // the fused projection hands each cube unit the static ranges of its vector cores; the slice order sweeps
+        // a core's static range once per slice
+        MsdaChooseSchedule(choice, !projected && forwardOrder != MSDA_FORWARD_ORDER_SLICE);
+        uint64_t tilingKey = MsdaTilingKey(shape);
+        size_t workspaceSize = 0;
+        if (projected) {
+            if (!SetProjectionTiling(context, ascendplatformInfo, shape, choice, tiling, workspaceSize)) {
+                return ge::GRAPH_FAILED;
+            }
+            tilingKey = MSDA_TILING_KEY_PROJ;
+        } else {
+            context->SetBlockDim(choice.usedCoreNum);
+            // the dynamic schedule and latency mode both meet at a SyncAll, which needs the library workspace
+            if (choice.scheduleMode == MSDA_SCHEDULE_DYNAMIC || querySplit > 1) {
+                workspaceSize = ascendplatformInfo.GetLibApiWorkSpaceSize();
+            }
+            if (choice.scheduleMode == MSDA_SCHEDULE_DYNAMIC) {
+                workspaceSize += MSDA_SCHEDULE_COUNTER_BYTES;
+            }
+        }
+        context->SetTilingKey(tilingKey);
+
+        tiling.set_batchSize(shape.batchSize);
+        tiling.set_numSources(shape.numSources);
+        tiling.set_numKeys(shape.numKeys);
+        tiling.set_numHeads(shape.numHeads);
+        tiling.set_embedDims(shape.embedDims);
+        tiling.set_numLevels(shape.numLevels);
+        tiling.set_numQueries(shape.numQueries);
+        tiling.set_numPoints(shape.numPoints);
+        tiling.set_coreNum(choice.usedCoreNum);
+        tiling.set_taskNumPerCore(choice.taskNumPerCore);
+        tiling.set_cacheMode(choice.cacheMode);
+        tiling.set_headPacked(headPacked ? 1 : 0);
+        tiling.set_querySplit(querySplit);
+        tiling.set_forwardOrder(forwardOrder);
+        tiling.set_outputRowStride(shape.rowStride);
+        tiling.set_outputOffset(shape.rowOffset);
+        tiling.set_locationRowStride(shape.locationRowStride);
+        tiling.set_locationOffset(shape.locationOffset);
+        tiling.set_weightRowStride(shape.weightRowStride);
+        tiling.set_weightOffset(shape.weightOffset);
+        tiling.set_weightThreshold(threshold);
+        tiling.set_renormalizeWeights(renormalize ? 1 : 0);
+        tiling.set_scheduleMode(choice.scheduleMode);
+        tiling.set_scheduleChunk(choice.scheduleChunk);
+        tiling.set_levelTable(levelTableBaked ? 1 : 0);
+        tiling.set_levelHeight(levelTable.height);
+        tiling.set_levelWidth(levelTable.width);
+        tiling.set_levelStart(levelTable.start);
         tiling.SaveToBuffer(context->GetRawTilingData()->GetData(), context->GetRawTilingData()->GetCapacity());
         context->GetRawTilingData()->SetDataSize(tiling.GetDataSize());
 
         size_t *currentWorkspace = context->GetWorkspaceSizes(1);
-        currentWorkspace[0] = 0;
+        currentWorkspace[0] = workspaceSize;
+        trace.Args("\"shape\":[%u,%u,%u,%u,%u,%u,%u],\"tilingKey\":%llu,\"coreNum\":%u,\"taskNumPerCore\":%u,"
+                   "\"cacheMode\":%u,\"headPacked\":%u,\"outputRowStride\":%llu,\"weightThreshold\":%g,"
+                   "\"renormalizeWeights\":%u,\"projDims\":%u,\"projSampled\":%u,\"scheduleMode\":%u,"
+                   "\"scheduleChunk\":%u,\"querySplit\":%u,\"levelTable\":%u,\"numSources\":%u,\"forwardOrder\":%u,"
+                   "\"workspace\":%zu",
+                   shape.batchSize, shape.numQueries, shape.numHeads, shape.numKeys, shape.embedDims, shape.numLevels,
+                   shape.numPoints, static_cast<unsigned long long>(tilingKey), choice.usedCoreNum,
+                   choice.taskNumPerCore, choice.cacheMode, tiling.get_headPacked(),
+                   static_cast<unsigned long long>(shape.rowStride), static_cast<double>(threshold),
+                   tiling.get_renormalizeWeights(), tiling.get_projDims(), tiling.get_projSampled(),
+                   choice.scheduleMode, choice.scheduleChunk, querySplit, tiling.get_levelTable(), shape.numSources,
+                   forwardOrder, currentWorkspace[0]);
         return ge::GRAPH_SUCCESS;
     }
 }
 
 namespace ge {
+    // Dim idx of an input shape for inference, -1 when it is unknown (a -1 dim, or any dim of a -2 unknown-rank
+    // shape) so graph mode can run the infer functions before the shapes are final.
+    static int64_t InferDim(const gert::Shape &shape, size_t idx) {
+        if (idx >= shape.GetDimNum() || shape.GetDim(idx) < 0) {
+            return -1;
+        }
+        return shape.GetDim(idx);
+    }
+
+    static int64_t InferDimMul(int64_t a, int64_t b) {
+        return (a < 0 || b < 0) ? -1 : a * b;
+    }
+
+    // output (bs, num_queries, num_heads * embed_dims), (bs, num_queries, output_row_stride) for a row view, or
+    // (bs, num_queries, proj_dims) with output_proj_weight (proj_dims, num_heads * embed_dims); bs is value's batch,
+    // num_sources times that of sampling_locations with several value sources
+    static void InferOutputShape(const gert::Shape &valueShape, const gert::Shape &samplingLocationsShape,
+                                 const gert::Shape *projWeightShape, int64_t outputRowStride, gert::Shape &yShape) {
+        yShape.SetDimNum(0);
+        yShape.AppendDim(InferDim(valueShape, 0));
+        yShape.AppendDim(InferDim(samplingLocationsShape, 1));
+        if (projWeightShape != nullptr) {
+            yShape.AppendDim(InferDim(*projWeightShape, 0));
+        } else if (outputRowStride > 0) {
+            yShape.AppendDim(outputRowStride);
+        } else {
+            yShape.AppendDim(InferDimMul(InferDim(samplingLocationsShape, 2), InferDim(valueShape, 3)));
+        }
+    }
+
+    // sampled: the (bs, num_queries, num_heads * embed_dims) rows the fused projection multiplies, (0) without
+    // output_proj_weight
+    static void InferSampledShape(const gert::Shape &samplingLocationsShape, const gert::Shape &valueShape,
+                                  bool projected, gert::Shape &sampledShape) {
+        sampledShape.SetDimNum(0);
+        if (!projected) {
+            sampledShape.AppendDim(0);
+            return;
+        }
+        sampledShape.AppendDim(InferDim(samplingLocationsShape, 0));
+        sampledShape.AppendDim(InferDim(samplingLocationsShape, 1));
+        sampledShape.AppendDim(InferDimMul(InferDim(samplingLocationsShape, 2), InferDim(valueShape, 3)));
+    }
+
+    static int64_t GetOutputRowStride(const gert::RuntimeAttrs *attrs) {
+        const int64_t *outputRowStride =
+            attrs == nullptr ? nullptr : attrs->GetAttrPointer<int64_t>(optiling::FUNC_ATTR_OUTPUT_ROW_STRIDE_INDEX);
+        return outputRowStride == nullptr ? 0 : *outputRowStride;
+    }
+
     static ge::graphStatus InferShapeForMultiScaleDeformableAttnFuncV2(gert::InferShapeContext *context) {
         const gert::Shape *valueShape = context->GetInputShape(0);
         if (valueShape == nullptr) {
             return ge::GRAPH_FAILED;
         }
-        const gert::Shape *samplingLocationsShape = context->GetInputShape(3);
+        const gert::Shape *samplingLocationsShape =
+            context->GetInputShape(optiling::FUNC_INPUT_SAMPLING_LOCATIONS_INDEX);
         if (samplingLocationsShape == nullptr) {
             return ge::GRAPH_FAILED;
         }
@@ -56,17 +344,51 @@ namespace ge {
         if (y_shape == nullptr) {
             return ge::GRAPH_FAILED;
         }
-        y_shape->SetDimNum(0);
-        y_shape->AppendDim(valueShape->GetDim(0));
-        y_shape->AppendDim(samplingLocationsShape->GetDim(1));
-        y_shape->AppendDim(samplingLocationsShape->GetDim(2) * valueShape->GetDim(3));
+        const gert::Shape *projWeightShape = context->GetOptionalInputShape(optiling::FUNC_INPUT_PROJ_WEIGHT_INDEX);
+        InferOutputShape(*valueShape, *samplingLocationsShape, projWeightShape,
+                         GetOutputRowStride(context->GetAttrs()), *y_shape);
+        gert::Shape *sampledShape = context->GetOutputShape(optiling::FUNC_OUTPUT_SAMPLED_INDEX);
+        if (sampledShape != nullptr) {
+            InferSampledShape(*samplingLocationsShape, *valueShape, projWeightShape != nullptr, *sampledShape);
+        }
+        return GRAPH_SUCCESS;
+    }
 
+    // Same formula on the min and max shapes; an unbounded (-1) max dim stays unbounded.
+    static ge::graphStatus InferShapeRangeForMultiScaleDeformableAttnFuncV2(gert::InferShapeRangeContext *context) {
+        const gert::Range<gert::Shape> *valueRange = context->GetInputShapeRange(0);
+        const gert::Range<gert::Shape> *samplingLocationsRange =
+            context->GetInputShapeRange(optiling::FUNC_INPUT_SAMPLING_LOCATIONS_INDEX);
+        gert::Range<gert::Shape> *yRange = context->GetOutputShapeRange(0);
+        if (valueRange == nullptr || samplingLocationsRange == nullptr || yRange == nullptr ||
+            valueRange->GetMin() == nullptr || valueRange->GetMax() == nullptr ||
+            samplingLocationsRange->GetMin() == nullptr || samplingLocationsRange->GetMax() == nullptr ||
+            yRange->GetMin() == nullptr || yRange->GetMax() == nullptr) {
+            return ge::GRAPH_FAILED;
+        }
+        const gert::Range<gert::Shape> *projWeightRange =
+            context->GetOptionalInputShapeRange(optiling::FUNC_INPUT_PROJ_WEIGHT_INDEX);
+        int64_t outputRowStride = GetOutputRowStride(context->GetAttrs());
+        InferOutputShape(*valueRange->GetMin(), *samplingLocationsRange->GetMin(),
+                         projWeightRange == nullptr ? nullptr : projWeightRange->GetMin(), outputRowStride,
+                         *yRange->GetMin());
+        InferOutputShape(*valueRange->GetMax(), *samplingLocationsRange->GetMax(),
+                         projWeightRange == nullptr ? nullptr : projWeightRange->GetMax(), outputRowStride,
+                         *yRange->GetMax());
+        gert::Range<gert::Shape> *sampledRange = context->GetOutputShapeRange(optiling::FUNC_OUTPUT_SAMPLED_INDEX);
+        if (sampledRange != nullptr && sampledRange->GetMin() != nullptr && sampledRange->GetMax() != nullptr) {
+            InferSampledShape(*samplingLocationsRange->GetMin(), *valueRange->GetMin(), projWeightRange != nullptr,
+                              *sampledRange->GetMin());
+            InferSampledShape(*samplingLocationsRange->GetMax(), *valueRange->GetMax(), projWeightRange != nullptr,
+                              *sampledRange->GetMax());
+        }
         return GRAPH_SUCCESS;
     }
 
     static ge::graphStatus InferDataTypeForMultiScaleDeformableAttnFuncV2(gert::InferDataTypeContext* context) {
         const ge::DataType value_dtype = context->GetInputDataType(0);
         context->SetOutputDataType(0, value_dtype);
+        context->SetOutputDataType(optiling::FUNC_OUTPUT_SAMPLED_INDEX, value_dtype);
         return GRAPH_SUCCESS;
     }
 }
@@ -86,40 +408,72 @@ namespace ops {
                 .DataType({ge::DT_INT32})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
+                .ValueDepend(OPTIONAL)
 		.AutoContiguous();
             this->Input("value_level_start_index")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_INT32})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
+                .ValueDepend(OPTIONAL)
 		.AutoContiguous();
             this->Input("sampling_locations")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_FLOAT})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
-		.AutoContiguous();
+		.IgnoreContiguous();
             this->Input("attention_weights")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_FLOAT})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
+		.IgnoreContiguous();
+            this->Input("output_proj_weight")
+                .ParamType(OPTIONAL)
+                .DataType({ge::DT_FLOAT})
+                .Format({ge::FORMAT_ND})
+                .UnknownShapeFormat({ge::FORMAT_ND})
+		.AutoContiguous();
+            this->Input("output_proj_bias")
+                .ParamType(OPTIONAL)
+                .DataType({ge::DT_FLOAT})
+                .Format({ge::FORMAT_ND})
+                .UnknownShapeFormat({ge::FORMAT_ND})
 		.AutoContiguous();
             this->Output("output")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_FLOAT})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND});
+            this->Output("sampled")
+                .ParamType(OPTIONAL)
+                .DataType({ge::DT_FLOAT})
+                .Format({ge::FORMAT_ND})
+                .UnknownShapeFormat({ge::FORMAT_ND});
+            this->Attr("output_row_stride").AttrType(OPTIONAL).Int(0);
+            this->Attr("output_offset").AttrType(OPTIONAL).Int(0);
+            this->Attr("weight_threshold").AttrType(OPTIONAL).Float(0.0);
+            this->Attr("renormalize_weights").AttrType(OPTIONAL).Bool(false);
+            this->Attr("sampling_locations_row_stride").AttrType(OPTIONAL).Int(0);
+            this->Attr("sampling_locations_offset").AttrType(OPTIONAL).Int(0);
+            this->Attr("attention_weights_row_stride").AttrType(OPTIONAL).Int(0);
+            this->Attr("attention_weights_offset").AttrType(OPTIONAL).Int(0);
 
             this->SetInferShape(ge::InferShapeForMultiScaleDeformableAttnFuncV2)
+                .SetInferShapeRange(ge::InferShapeRangeForMultiScaleDeformableAttnFuncV2)
                 .SetInferDataType(ge::InferDataTypeForMultiScaleDeformableAttnFuncV2);
 
             this->AICore()
                 .SetTiling(optiling::TilingFuncForMultiScaleDeformableAttnFuncV2);
             
+            // one unknown-rank binary per dtype serves every shape: shapes only reach the kernel through tiling
+            // data, and static-shape calls reuse the dynamic binary instead of compiling their own
             OpAICoreConfig aiConfig;
             aiConfig.ExtendCfgInfo("enableVectorCore.flag", "false");
-            aiConfig.DynamicCompileStaticFlag(true);
+            aiConfig.DynamicCompileStaticFlag(true)
+                .DynamicShapeSupportFlag(true)
+                .DynamicRankSupportFlag(true);
             //this->AICore().AddConfig("ascend310p", aiConfig);
             this->AICore().AddConfig("ascend910b", aiConfig);
 
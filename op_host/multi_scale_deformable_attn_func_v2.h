@@ -1,10 +1,12 @@
 #ifndef MULIT_SCALE_DEFOEMABLE_ATTN_FUNC_V2_TILING_H
 #define MULIT_SCALE_DEFOEMABLE_ATTN_FUNC_V2_TILING_H
 #include "register/tilingdata_base.h"
+#include "tiling/tiling_api.h"
 
 namespace optiling {
     BEGIN_TILING_DATA_DEF(MultiScaleDeformableAttnFuncV2TilingData)
     TILING_DATA_FIELD_DEF(uint32_t, batchSize)
+    TILING_DATA_FIELD_DEF(uint32_t, numSources)
     TILING_DATA_FIELD_DEF(uint32_t, numKeys)
     TILING_DATA_FIELD_DEF(uint32_t, numHeads)
     TILING_DATA_FIELD_DEF(uint32_t, embedDims)
@@ -12,6 +14,30 @@ namespace optiling {
     TILING_DATA_FIELD_DEF(uint32_t, numQueries)
     TILING_DATA_FIELD_DEF(uint32_t, numPoints)
     TILING_DATA_FIELD_DEF(uint32_t, coreNum)
+    TILING_DATA_FIELD_DEF(uint32_t, taskNumPerCore)
+    TILING_DATA_FIELD_DEF(uint32_t, cacheMode)
+    TILING_DATA_FIELD_DEF(uint32_t, headPacked)
+    TILING_DATA_FIELD_DEF(uint32_t, outputRowStride)
+    TILING_DATA_FIELD_DEF(uint32_t, outputOffset)
+    TILING_DATA_FIELD_DEF(uint32_t, locationRowStride)
+    TILING_DATA_FIELD_DEF(uint32_t, locationOffset)
+    TILING_DATA_FIELD_DEF(uint32_t, weightRowStride)
+    TILING_DATA_FIELD_DEF(uint32_t, weightOffset)
+    TILING_DATA_FIELD_DEF(float, weightThreshold)
+    TILING_DATA_FIELD_DEF(uint32_t, renormalizeWeights)
+    TILING_DATA_FIELD_DEF(uint32_t, querySplit)
+    TILING_DATA_FIELD_DEF(uint32_t, forwardOrder)
+    TILING_DATA_FIELD_DEF(uint32_t, scheduleMode)
+    TILING_DATA_FIELD_DEF(uint32_t, scheduleChunk)
+    TILING_DATA_FIELD_DEF(uint32_t, levelTable)
+    TILING_DATA_FIELD_DEF_ARR(int32_t, 16, levelHeight)
+    TILING_DATA_FIELD_DEF_ARR(int32_t, 16, levelWidth)
+    TILING_DATA_FIELD_DEF_ARR(int32_t, 16, levelStart)
+    TILING_DATA_FIELD_DEF(uint32_t, projDims)
+    TILING_DATA_FIELD_DEF(uint32_t, projChunk)
+    TILING_DATA_FIELD_DEF(uint32_t, projBias)
+    TILING_DATA_FIELD_DEF(uint32_t, projSampled)
+    TILING_DATA_FIELD_DEF_STRUCT(TCubeTiling, projTiling)
 
     END_TILING_DATA_DEF;
 
@@ -1,4 +1,7 @@
 #include "multi_scale_deformable_attn_grad_v2.h"
+#include "multi_scale_deformable_attn_v2_tiling_common.h"
+#define MSDA_TRACE_MODULE "tiling"
+#include "multi_scale_deformable_attn_v2_trace.h"
 #include "register/op_def_registry.h"
 #include "tiling/tiling_api.h"
 #include "tiling/platform/platform_ascendc.h"
@@ -8,11 +11,82 @@ using namespace std;
 using namespace AscendC;
 
 namespace optiling {
+    // ClearOutput zeroes one output tensor on each of the first three blocks
+    const uint32_t GRAD_CLEAR_CORE_NUM = 3;
+    const size_t GRAD_SYS_WORKSPACE_SIZE = 16 * 1024 * 1024;
+    const size_t GRAD_ATTR_OUTPUT_MASK_INDEX = 0;
+    const size_t GRAD_ATTR_GRAD_OUTPUT_ROW_STRIDE_INDEX = 1;
+    const size_t GRAD_ATTR_GRAD_OUTPUT_OFFSET_INDEX = 2;
+    const size_t GRAD_ATTR_LOCATION_ROW_STRIDE_INDEX = 3;
+    const size_t GRAD_ATTR_LOCATION_OFFSET_INDEX = 4;
+    const size_t GRAD_ATTR_WEIGHT_ROW_STRIDE_INDEX = 5;
+    const size_t GRAD_ATTR_WEIGHT_OFFSET_INDEX = 6;
+    const size_t GRAD_ATTR_GRAD_VALUE_SPARSE_INDEX = 7;
+    const size_t GRAD_INPUT_SPATIAL_SHAPES_INDEX = 1;
+    const size_t GRAD_INPUT_LEVEL_START_INDEX_INDEX = 2;
+    const size_t GRAD_INPUT_SAMPLING_LOC_INDEX = 3;
+    const size_t GRAD_INPUT_ATTN_WEIGHT_INDEX = 4;
+    const size_t GRAD_INPUT_GRAD_OUTPUT_INDEX = 5;
+    const size_t GRAD_OUTPUT_NUM = 3;
+    const size_t GRAD_OUTPUT_GRAD_VALUE_INDEX = 0;
+    const size_t GRAD_OUTPUT_GRAD_VALUE_INDEX_INDEX = 3;
+
+    // output_mask[i] false means output i is left untouched; an absent attr asks for all three
+    static uint32_t GetGradMask(gert::TilingContext *context) {
+        auto attrs = context->GetAttrs();
+        if (attrs == nullptr) {
+            return MSDA_GRAD_MASK_ALL;
+        }
+        auto outputMask = attrs->GetAttrPointer<gert::ContinuousVector>(GRAD_ATTR_OUTPUT_MASK_INDEX);
+        if ((outputMask == nullptr) || (outputMask->GetSize() != GRAD_OUTPUT_NUM)) {
+            return MSDA_GRAD_MASK_ALL;
+        }
+        const bool *maskData = static_cast<const bool *>(outputMask->GetData());
+        uint32_t gradMask = 0;
+        gradMask |= maskData[0] ? MSDA_GRAD_MASK_VALUE : 0;
+        gradMask |= maskData[1] ? MSDA_GRAD_MASK_LOCATION : 0;
+        gradMask |= maskData[2] ? MSDA_GRAD_MASK_WEIGHT : 0;
+        return gradMask;
+    }
+
+    // Host copy of an int32 value-depend input, nullptr when its values are not known at tiling time.
+    static const int32_t *GetHostInt32Input(gert::TilingContext *context, size_t index, uint64_t minSize) {
+        const gert::Tensor *tensor = context->GetInputTensor(index);
+        if (tensor == nullptr || static_cast<uint64_t>(tensor->GetShapeSize()) < minSize) {
+            return nullptr;
+        }
+        return tensor->GetData<int32_t>();
+    }
+
+    static int64_t GetIntAttr(const gert::RuntimeAttrs *attrs, size_t index) {
+        const int64_t *attr = attrs->GetAttrPointer<int64_t>(index);
+        return attr == nullptr ? 0 : *attr;
+    }
+
+    static bool GetBoolAttr(const gert::RuntimeAttrs *attrs, size_t index) {
+        const bool *attr = attrs->GetAttrPointer<bool>(index);
+        return attr != nullptr && *attr;
+    }
+
+    // The sparse grad_value outputs must hold MsdaSparseRows(shape) rows / indices.
+    static bool CheckSparseOutputs(gert::TilingContext *context, const MsdaTilingShape &shape) {
+        uint64_t sparseRows = MsdaSparseRows(shape);
+        const gert::StorageShape *rowsShape = context->GetOutputShape(GRAD_OUTPUT_GRAD_VALUE_INDEX);
+        const gert::StorageShape *indexShape = context->GetOutputShape(GRAD_OUTPUT_GRAD_VALUE_INDEX_INDEX);
+        if (rowsShape == nullptr || indexShape == nullptr || sparseRows > INT32_MAX) {
+            return false;
+        }
+        return static_cast<uint64_t>(rowsShape->GetStorageShape().GetShapeSize()) >= sparseRows * shape.embedDims &&
+               static_cast<uint64_t>(indexShape->GetStorageShape().GetShapeSize()) >= sparseRows;
+    }
+
     static ge::graphStatus TilingFuncForMultiScaleDeformableAttnGradV2(gert::TilingContext *context) {
+        msda_trace::Scope trace("GradV2Tiling");
         MultiScaleDeformableAttnGradV2TilingData tiling;
 
         auto valueShape = context->GetInputTensor(0)->GetStorageShape();
-        auto samplingLocationsShape = context->GetInputTensor(3)->GetStorageShape();
+        // logical shape: sampling_loc may be a strided view whose storage is a wider buffer
+        auto samplingLocationsShape = context->GetInputTensor(GRAD_INPUT_SAMPLING_LOC_INDEX)->GetOriginShape();
 
         auto platformInfoptr = context->GetPlatformInfo();
         if (platformInfoptr == nullptr) {
@@ -20,32 +94,199 @@ namespace optiling {
         }
         auto ascendplatformInfo = platform_ascendc::PlatformAscendC(platformInfoptr);
         uint32_t coreNum = ascendplatformInfo.GetCoreNumAiv();
-        context->SetBlockDim(coreNum);
-
-        tiling.set_batchSize(valueShape.GetDim(0));
-        tiling.set_numKeys(valueShape.GetDim(2));
-        tiling.set_numHeads(valueShape.GetDim(1));
-        tiling.set_embedDims(valueShape.GetDim(3));
-        tiling.set_numLevels(samplingLocationsShape.GetDim(3));
-        tiling.set_numQueries(samplingLocationsShape.GetDim(1));
-        tiling.set_numPoints(samplingLocationsShape.GetDim(5));
-        tiling.set_coreNum(coreNum);
+        uint64_t ubSize = 0;
+        ascendplatformInfo.GetCoreMemSize(platform_ascendc::CoreMemType::UB, ubSize);
+
+        MsdaTilingShape shape;
+        if (!MsdaSetSources(shape, valueShape.GetDim(0), samplingLocationsShape.GetDim(0))) {
+            return ge::GRAPH_FAILED;
+        }
+        shape.numKeys = valueShape.GetDim(2);
+        shape.numHeads = valueShape.GetDim(1);
+        shape.embedDims = valueShape.GetDim(3);
+        shape.numLevels = samplingLocationsShape.GetDim(3);
+        shape.numQueries = samplingLocationsShape.GetDim(1);
+        shape.numPoints = samplingLocationsShape.GetDim(5);
+
+        // grad_output may be a row view into a larger buffer, matching the forward's output_row_stride
+        auto attrs = context->GetAttrs();
+        if (attrs == nullptr) {
+            return ge::GRAPH_FAILED;
+        }
+        uint64_t gradOutputSize =
+            context->GetInputTensor(GRAD_INPUT_GRAD_OUTPUT_INDEX)->GetStorageShape().GetShapeSize();
+        if (!MsdaSetRowView(shape, GetIntAttr(attrs, GRAD_ATTR_GRAD_OUTPUT_ROW_STRIDE_INDEX),
+                            GetIntAttr(attrs, GRAD_ATTR_GRAD_OUTPUT_OFFSET_INDEX), gradOutputSize)) {
+            return ge::GRAPH_FAILED;
+        }
+        // the same in-place views of sampling_loc / attn_weight as the forward; the grads stay dense
+        uint64_t locationSize =
+            context->GetInputTensor(GRAD_INPUT_SAMPLING_LOC_INDEX)->GetStorageShape().GetShapeSize();
+        uint64_t weightSize = context->GetInputTensor(GRAD_INPUT_ATTN_WEIGHT_INDEX)->GetStorageShape().GetShapeSize();
+        if (!MsdaSetInputViews(shape, GetIntAttr(attrs, GRAD_ATTR_LOCATION_ROW_STRIDE_INDEX),
+                               GetIntAttr(attrs, GRAD_ATTR_LOCATION_OFFSET_INDEX), locationSize,
+                               GetIntAttr(attrs, GRAD_ATTR_WEIGHT_ROW_STRIDE_INDEX),
+                               GetIntAttr(attrs, GRAD_ATTR_WEIGHT_OFFSET_INDEX), weightSize)) {
+            return ge::GRAPH_FAILED;
+        }
+        // every grad_value mode allocates the per-level buffers, double-buffered per head; the bucket planner
+        // checks its own buffers on top of these
+        if (MsdaGradUbBytes(shape) > ubSize) {
+            return ge::GRAPH_FAILED;
+        }
+        MsdaTilingChoice choice = MsdaChooseTiling(MSDA_OP_GRAD, shape, coreNum, GRAD_CLEAR_CORE_NUM);
+        context->SetBlockDim(choice.usedCoreNum);
+        context->SetTilingKey(MsdaTilingKey(shape));
+        uint32_t gradMask = GetGradMask(context);
+        // sparse grad_value rides on the bucket sort, so it needs the bucket buffers to fit. Shape inference lays
+        // grad_value out sparse from the attr alone, so a masked grad_value cannot be sparse: nothing would write
+        // the inferred grad_value_index
+        bool sparse = GetBoolAttr(attrs, GRAD_ATTR_GRAD_VALUE_SPARSE_INDEX);
+        if (sparse && (gradMask & MSDA_GRAD_MASK_VALUE) == 0) {
+            return ge::GRAPH_FAILED;
+        }
+        MsdaBucketPlan bucket = {MSDA_GRAD_VALUE_ATOMIC, 0, 0, 0, 0, 0, 0};
+        // the bucket sort records one source's samples, several sources accumulate grad_value atomically
+        if ((gradMask & MSDA_GRAD_MASK_VALUE) != 0 && shape.numSources == 1) {
+            bucket = MsdaChooseGradValueMode(shape, choice, ubSize, sparse);
+        }
+        if (sparse && (bucket.gradValueMode != MSDA_GRAD_VALUE_SPARSE || !CheckSparseOutputs(context, shape))) {
+            return ge::GRAPH_FAILED;
+        }
+        // the bucket sort lays out each core's samples by its static query range
+        MsdaChooseSchedule(choice, bucket.gradValueMode == MSDA_GRAD_VALUE_ATOMIC);
+
+        tiling.set_batchSize(shape.batchSize);
+        tiling.set_numSources(shape.numSources);
+        tiling.set_numKeys(shape.numKeys);
+        tiling.set_numHeads(shape.numHeads);
+        tiling.set_embedDims(shape.embedDims);
+        tiling.set_numLevels(shape.numLevels);
+        tiling.set_numQueries(shape.numQueries);
+        tiling.set_numPoints(shape.numPoints);
+        tiling.set_coreNum(choice.usedCoreNum);
+        tiling.set_taskNumPerCore(choice.taskNumPerCore);
+        tiling.set_cacheMode(choice.cacheMode);
+        tiling.set_gradValueMode(bucket.gradValueMode);
+        tiling.set_bucketTileRows(bucket.tileRows);
+        tiling.set_bucketTileNum(bucket.tileNum);
+        tiling.set_bucketTileNumAlign(bucket.tileNumAlign);
+        tiling.set_bucketChunk(bucket.chunk);
+        tiling.set_bucketCapacity(bucket.capacity);
+        tiling.set_sparseRows(sparse ? static_cast<uint32_t>(MsdaSparseRows(shape)) : 0);
+        tiling.set_gradMask(gradMask);
+        tiling.set_gradOutputRowStride(shape.rowStride);
+        tiling.set_gradOutputOffset(shape.rowOffset);
+        tiling.set_locationRowStride(shape.locationRowStride);
+        tiling.set_locationOffset(shape.locationOffset);
+        tiling.set_weightRowStride(shape.weightRowStride);
+        tiling.set_weightOffset(shape.weightOffset);
+        tiling.set_scheduleMode(choice.scheduleMode);
+        tiling.set_scheduleChunk(choice.scheduleChunk);
+        MsdaLevelTable levelTable = {};
+        bool levelTableBaked = MsdaBuildLevelTable(
+            GetHostInt32Input(context, GRAD_INPUT_SPATIAL_SHAPES_INDEX, 2ULL * shape.numLevels),
+            GetHostInt32Input(context, GRAD_INPUT_LEVEL_START_INDEX_INDEX, shape.numLevels), shape, levelTable);
+        tiling.set_levelTable(levelTableBaked ? 1 : 0);
+        tiling.set_levelHeight(levelTable.height);
+        tiling.set_levelWidth(levelTable.width);
+        tiling.set_levelStart(levelTable.start);
         tiling.SaveToBuffer(context->GetRawTilingData()->GetData(), context->GetRawTilingData()->GetCapacity());
         context->GetRawTilingData()->SetDataSize(tiling.GetDataSize());
 
         size_t *currentWorkspace = context->GetWorkspaceSizes(1);
-        currentWorkspace[0] = 16 * 1024 * 1024;
+        currentWorkspace[0] = GRAD_SYS_WORKSPACE_SIZE + bucket.workspaceBytes +
+                              (choice.scheduleMode == MSDA_SCHEDULE_DYNAMIC ? MSDA_SCHEDULE_COUNTER_BYTES : 0);
+        trace.Args("\"shape\":[%u,%u,%u,%u,%u,%u,%u],\"tilingKey\":%llu,\"coreNum\":%u,\"taskNumPerCore\":%u,"
+                   "\"cacheMode\":%u,\"gradMask\":%u,\"gradValueMode\":%u,\"bucketTileRows\":%u,"
+                   "\"bucketTileNum\":%u,\"bucketChunk\":%u,\"bucketCapacity\":%u,\"sparseRows\":%u,"
+                   "\"scheduleMode\":%u,\"scheduleChunk\":%u,\"levelTable\":%u,\"numSources\":%u,"
+                   "\"workspace\":%zu",
+                   shape.batchSize, shape.numQueries, shape.numHeads, shape.numKeys, shape.embedDims, shape.numLevels,
+                   shape.numPoints, static_cast<unsigned long long>(MsdaTilingKey(shape)), choice.usedCoreNum,
+                   choice.taskNumPerCore, choice.cacheMode, gradMask, bucket.gradValueMode, bucket.tileRows,
+                   bucket.tileNum, bucket.chunk, bucket.capacity, tiling.get_sparseRows(), choice.scheduleMode,
+                   choice.scheduleChunk, tiling.get_levelTable(), shape.numSources, currentWorkspace[0]);
         return ge::GRAPH_SUCCESS;
     }
 }
 
 namespace ge {
+    // Dim idx of an input shape for inference, -1 when it is unknown (a -1 dim, or any dim of a -2 unknown-rank
+    // shape) so graph mode can run the infer functions before the shapes are final.
+    static int64_t InferDim(const gert::Shape &shape, size_t idx) {
+        if (idx >= shape.GetDimNum() || shape.GetDim(idx) < 0) {
+            return -1;
+        }
+        return shape.GetDim(idx);
+    }
+
+    static int64_t InferDimMul(int64_t a, int64_t b) {
+        return (a < 0 || b < 0) ? -1 : a * b;
+    }
+
+    // Rows of the sparse grad_value outputs, as MsdaSparseRows. For the max of a shape range one unbounded term
+    // still leaves the other as the bound.
+    static int64_t InferSparseRows(const gert::Shape &valueShape, const gert::Shape &samplingLocationsShape,
+                                   bool upperBound) {
+        int64_t rows = InferDimMul(InferDimMul(InferDim(valueShape, 0), InferDim(valueShape, 1)),
+                                   InferDim(valueShape, 2));
+        // 4 corners per point; num_points is dim 5 of sampling_loc, as in the tiling function
+        int64_t samples = InferDimMul(4, InferDim(samplingLocationsShape, 5));
+        for (size_t dim = 0; dim < 4; dim++) {
+            samples = InferDimMul(samples, InferDim(samplingLocationsShape, dim));
+        }
+        if (rows < 0 || samples < 0) {
+            return upperBound ? (rows < 0 ? samples : rows) : -1;
+        }
+        return samples < rows ? samples : rows;
+    }
+
+    static bool GetGradValueSparse(const gert::RuntimeAttrs *attrs) {
+        const bool *sparse =
+            attrs == nullptr ? nullptr : attrs->GetAttrPointer<bool>(optiling::GRAD_ATTR_GRAD_VALUE_SPARSE_INDEX);
+        return sparse != nullptr && *sparse;
+    }
+
+    // grad_value (bs, num_heads, num_keys, embed_dims) like value, or (sparse_rows, embed_dims) with
+    // grad_value_index (sparse_rows) when grad_value_sparse is set; grad_sampling_loc like sampling_loc and
+    // grad_attn_weight (bs, num_queries, num_heads, num_levels, num_points). gradValueIndexShape may be null
+    // when the optional output is absent, and is (0) without grad_value_sparse.
+    static void InferGradShapes(const gert::Shape &valueShape, const gert::Shape &samplingLocationsShape, bool sparse,
+                                bool upperBound, gert::Shape &gradValueShape, gert::Shape &gradSampleLocShape,
+                                gert::Shape &gradAttnWeightShape, gert::Shape *gradValueIndexShape) {
+        int64_t sparseRows = sparse ? InferSparseRows(valueShape, samplingLocationsShape, upperBound) : 0;
+        gradValueShape.SetDimNum(0);
+        if (sparse) {
+            gradValueShape.AppendDim(sparseRows);
+            gradValueShape.AppendDim(InferDim(valueShape, 3));
+        } else {
+            for (size_t dim = 0; dim < 4; dim++) {
+                gradValueShape.AppendDim(InferDim(valueShape, dim));
+            }
+        }
+        if (gradValueIndexShape != nullptr) {
+            gradValueIndexShape->SetDimNum(0);
+            gradValueIndexShape->AppendDim(sparseRows);
+        }
+        gradSampleLocShape.SetDimNum(0);
+        for (size_t dim = 0; dim < 6; dim++) {
+            gradSampleLocShape.AppendDim(InferDim(samplingLocationsShape, dim));
+        }
+        gradAttnWeightShape.SetDimNum(0);
+        for (size_t dim = 0; dim < 4; dim++) {
+            gradAttnWeightShape.AppendDim(InferDim(samplingLocationsShape, dim));
+        }
+        gradAttnWeightShape.AppendDim(InferDim(samplingLocationsShape, 5));
+    }
+
     static ge::graphStatus InferShapeForMultiScaleDeformableAttnGradV2(gert::InferShapeContext *context) {
         const gert::Shape *value_shape = context->GetInputShape(0);
         if (value_shape == nullptr) {
             return ge::GRAPH_FAILED;
         }
-        const gert::Shape *sampling_locations_shape = context->GetInputShape(3);
+        const gert::Shape *sampling_locations_shape =
+            context->GetInputShape(optiling::GRAD_INPUT_SAMPLING_LOC_INDEX);
         if (sampling_locations_shape == nullptr) {
             return ge::GRAPH_FAILED;
         }
@@ -55,21 +296,55 @@ namespace ge {
         if ((grad_value_shape == nullptr) || (grad_sample_loc_shape == nullptr) || (grad_attn_weight_shape == nullptr)) {
             return ge::GRAPH_FAILED;
         }
-        grad_value_shape->AppendDim(value_shape->GetDim(0));
-        grad_value_shape->AppendDim(value_shape->GetDim(1));
-        grad_value_shape->AppendDim(value_shape->GetDim(2));
-        grad_value_shape->AppendDim(value_shape->GetDim(3));
-        grad_sample_loc_shape->AppendDim(sampling_locations_shape->GetDim(0));
-        grad_sample_loc_shape->AppendDim(sampling_locations_shape->GetDim(1));
-        grad_sample_loc_shape->AppendDim(sampling_locations_shape->GetDim(2));
-        grad_sample_loc_shape->AppendDim(sampling_locations_shape->GetDim(3));
-        grad_sample_loc_shape->AppendDim(sampling_locations_shape->GetDim(4));
-        grad_sample_loc_shape->AppendDim(sampling_locations_shape->GetDim(5));
-        grad_attn_weight_shape->AppendDim(sampling_locations_shape->GetDim(0));
-        grad_attn_weight_shape->AppendDim(sampling_locations_shape->GetDim(1));
-        grad_attn_weight_shape->AppendDim(sampling_locations_shape->GetDim(2));
-        grad_attn_weight_shape->AppendDim(sampling_locations_shape->GetDim(3));
-        grad_attn_weight_shape->AppendDim(sampling_locations_shape->GetDim(5));
+        bool sparse = GetGradValueSparse(context->GetAttrs());
+        gert::Shape *grad_value_index_shape = context->GetOutputShape(optiling::GRAD_OUTPUT_GRAD_VALUE_INDEX_INDEX);
+        if (sparse && grad_value_index_shape == nullptr) {
+            return ge::GRAPH_FAILED;
+        }
+        InferGradShapes(*value_shape, *sampling_locations_shape, sparse, false, *grad_value_shape,
+                        *grad_sample_loc_shape, *grad_attn_weight_shape, grad_value_index_shape);
+        return GRAPH_SUCCESS;
+    }
+
+    // Same formulas on the min and max shapes; an unbounded (-1) max dim stays unbounded.
+    static ge::graphStatus InferShapeRangeForMultiScaleDeformableAttnGradV2(gert::InferShapeRangeContext *context) {
+        const gert::Range<gert::Shape> *valueRange = context->GetInputShapeRange(0);
+        const gert::Range<gert::Shape> *samplingLocationsRange =
+            context->GetInputShapeRange(optiling::GRAD_INPUT_SAMPLING_LOC_INDEX);
+        if (valueRange == nullptr || samplingLocationsRange == nullptr || valueRange->GetMin() == nullptr ||
+            valueRange->GetMax() == nullptr || samplingLocationsRange->GetMin() == nullptr ||
+            samplingLocationsRange->GetMax() == nullptr) {
+            return ge::GRAPH_FAILED;
+        }
+        gert::Range<gert::Shape> *outputRanges[optiling::GRAD_OUTPUT_NUM];
+        for (size_t i = 0; i < optiling::GRAD_OUTPUT_NUM; i++) {
+            outputRanges[i] = context->GetOutputShapeRange(i);
+            if (outputRanges[i] == nullptr || outputRanges[i]->GetMin() == nullptr ||
+                outputRanges[i]->GetMax() == nullptr) {
+                return ge::GRAPH_FAILED;
+            }
+        }
+        bool sparse = GetGradValueSparse(context->GetAttrs());
+        gert::Range<gert::Shape> *indexRange =
+            context->GetOutputShapeRange(optiling::GRAD_OUTPUT_GRAD_VALUE_INDEX_INDEX);
+        if (sparse && (indexRange == nullptr || indexRange->GetMin() == nullptr || indexRange->GetMax() == nullptr)) {
+            return ge::GRAPH_FAILED;
+        }
+        InferGradShapes(*valueRange->GetMin(), *samplingLocationsRange->GetMin(), sparse, false,
+                        *outputRanges[0]->GetMin(), *outputRanges[1]->GetMin(), *outputRanges[2]->GetMin(),
+                        indexRange == nullptr ? nullptr : indexRange->GetMin());
+        InferGradShapes(*valueRange->GetMax(), *samplingLocationsRange->GetMax(), sparse, true,
+                        *outputRanges[0]->GetMax(), *outputRanges[1]->GetMax(), *outputRanges[2]->GetMax(),
+                        indexRange == nullptr ? nullptr : indexRange->GetMax());
+        return GRAPH_SUCCESS;
+    }
+
+    // each gradient takes the dtype of the input it belongs to; grad_value_index holds int32 row numbers
+    static ge::graphStatus InferDataTypeForMultiScaleDeformableAttnGradV2(gert::InferDataTypeContext *context) {
+        context->SetOutputDataType(0, context->GetInputDataType(0));
+        context->SetOutputDataType(1, context->GetInputDataType(optiling::GRAD_INPUT_SAMPLING_LOC_INDEX));
+        context->SetOutputDataType(2, context->GetInputDataType(optiling::GRAD_INPUT_ATTN_WEIGHT_INDEX));
+        context->SetOutputDataType(optiling::GRAD_OUTPUT_GRAD_VALUE_INDEX_INDEX, ge::DT_INT32);
         return GRAPH_SUCCESS;
     }
 }
@@ -89,25 +364,27 @@ namespace ops {
                 .DataType({ge::DT_INT32})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
+                .ValueDepend(OPTIONAL)
 		.AutoContiguous();
             this->Input("level_start_index")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_INT32})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
+                .ValueDepend(OPTIONAL)
 		.AutoContiguous();
             this->Input("sampling_loc")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_FLOAT})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
-		.AutoContiguous();
+		.IgnoreContiguous();
             this->Input("attn_weight")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_FLOAT})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND})
-		.AutoContiguous();
+		.IgnoreContiguous();
             this->Input("grad_output")
                 .ParamType(REQUIRED)
                 .DataType({ge::DT_FLOAT})
@@ -129,13 +406,33 @@ namespace ops {
                 .DataType({ge::DT_FLOAT})
                 .Format({ge::FORMAT_ND})
                 .UnknownShapeFormat({ge::FORMAT_ND});
+            this->Output("grad_value_index")
+                .ParamType(OPTIONAL)
+                .DataType({ge::DT_INT32})
+                .Format({ge::FORMAT_ND})
+                .UnknownShapeFormat({ge::FORMAT_ND});
+            this->Attr("output_mask").AttrType(OPTIONAL).ListBool({true, true, true});
+            this->Attr("grad_output_row_stride").AttrType(OPTIONAL).Int(0);
+            this->Attr("grad_output_offset").AttrType(OPTIONAL).Int(0);
+            this->Attr("sampling_loc_row_stride").AttrType(OPTIONAL).Int(0);
+            this->Attr("sampling_loc_offset").AttrType(OPTIONAL).Int(0);
+            this->Attr("attn_weight_row_stride").AttrType(OPTIONAL).Int(0);
+            this->Attr("attn_weight_offset").AttrType(OPTIONAL).Int(0);
+            this->Attr("grad_value_sparse").AttrType(OPTIONAL).Bool(false);
 
-            this->SetInferShape(ge::InferShapeForMultiScaleDeformableAttnGradV2);
+            this->SetInferShape(ge::InferShapeForMultiScaleDeformableAttnGradV2)
+                .SetInferShapeRange(ge::InferShapeRangeForMultiScaleDeformableAttnGradV2)
+                .SetInferDataType(ge::InferDataTypeForMultiScaleDeformableAttnGradV2);
 
             this->AICore()
                 .SetTiling(optiling::TilingFuncForMultiScaleDeformableAttnGradV2);
 
-            this->AICore().AddConfig("ascend910b");
+            // same dynamic-shape binary setup as the forward op
+            OpAICoreConfig aiConfig;
+            aiConfig.DynamicCompileStaticFlag(true)
+                .DynamicShapeSupportFlag(true)
+                .DynamicRankSupportFlag(true);
+            this->AICore().AddConfig("ascend910b", aiConfig);
         }
     };
 
@@ -5,6 +5,7 @@
 namespace optiling {
     BEGIN_TILING_DATA_DEF(MultiScaleDeformableAttnGradV2TilingData)
     TILING_DATA_FIELD_DEF(uint32_t, batchSize)
+    TILING_DATA_FIELD_DEF(uint32_t, numSources)
     TILING_DATA_FIELD_DEF(uint32_t, numKeys)
     TILING_DATA_FIELD_DEF(uint32_t, numHeads)
     TILING_DATA_FIELD_DEF(uint32_t, embedDims)
@@ -12,6 +13,28 @@ namespace optiling {
     TILING_DATA_FIELD_DEF(uint32_t, numQueries)
     TILING_DATA_FIELD_DEF(uint32_t, numPoints)
     TILING_DATA_FIELD_DEF(uint32_t, coreNum)
+    TILING_DATA_FIELD_DEF(uint32_t, taskNumPerCore)
+    TILING_DATA_FIELD_DEF(uint32_t, cacheMode)
+    TILING_DATA_FIELD_DEF(uint32_t, gradValueMode)
+    TILING_DATA_FIELD_DEF(uint32_t, bucketTileRows)
+    TILING_DATA_FIELD_DEF(uint32_t, bucketTileNum)
+    TILING_DATA_FIELD_DEF(uint32_t, bucketTileNumAlign)
+    TILING_DATA_FIELD_DEF(uint32_t, bucketChunk)
+    TILING_DATA_FIELD_DEF(uint32_t, bucketCapacity)
+    TILING_DATA_FIELD_DEF(uint32_t, sparseRows)
+    TILING_DATA_FIELD_DEF(uint32_t, gradMask)
+    TILING_DATA_FIELD_DEF(uint32_t, gradOutputRowStride)
+    TILING_DATA_FIELD_DEF(uint32_t, gradOutputOffset)
+    TILING_DATA_FIELD_DEF(uint32_t, locationRowStride)
+    TILING_DATA_FIELD_DEF(uint32_t, locationOffset)
+    TILING_DATA_FIELD_DEF(uint32_t, weightRowStride)
+    TILING_DATA_FIELD_DEF(uint32_t, weightOffset)
+    TILING_DATA_FIELD_DEF(uint32_t, scheduleMode)
+    TILING_DATA_FIELD_DEF(uint32_t, scheduleChunk)
+    TILING_DATA_FIELD_DEF(uint32_t, levelTable)
+    TILING_DATA_FIELD_DEF_ARR(int32_t, 16, levelHeight)
+    TILING_DATA_FIELD_DEF_ARR(int32_t, 16, levelWidth)
+    TILING_DATA_FIELD_DEF_ARR(int32_t, 16, levelStart)
     END_TILING_DATA_DEF;
 
     REGISTER_TILING_DATA_CLASS(MultiScaleDeformableAttnGradV2, MultiScaleDeformableAttnGradV2TilingData)
@@ -0,0 +1,240 @@
+#ifndef MULTI_SCALE_DEFORMABLE_ATTN_V2_CAPTURE_H
+#define MULTI_SCALE_DEFORMABLE_ATTN_V2_CAPTURE_H
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Input capture for the MSDA ops, enabled by MSDA_CAPTURE=<path prefix>.
+//
+// The caller hands over host copies of the op inputs of one call and the attrs it passed; they are written to
+// <prefix>.<pid>.<seq>.msdacap, at most MSDA_CAPTURE_CALLS (default 1) files per process. A file is a
+// FileHeader (with the CallAttrs), tensorNum TensorRecords, then the tensor data, each tensor starting on a
+// CAPTURE_ALIGN boundary so a reader can use it straight from the mapping. All fields are little endian as
+// written by the host.
+namespace msda_capture {
+    const char CAPTURE_MAGIC[8] = {'M', 'S', 'D', 'A', 'C', 'A', 'P', '\0'};
+    // 2: FileHeader carries the call's attrs
+    const uint32_t CAPTURE_VERSION = 2;
+    const uint32_t CAPTURE_MAX_DIMS = 8;
+    const uint32_t CAPTURE_MAX_TENSORS = 16;
+    const size_t CAPTURE_NAME_BYTES = 32;
+    const uint64_t CAPTURE_ALIGN = 64;
+
+    // capture dtypes, the values of aclDataType for the types the ops accept
+    const uint32_t CAPTURE_DT_FLOAT = 0;
+    const uint32_t CAPTURE_DT_INT32 = 3;
+
+    // The attrs of the captured call, forward and backward, so a replay runs the same call: row views, pruning,
+    // output mask and the sparse grad_value layout. Fixed layout, 8 B aligned.
+    struct CallAttrs {
+        int64_t outputRowStride;
+        int64_t outputOffset;
+        int64_t locationRowStride;
+        int64_t locationOffset;
+        int64_t weightRowStride;
+        int64_t weightOffset;
+        int64_t gradOutputRowStride;
+        int64_t gradOutputOffset;
+        float weightThreshold;
+        uint8_t renormalizeWeights;
+        uint8_t outputMask[3];  // grad_value, grad_sampling_loc, grad_attn_weight
+        uint8_t gradValueSparse;
+        uint8_t reserved[7];
+    };
+
+    // The op defaults: dense rows, no pruning, every grad output, dense grad_value.
+    inline CallAttrs DefaultAttrs() {
+        CallAttrs attrs;
+        std::memset(&attrs, 0, sizeof(attrs));
+        attrs.outputMask[0] = attrs.outputMask[1] = attrs.outputMask[2] = 1;
+        return attrs;
+    }
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t tensorNum;
+        CallAttrs attrs;
+    };
+
+    struct TensorRecord {
+        char name[CAPTURE_NAME_BYTES];
+        uint32_t dtype;
+        uint32_t dimNum;
+        int64_t dims[CAPTURE_MAX_DIMS];
+        uint64_t offset;  // from the start of the file
+        // the storage the call's row view attrs address; more than the dims' elements for a strided view
+        uint64_t bytes;
+    };
+
+    // One host tensor to capture; data is not owned.
+    struct TensorView {
+        const char *name;
+        uint32_t dtype;
+        uint32_t dimNum;
+        const int64_t *dims;
+        const void *data;
+        uint64_t bytes;
+    };
+
+    inline const char *Prefix() {
+        static const char *prefix = [] {
+            const char *env = std::getenv("MSDA_CAPTURE");
+            return (env != nullptr && env[0] != '\0') ? env : static_cast<const char *>(nullptr);
+        }();
+        return prefix;
+    }
+
+    inline bool Enabled() {
+        return Prefix() != nullptr;
+    }
+
+    // Claims the next capture slot. False when capture is off or the per-process budget is spent, so a caller
+    // only pays for the device-to-host copies of the calls that are actually written.
+    inline bool Claim(uint32_t *seq) {
+        if (!Enabled()) {
+            return false;
+        }
+        static const uint32_t budget = [] {
+            const char *env = std::getenv("MSDA_CAPTURE_CALLS");
+            return env != nullptr ? static_cast<uint32_t>(std::strtoul(env, nullptr, 10)) : 1U;
+        }();
+        static std::atomic<uint32_t> next(0);
+        uint32_t index = next.fetch_add(1);
+        if (index >= budget) {
+            return false;
+        }
+        *seq = index;
+        return true;
+    }
+
+    inline uint64_t AlignUp(uint64_t x) {
+        return (x + CAPTURE_ALIGN - 1) / CAPTURE_ALIGN * CAPTURE_ALIGN;
+    }
+
+    // Writes one capture file for slot seq. Returns false on a malformed view or an I/O error.
+    inline bool Write(uint32_t seq, const CallAttrs &attrs, const TensorView *tensors, uint32_t tensorNum) {
+        if (tensorNum > CAPTURE_MAX_TENSORS) {
+            return false;
+        }
+        FileHeader header;
+        std::memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        header.version = CAPTURE_VERSION;
+        header.tensorNum = tensorNum;
+        header.attrs = attrs;
+
+        TensorRecord records[CAPTURE_MAX_TENSORS];
+        uint64_t offset = AlignUp(sizeof(FileHeader) + tensorNum * sizeof(TensorRecord));
+        for (uint32_t i = 0; i < tensorNum; i++) {
+            if (tensors[i].dimNum > CAPTURE_MAX_DIMS) {
+                return false;
+            }
+            std::memset(&records[i], 0, sizeof(TensorRecord));
+            std::snprintf(records[i].name, CAPTURE_NAME_BYTES, "%s", tensors[i].name);
+            records[i].dtype = tensors[i].dtype;
+            records[i].dimNum = tensors[i].dimNum;
+            for (uint32_t d = 0; d < tensors[i].dimNum; d++) {
+                records[i].dims[d] = tensors[i].dims[d];
+            }
+            records[i].offset = offset;
+            records[i].bytes = tensors[i].bytes;
+            offset = AlignUp(offset + tensors[i].bytes);
+        }
+
+        char path[1024];
+        std::snprintf(path, sizeof(path), "%s.%d.%u.msdacap", Prefix(), static_cast<int>(getpid()), seq);
+        FILE *file = std::fopen(path, "wb");
+        if (file == nullptr) {
+            return false;
+        }
+        static const char padding[CAPTURE_ALIGN] = {0};
+        bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1 &&
+                  std::fwrite(records, sizeof(TensorRecord), tensorNum, file) == tensorNum;
+        uint64_t written = sizeof(FileHeader) + tensorNum * sizeof(TensorRecord);
+        for (uint32_t i = 0; ok && i < tensorNum; i++) {
+            ok = std::fwrite(padding, 1, records[i].offset - written, file) == records[i].offset - written &&
+                 std::fwrite(tensors[i].data, 1, tensors[i].bytes, file) == tensors[i].bytes;
+            written = records[i].offset + tensors[i].bytes;
+        }
+        ok = (std::fclose(file) == 0) && ok;
+        return ok;
+    }
+
+    // Read-only mapping of one capture file. The records and data point into the mapping.
+    class MappedFile {
+    public:
+        MappedFile() : base_(nullptr), size_(0), header_(nullptr), records_(nullptr) {}
+        ~MappedFile() {
+            if (base_ != nullptr) {
+                munmap(base_, size_);
+            }
+        }
+
+        // Maps path and checks the header and that every tensor lies inside the file.
+        bool Open(const char *path) {
+            int fd = open(path, O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+            struct stat info;
+            if (fstat(fd, &info) != 0 || static_cast<uint64_t>(info.st_size) < sizeof(FileHeader)) {
+                close(fd);
+                return false;
+            }
+            size_ = static_cast<size_t>(info.st_size);
+            void *base = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (base == MAP_FAILED) {
+                return false;
+            }
+            base_ = base;
+            header_ = static_cast<const FileHeader *>(base_);
+            records_ = reinterpret_cast<const TensorRecord *>(header_ + 1);
+            if (std::memcmp(header_->magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0 ||
+                header_->version != CAPTURE_VERSION || header_->tensorNum > CAPTURE_MAX_TENSORS ||
+                sizeof(FileHeader) + header_->tensorNum * sizeof(TensorRecord) > size_) {
+                return false;
+            }
+            for (uint32_t i = 0; i < header_->tensorNum; i++) {
+                const TensorRecord &record = records_[i];
+                if (record.dimNum > CAPTURE_MAX_DIMS || record.offset > size_ || record.bytes > size_ - record.offset) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        // The record named name, or nullptr.
+        const TensorRecord *Find(const char *name) const {
+            for (uint32_t i = 0; i < header_->tensorNum; i++) {
+                if (std::strncmp(records_[i].name, name, CAPTURE_NAME_BYTES) == 0) {
+                    return &records_[i];
+                }
+            }
+            return nullptr;
+        }
+
+        const CallAttrs &Attrs() const {
+            return header_->attrs;
+        }
+
+        const void *Data(const TensorRecord &record) const {
+            return static_cast<const char *>(base_) + record.offset;
+        }
+
+    private:
+        MappedFile(const MappedFile &) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        void *base_;
+        size_t size_;
+        const FileHeader *header_;
+        const TensorRecord *records_;
+    };
+}
+#endif  // MULTI_SCALE_DEFORMABLE_ATTN_V2_CAPTURE_H
@@ -0,0 +1,416 @@
+#ifndef MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_COMMON_H
+#define MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_COMMON_H
+#include <cstdint>
+#include "multi_scale_deformable_attn_v2_tiling_table.h"
+
+namespace optiling {
+    const uint32_t MSDA_OP_FUNC = 0;
+    const uint32_t MSDA_OP_GRAD = 1;
+
+    // cacheMode: NORMAL keeps every GM tensor L2-cacheable, STREAM bypasses L2 for the
+    // once-touched tensors (locations, weights, outputs) so the value gathers keep it.
+    const uint32_t MSDA_CACHE_MODE_NORMAL = 0;
+    const uint32_t MSDA_CACHE_MODE_STREAM = 1;
+
+    // Tiling keys: embed_dims * 100 + num_points selects a kernel instantiation with those dims as
+    // compile-time constants, MSDA_TILING_KEY_GENERIC the runtime-shaped kernel. MSDA_TILING_KEY_LARGE is the
+    // runtime-shaped kernel with 64-bit GM offsets, for tensors past the int32 element range.
+    const uint64_t MSDA_TILING_KEY_GENERIC = 0;
+    const uint64_t MSDA_TILING_KEY_EMBED_FACTOR = 100;
+    const uint64_t MSDA_TILING_KEY_LARGE = 100000;
+    // runtime-shaped kernel in mixed AIC/AIV mode with the output projection fused in (int32 offsets only)
+    const uint64_t MSDA_TILING_KEY_PROJ = 200000;
+    const uint64_t MSDA_INT32_ELEMENT_LIMIT = 1ULL << 31;
+
+    // Forward head packing (one vector lane per (point, head)) pays off while a head's row is a fraction of a
+    // vector repeat. The weight broadcast works on whole 32 B lane groups and the column sum issues one repeat
+    // per lane, so the lane count must be a multiple of 8 and fit a uint8 repeat count.
+    const uint32_t MSDA_HEAD_PACK_MAX_EMBED_DIMS = 32;
+    const uint32_t MSDA_HEAD_PACK_LANE_ALIGN = 8;
+    const uint32_t MSDA_HEAD_PACK_MAX_LANES = 255;
+    // lanes * embed_dims floats: valueUb 8x, cornerWeightUb 4x, tmpResUb / tmpResUb3 1x each
+    const uint32_t MSDA_HEAD_PACK_UB_FACTOR = 14;
+    const uint64_t MSDA_HEAD_PACK_UB_RESERVE = 32 * 1024;
+
+    // Fused output projection: each AIV core samples up to this many of its queries (for every batch) into its
+    // workspace slab, then has its cube core multiply the slab by the projection weight. One AIC serves two AIVs.
+    const uint32_t MSDA_PROJ_CHUNK_QUERIES = 128;
+    const uint32_t MSDA_PROJ_AIV_PER_AIC = 2;
+
+    // Query scheduling: STATIC gives core i the tasks [i * taskNumPerCore, (i + 1) * taskNumPerCore), DYNAMIC
+    // lets the cores claim scheduleChunk-task chunks from a counter in workspace until the queries run out, so
+    // cores that drew cheap queries (out-of-range points, border queries) take over the rest. Dynamic pays off
+    // once every core gets a few chunks. The choice depends on the shape and core count only, never on the
+    // process environment, so cached tilings and compile-time workspace sizes agree with it.
+    const uint32_t MSDA_SCHEDULE_STATIC = 0;
+    const uint32_t MSDA_SCHEDULE_DYNAMIC = 1;
+    const uint32_t MSDA_SCHEDULE_CHUNKS_PER_CORE = 8;
+    const uint32_t MSDA_SCHEDULE_MIN_TASKS_PER_CORE = 8;
+    // one 32 B block at the start of the user workspace holds the counter
+    const uint64_t MSDA_SCHEDULE_COUNTER_BYTES = 32;
+
+    // Forward order: QUERY samples every (batch, level, head) slice of value per query, SLICE (level-outer) sweeps
+    // the core's queries once per slice, so its gathers stay inside one slice of value at a time. SLICE pays off
+    // once value overflows L2 while a slice, with room to spare for the streamed inputs (1 / FRACTION of L2),
+    // fits; it costs one location DMA per (query, slice) instead of one per query.
+    // The choice never depends on the environment: tune the shape into the table to force an order.
+    const uint32_t MSDA_FORWARD_ORDER_QUERY = 0;
+    const uint32_t MSDA_FORWARD_ORDER_SLICE = 1;
+    const uint64_t MSDA_FORWARD_ORDER_L2_FRACTION = 4;
+
+    // grad_value accumulation: ATOMIC scatters every corner sample with an atomic-add DMA, BUCKET sorts the
+    // samples by key tile into workspace and lets each core reduce the tiles it owns with plain writes. SPARSE
+    // is BUCKET that writes only the touched rows, compacted, plus their row indices (grad_value_sparse attr).
+    const uint32_t MSDA_GRAD_VALUE_ATOMIC = 0;
+    const uint32_t MSDA_GRAD_VALUE_BUCKET = 1;
+    const uint32_t MSDA_GRAD_VALUE_SPARSE = 2;
+    // corner samples per grad_value row above which atomic adds start queueing on the same rows
+    const uint64_t MSDA_BUCKET_MIN_DENSITY = 4;
+    const uint64_t MSDA_BUCKET_TILE_BYTES = 32 * 1024;
+    const uint64_t MSDA_BUCKET_CHUNK_BYTES = 16 * 1024;
+    const uint64_t MSDA_BUCKET_MAX_TILE_NUM = 4096;
+    const uint64_t MSDA_BUCKET_MAX_WORKSPACE = 1024ULL * 1024 * 1024;
+    const uint64_t MSDA_BLOCK_BYTES = 32;
+
+    // gradMask bits, one per grad op output, set from the output_mask attr
+    const uint32_t MSDA_GRAD_MASK_VALUE = 1;
+    const uint32_t MSDA_GRAD_MASK_LOCATION = 2;
+    const uint32_t MSDA_GRAD_MASK_WEIGHT = 4;
+    const uint32_t MSDA_GRAD_MASK_ALL = MSDA_GRAD_MASK_VALUE | MSDA_GRAD_MASK_LOCATION | MSDA_GRAD_MASK_WEIGHT;
+
+    struct MsdaTilingShape {
+        // batch of sampling_locations; value / output (grad_value / grad_output) stack numSources such batches
+        uint32_t batchSize;
+        uint32_t numSources;
+        uint32_t numQueries;
+        uint32_t numHeads;
+        uint32_t numKeys;
+        uint32_t embedDims;
+        uint32_t numLevels;
+        uint32_t numPoints;
+        // (bs, Q, H*E) output / grad_output as a row view: row (b, q) starts at rowOffset + (b*Q + q)*rowStride
+        uint64_t rowStride;
+        uint64_t rowOffset;
+        // sampling_locations / attention_weights as row views, same addressing; rows of H*L*P*2 / H*L*P
+        uint64_t locationRowStride;
+        uint64_t locationOffset;
+        uint64_t weightRowStride;
+        uint64_t weightOffset;
+    };
+
+    struct MsdaTilingChoice {
+        uint32_t usedCoreNum;
+        uint32_t taskNumPerCore;
+        uint32_t cacheMode;
+        uint32_t scheduleMode;
+        uint32_t scheduleChunk;
+    };
+
+    struct MsdaBucketPlan {
+        uint32_t gradValueMode;
+        uint32_t tileRows;
+        uint32_t tileNum;
+        uint32_t tileNumAlign;
+        uint32_t chunk;
+        uint32_t capacity;
+        uint64_t workspaceBytes;
+    };
+
+    // log2 bucket, must match bucket_of() in tools/msda_tiling_tuner.py
+    inline uint32_t MsdaTilingBucket(uint64_t x) {
+        uint32_t bucket = 0;
+        while (x > 1) {
+            x >>= 1;
+            bucket++;
+        }
+        return bucket;
+    }
+
+    inline const MsdaTilingTableEntry *MsdaLookupTilingTable(uint32_t op, const MsdaTilingShape &shape,
+                                                             uint32_t coreNum) {
+        if (coreNum != MSDA_TILING_TABLE_CORE_NUM) {
+            return nullptr;
+        }
+        uint32_t batchBucket = MsdaTilingBucket(shape.batchSize);
+        uint32_t queryBucket = MsdaTilingBucket(shape.numQueries);
+        uint32_t keyBucket = MsdaTilingBucket(shape.numKeys);
+        for (const MsdaTilingTableEntry &entry : MSDA_TILING_TABLE) {
+            if (entry.usedCoreNum != 0 && entry.op == op && entry.embedDims == shape.embedDims &&
+                entry.numHeads == shape.numHeads && entry.numLevels == shape.numLevels &&
+                entry.numPoints == shape.numPoints && entry.batchBucket == batchBucket &&
+                entry.queryBucket == queryBucket && entry.keyBucket == keyBucket) {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // Tuned split from the compiled-in table, or the formula (every core, even split) for unseen shapes.
+    // minCoreNum keeps blocks the kernel relies on regardless of the split (e.g. output clearing).
+    inline MsdaTilingChoice MsdaChooseTiling(uint32_t op, const MsdaTilingShape &shape, uint32_t coreNum,
+                                             uint32_t minCoreNum) {
+        MsdaTilingChoice choice = {coreNum, 0, MSDA_CACHE_MODE_NORMAL, MSDA_SCHEDULE_STATIC, 0};
+        const MsdaTilingTableEntry *entry = MsdaLookupTilingTable(op, shape, coreNum);
+        if (entry != nullptr) {
+            choice.usedCoreNum = entry->usedCoreNum < coreNum ? entry->usedCoreNum : coreNum;
+            choice.cacheMode = entry->cacheMode;
+        }
+        uint32_t taskNum = shape.numQueries > 0 ? shape.numQueries : 1;
+        if (choice.usedCoreNum > taskNum) {
+            choice.usedCoreNum = taskNum;
+        }
+        if (choice.usedCoreNum < minCoreNum) {
+            choice.usedCoreNum = minCoreNum < coreNum ? minCoreNum : coreNum;
+        }
+        choice.taskNumPerCore = (taskNum + choice.usedCoreNum - 1) / choice.usedCoreNum;
+        return choice;
+    }
+
+    // Switches choice to dynamic scheduling when every core would claim several chunks. allowed is false for
+    // the kernel paths that depend on the static ranges (bucketed grad_value, the fused projection).
+    inline void MsdaChooseSchedule(MsdaTilingChoice &choice, bool allowed) {
+        choice.scheduleMode = MSDA_SCHEDULE_STATIC;
+        choice.scheduleChunk = 0;
+        bool dynamic = choice.usedCoreNum > 1 && choice.taskNumPerCore >= MSDA_SCHEDULE_MIN_TASKS_PER_CORE;
+        if (!allowed || !dynamic) {
+            return;
+        }
+        choice.scheduleMode = MSDA_SCHEDULE_DYNAMIC;
+        choice.scheduleChunk = (choice.taskNumPerCore + MSDA_SCHEDULE_CHUNKS_PER_CORE - 1) /
+                               MSDA_SCHEDULE_CHUNKS_PER_CORE;
+    }
+
+    // Forward order for the shape: the table's when the shape was tuned, else the L2 rule above. sliceKeys is the
+    // key count of the largest slice (the largest level, or num_keys when the levels are unknown). allowed is
+    // false for the paths that keep whole query rows on one core (head packing, query split, sources, the fused
+    // projection, renormalized weights).
+    inline uint32_t MsdaChooseForwardOrder(const MsdaTilingShape &shape, uint32_t coreNum, uint64_t sliceKeys,
+                                           uint64_t l2Bytes, bool allowed) {
+        if (!allowed) {
+            return MSDA_FORWARD_ORDER_QUERY;
+        }
+        const MsdaTilingTableEntry *entry = MsdaLookupTilingTable(MSDA_OP_FUNC, shape, coreNum);
+        if (entry != nullptr) {
+            return entry->forwardOrder;
+        }
+        uint64_t rowBytes = static_cast<uint64_t>(shape.embedDims) * sizeof(float);
+        uint64_t valueBytes = static_cast<uint64_t>(shape.numSources) * shape.batchSize * shape.numHeads *
+                              shape.numKeys * rowBytes;
+        bool sliceFits = MSDA_FORWARD_ORDER_L2_FRACTION * sliceKeys * rowBytes <= l2Bytes;
+        return (l2Bytes > 0 && valueBytes > l2Bytes && sliceFits) ? MSDA_FORWARD_ORDER_SLICE
+                                                                  : MSDA_FORWARD_ORDER_QUERY;
+    }
+
+    inline uint64_t MsdaShapeTilingKey(uint32_t embedDims, uint32_t numPoints) {
+        bool embedSpecialized = embedDims == 32 || embedDims == 64 || embedDims == 128 || embedDims == 256;
+        bool pointsSpecialized = numPoints == 4 || numPoints == 8;
+        if (!embedSpecialized || !pointsSpecialized) {
+            return MSDA_TILING_KEY_GENERIC;
+        }
+        return embedDims * MSDA_TILING_KEY_EMBED_FACTOR + numPoints;
+    }
+
+    // Any GM tensor of either op (value / grad_value, sampling locations / their grad, output / grad_output)
+    // reaching 2^31 elements needs 64-bit offsets in the kernel.
+    inline bool MsdaIsLargeTensor(const MsdaTilingShape &shape) {
+        uint64_t valueNum = static_cast<uint64_t>(shape.numSources) * shape.batchSize * shape.numKeys *
+                            shape.numHeads * shape.embedDims;
+        uint64_t queryNum = static_cast<uint64_t>(shape.batchSize) * shape.numQueries * shape.numHeads;
+        uint64_t locationNum = queryNum * shape.numLevels * shape.numPoints * 2;
+        uint64_t rows = static_cast<uint64_t>(shape.batchSize) * shape.numQueries;
+        uint64_t outputNum = shape.rowOffset + shape.numSources * rows * shape.rowStride;
+        uint64_t locationViewNum = shape.locationOffset + rows * shape.locationRowStride;
+        uint64_t weightViewNum = shape.weightOffset + rows * shape.weightRowStride;
+        return valueNum >= MSDA_INT32_ELEMENT_LIMIT || locationNum >= MSDA_INT32_ELEMENT_LIMIT ||
+               outputNum >= MSDA_INT32_ELEMENT_LIMIT || locationViewNum >= MSDA_INT32_ELEMENT_LIMIT ||
+               weightViewNum >= MSDA_INT32_ELEMENT_LIMIT;
+    }
+
+    // Resolves the row_stride / offset attrs (0 stride: dense rows of H*E) against the view's storage size.
+    // Rows are written and read with whole 32 B blocks, so stride and offset must stay block aligned.
+    inline bool MsdaSetRowView(MsdaTilingShape &shape, int64_t rowStride, int64_t rowOffset, uint64_t storageSize) {
+        uint64_t rowNum = static_cast<uint64_t>(shape.numHeads) * shape.embedDims;
+        uint64_t align = MSDA_BLOCK_BYTES / sizeof(float);
+        if (rowStride < 0 || rowOffset < 0) {
+            return false;
+        }
+        shape.rowStride = rowStride == 0 ? rowNum : static_cast<uint64_t>(rowStride);
+        shape.rowOffset = static_cast<uint64_t>(rowOffset);
+        if (shape.rowStride < rowNum || shape.rowStride % align != 0 || shape.rowOffset % align != 0 ||
+            shape.rowStride > UINT32_MAX || shape.rowOffset > UINT32_MAX) {
+            return false;
+        }
+        uint64_t rows = static_cast<uint64_t>(shape.numSources) * shape.batchSize * shape.numQueries;
+        return rows == 0 || shape.rowOffset + (rows - 1) * shape.rowStride + rowNum <= storageSize;
+    }
+
+    // Input row views (0 stride: dense rows of rowNum). The kernels fetch input rows with DataCopyPad, so unlike
+    // the output view they need no block alignment, only a stride that covers the row and a fit in storage.
+    // The inputs skip the framework's contiguous copy, so a 0 stride also requires storage to hold exactly the
+    // logical rows: a strided tensor passed without its view attrs is rejected instead of read as dense.
+    inline bool MsdaResolveInputView(uint64_t rowNum, uint64_t rows, int64_t rowStride, int64_t rowOffset,
+                                     uint64_t storageSize, uint64_t &stride, uint64_t &offset) {
+        if (rowStride < 0 || rowOffset < 0 || (rowStride == 0 && storageSize != rows * rowNum)) {
+            return false;
+        }
+        stride = rowStride == 0 ? rowNum : static_cast<uint64_t>(rowStride);
+        offset = static_cast<uint64_t>(rowOffset);
+        if (stride < rowNum || stride > UINT32_MAX || offset > UINT32_MAX) {
+            return false;
+        }
+        return rows == 0 || offset + (rows - 1) * stride + rowNum <= storageSize;
+    }
+
+    // Multi-source mode (e.g. temporal self-attention over the current and the history BEV): value carries
+    // numSources batches of bs, source-major, that all sample with the one (bs, ...) set of locations and weights.
+    // A value batch that is not a multiple of the locations' batch is rejected.
+    inline bool MsdaSetSources(MsdaTilingShape &shape, int64_t valueBatch, int64_t locationBatch) {
+        if (valueBatch <= 0 || locationBatch <= 0 || valueBatch % locationBatch != 0) {
+            return false;
+        }
+        shape.batchSize = static_cast<uint32_t>(locationBatch);
+        shape.numSources = static_cast<uint32_t>(valueBatch / locationBatch);
+        return true;
+    }
+
+    inline bool MsdaSetInputViews(MsdaTilingShape &shape, int64_t locationRowStride, int64_t locationOffset,
+                                  uint64_t locationStorageSize, int64_t weightRowStride, int64_t weightOffset,
+                                  uint64_t weightStorageSize) {
+        uint64_t rows = static_cast<uint64_t>(shape.batchSize) * shape.numQueries;
+        uint64_t weightNum = static_cast<uint64_t>(shape.numHeads) * shape.numLevels * shape.numPoints;
+        return MsdaResolveInputView(2 * weightNum, rows, locationRowStride, locationOffset, locationStorageSize,
+                                    shape.locationRowStride, shape.locationOffset) &&
+               MsdaResolveInputView(weightNum, rows, weightRowStride, weightOffset, weightStorageSize,
+                                    shape.weightRowStride, shape.weightOffset);
+    }
+
+    inline uint64_t MsdaTilingKey(const MsdaTilingShape &shape) {
+        if (MsdaIsLargeTensor(shape)) {
+            return MSDA_TILING_KEY_LARGE;
+        }
+        return MsdaShapeTilingKey(shape.embedDims, shape.numPoints);
+    }
+
+    inline bool MsdaUseHeadPacked(const MsdaTilingShape &shape, uint64_t ubSize) {
+        uint64_t lanes = static_cast<uint64_t>(shape.numHeads) * shape.numPoints;
+        if (shape.embedDims > MSDA_HEAD_PACK_MAX_EMBED_DIMS || shape.embedDims % MSDA_HEAD_PACK_LANE_ALIGN != 0 ||
+            lanes % MSDA_HEAD_PACK_LANE_ALIGN != 0 || lanes > MSDA_HEAD_PACK_MAX_LANES) {
+            return false;
+        }
+        uint64_t packedBytes = MSDA_HEAD_PACK_UB_FACTOR * lanes * shape.embedDims * sizeof(float);
+        return packedBytes + MSDA_HEAD_PACK_UB_RESERVE <= ubSize;
+    }
+
+    // Level table: value_spatial_shapes / value_level_start_index are value-depend inputs, so when the host can
+    // read them every level's H, W and first key go into the tiling data and the kernels skip the GM reads.
+    const uint32_t MSDA_MAX_LEVELS = 16;
+
+    struct MsdaLevelTable {
+        int32_t height[MSDA_MAX_LEVELS];
+        int32_t width[MSDA_MAX_LEVELS];
+        int32_t start[MSDA_MAX_LEVELS];
+    };
+
+    // Fills table from host copies of the two inputs (null when their values are unknown at tiling time). False
+    // leaves the kernels reading the inputs from GM: values missing, too many levels, or a level past num_keys.
+    inline bool MsdaBuildLevelTable(const int32_t *shapes, const int32_t *starts, const MsdaTilingShape &shape,
+                                    MsdaLevelTable &table) {
+        if (shapes == nullptr || starts == nullptr || shape.numLevels > MSDA_MAX_LEVELS) {
+            return false;
+        }
+        for (uint32_t level = 0; level < shape.numLevels; level++) {
+            int32_t height = shapes[level * 2];
+            int32_t width = shapes[level * 2 + 1];
+            if (height < 1 || width < 1 || starts[level] < 0 ||
+                static_cast<uint64_t>(starts[level]) + static_cast<uint64_t>(height) * width > shape.numKeys) {
+                return false;
+            }
+            table.height[level] = height;
+            table.width[level] = width;
+            table.start[level] = starts[level];
+        }
+        return true;
+    }
+
+    inline uint64_t MsdaAlignUp(uint64_t x, uint64_t align) {
+        return (x + align - 1) / align * align;
+    }
+
+    // UB taken by the grad kernel's per-level buffers (see InitBuffer), float data. The grad tiling fails when it
+    // exceeds UB on any path; topGradUb grows with numSources, so this is what bounds the source count. Must match
+    // the grad branch of ub_usage() in tools/msda_tiling_tuner.py.
+    inline uint64_t MsdaGradUbBytes(const MsdaTilingShape &shape) {
+        uint64_t align = MSDA_BLOCK_BYTES / sizeof(float);
+        uint64_t pointsAlign = MsdaAlignUp(shape.numPoints, align);
+        uint64_t levelsAlign = MsdaAlignUp(shape.numLevels, align);
+        uint64_t pe = static_cast<uint64_t>(shape.numPoints) * shape.embedDims;
+        // the per-head inputs (2 location rows and 1 weight row per level, grad_output's row of every source)
+        // and the three per-level sums are double-buffered
+        uint64_t words = 3 * levelsAlign + 2 * 3 * static_cast<uint64_t>(shape.numLevels) * pointsAlign +
+                         2 * (shape.numSources + 1ULL) * shape.embedDims + 22 * pointsAlign + 19 * pe;
+        // point-compaction bit mask, one bit per point in 256-point vector repeats
+        return words * sizeof(float) + MsdaAlignUp(shape.numPoints, 256) / 8;
+    }
+
+    // Rows of the sparse grad_value outputs: no more than the dense rows, nor than the corner samples.
+    inline uint64_t MsdaSparseRows(const MsdaTilingShape &shape) {
+        uint64_t rows = static_cast<uint64_t>(shape.batchSize) * shape.numHeads * shape.numKeys;
+        uint64_t samples = 4ULL * shape.batchSize * shape.numQueries * shape.numHeads * shape.numLevels *
+                           shape.numPoints;
+        return samples < rows ? samples : rows;
+    }
+
+    // Bucketed grad_value when corner samples crowd the grad_value rows and the sort fits UB / workspace. sparse
+    // asks for the SPARSE plan regardless of density; the result is ATOMIC when it does not fit.
+    inline MsdaBucketPlan MsdaChooseGradValueMode(const MsdaTilingShape &shape, const MsdaTilingChoice &choice,
+                                                  uint64_t ubSize, bool sparse) {
+        MsdaBucketPlan plan = {MSDA_GRAD_VALUE_ATOMIC, 0, 0, 0, 0, 0, 0};
+        uint64_t align = MSDA_BLOCK_BYTES / sizeof(int32_t);
+        uint64_t rows = static_cast<uint64_t>(shape.batchSize) * shape.numHeads * shape.numKeys;
+        uint64_t samplesPerQuery = 4ULL * shape.batchSize * shape.numHeads * shape.numLevels * shape.numPoints;
+        uint64_t samples = samplesPerQuery * shape.numQueries;
+        if (rows == 0 || (!sparse && samples < MSDA_BUCKET_MIN_DENSITY * rows)) {
+            return plan;
+        }
+        uint64_t rowBytes = static_cast<uint64_t>(shape.embedDims) * sizeof(float);
+        uint64_t tileRows = MSDA_BUCKET_TILE_BYTES / rowBytes;
+        uint64_t chunk = MSDA_BUCKET_CHUNK_BYTES / (rowBytes + MSDA_BLOCK_BYTES);
+        if (tileRows == 0 || chunk == 0) {
+            return plan;
+        }
+        uint64_t tileNum = (rows + tileRows - 1) / tileRows;
+        uint64_t tileNumAlign = MsdaAlignUp(tileNum + 1, align);
+        if (tileNum > MSDA_BUCKET_MAX_TILE_NUM) {
+            return plan;
+        }
+        uint64_t bucketUb = tileNumAlign * sizeof(int32_t) + 4ULL * shape.numPoints * MSDA_BLOCK_BYTES +
+                            static_cast<uint64_t>(choice.usedCoreNum) * MSDA_BLOCK_BYTES + tileRows * rowBytes +
+                            chunk * (rowBytes + MSDA_BLOCK_BYTES);
+        if (sparse) {
+            // touched-row flags of the tile being reduced, compacted in place into its row indices
+            bucketUb += MsdaAlignUp(tileRows, align) * sizeof(int32_t);
+        }
+        if (MsdaGradUbBytes(shape) + bucketUb > ubSize) {
+            return plan;
+        }
+        uint64_t capacity = samplesPerQuery * choice.taskNumPerCore;
+        uint64_t workspaceBytes = static_cast<uint64_t>(choice.usedCoreNum) *
+                                  (tileNumAlign * sizeof(int32_t) + capacity * (MSDA_BLOCK_BYTES + rowBytes));
+        if (capacity > UINT32_MAX || workspaceBytes > MSDA_BUCKET_MAX_WORKSPACE) {
+            return plan;
+        }
+        if (sparse) {
+            // the slot counter of the compacted rows follows the bucket regions
+            workspaceBytes += MSDA_SCHEDULE_COUNTER_BYTES;
+        }
+        plan.gradValueMode = sparse ? MSDA_GRAD_VALUE_SPARSE : MSDA_GRAD_VALUE_BUCKET;
+        plan.tileRows = static_cast<uint32_t>(tileRows);
+        plan.tileNum = static_cast<uint32_t>(tileNum);
+        plan.tileNumAlign = static_cast<uint32_t>(tileNumAlign);
+        plan.chunk = static_cast<uint32_t>(chunk);
+        plan.capacity = static_cast<uint32_t>(capacity);
+        plan.workspaceBytes = workspaceBytes;
+        return plan;
+    }
+} // namespace optiling
+#endif // MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_COMMON_H
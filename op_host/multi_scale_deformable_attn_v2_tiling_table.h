@@ -0,0 +1,47 @@
+// Generated by tools/msda_tiling_tuner.py. Do not edit by hand.
+// core num: 40, ub bytes: 196608, l2 bytes: 201326592, scales (dma, vec, fixed): 1.000 1.000 1.000
+#ifndef MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_TABLE_H
+#define MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_TABLE_H
+#include <cstdint>
+
+namespace optiling {
+    struct MsdaTilingTableEntry {
+        uint32_t op;
+        uint32_t embedDims;
+        uint32_t numHeads;
+        uint32_t numLevels;
+        uint32_t numPoints;
+        uint32_t batchBucket;
+        uint32_t queryBucket;
+        uint32_t keyBucket;
+        uint32_t usedCoreNum;
+        uint32_t cacheMode;
+        uint32_t forwardOrder;
+    };
+
+    const uint32_t MSDA_TILING_TABLE_CORE_NUM = 40;
+
+    const MsdaTilingTableEntry MSDA_TILING_TABLE[] = {
+        {0, 32, 8, 1, 4, 0, 15, 15, 40, 0, 0}, // 13178.6 us
+        {0, 32, 8, 1, 4, 1, 11, 11, 40, 0, 0}, // 1664.4 us
+        {0, 32, 8, 3, 4, 1, 13, 13, 40, 0, 0}, // 15977.5 us
+        {0, 32, 8, 4, 4, 0, 14, 14, 40, 0, 0}, // 25234.3 us
+        {0, 32, 8, 4, 4, 1, 8, 14, 38, 0, 0}, // 811.5 us
+        {0, 32, 8, 4, 4, 1, 9, 14, 40, 0, 0}, // 2325.6 us
+        {0, 32, 8, 4, 8, 0, 11, 14, 40, 0, 0}, // 5804.6 us
+        {0, 64, 4, 4, 4, 0, 12, 14, 40, 0, 0}, // 2676.8 us
+        {0, 64, 8, 1, 4, 2, 15, 15, 40, 1, 1}, // 56366.7 us
+        {0, 128, 4, 4, 8, 0, 10, 14, 40, 0, 0}, // 1314.6 us
+        {1, 32, 8, 1, 4, 0, 15, 15, 40, 0, 0}, // 35608.6 us
+        {1, 32, 8, 1, 4, 1, 11, 11, 40, 0, 0}, // 4491.0 us
+        {1, 32, 8, 3, 4, 1, 13, 13, 40, 0, 0}, // 44019.6 us
+        {1, 32, 8, 4, 4, 0, 14, 14, 40, 0, 0}, // 69701.3 us
+        {1, 32, 8, 4, 4, 1, 8, 14, 38, 0, 0}, // 2571.0 us
+        {1, 32, 8, 4, 4, 1, 9, 14, 40, 0, 0}, // 6742.6 us
+        {1, 32, 8, 4, 8, 0, 11, 14, 40, 0, 0}, // 16356.6 us
+        {1, 64, 4, 4, 4, 0, 12, 14, 40, 0, 0}, // 7387.9 us
+        {1, 64, 8, 1, 4, 2, 15, 15, 40, 0, 0}, // 167808.8 us
+        {1, 128, 4, 4, 8, 0, 10, 14, 40, 0, 0}, // 3767.3 us
+    };
+} // namespace optiling
+#endif // MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_TABLE_H
@@ -0,0 +1,187 @@
+#ifndef MULTI_SCALE_DEFORMABLE_ATTN_V2_TRACE_H
+#define MULTI_SCALE_DEFORMABLE_ATTN_V2_TRACE_H
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Host-side launch tracing in Chrome trace format, enabled by MSDA_TRACE=<path prefix>.
+//
+// Every thread appends to its own chunked event buffer and publishes the count with a release store, so
+// recording takes no lock. The buffers hang off a lock-free list that is walked once at exit to write
+// <prefix>.<pid>.<module>.json. MSDA_TRACE_MODULE names the writing library: the tiling functions and the
+// aclnn caller live in different shared objects, each with its own buffers and file. Timestamps are steady
+// clock microseconds and tids are OS thread ids, so the files of one process line up on the same tracks
+// (tools/msda_trace_merge.py joins them).
+#ifndef MSDA_TRACE_MODULE
+#define MSDA_TRACE_MODULE "app"
+#endif
+
+namespace msda_trace {
+    const size_t TRACE_CHUNK_EVENTS = 1024;
+    const size_t TRACE_NAME_BYTES = 64;
+    const size_t TRACE_ARGS_BYTES = 512;
+
+    struct Event {
+        char name[TRACE_NAME_BYTES];
+        char args[TRACE_ARGS_BYTES];  // JSON object body without braces, may be empty
+        uint64_t ts;
+        uint64_t dur;
+    };
+
+    struct Chunk {
+        Event events[TRACE_CHUNK_EVENTS];
+        std::atomic<size_t> count;
+        Chunk *next;  // written by the owner before the chunk is linked, read only after
+        Chunk() : count(0), next(nullptr) {}
+    };
+
+    struct ThreadBuffer {
+        uint32_t tid;
+        Chunk *head;
+        std::atomic<Chunk *> tail;
+        ThreadBuffer *next;
+    };
+
+    struct Registry {
+        const char *prefix;
+        std::atomic<ThreadBuffer *> threads;
+    };
+
+    inline void Flush();
+
+    inline Registry &GetRegistry() {
+        static Registry *registry = [] {
+            Registry *r = new Registry();
+            const char *prefix = std::getenv("MSDA_TRACE");
+            r->prefix = (prefix != nullptr && prefix[0] != '\0') ? prefix : nullptr;
+            r->threads.store(nullptr);
+            if (r->prefix != nullptr) {
+                std::atexit(Flush);
+            }
+            return r;
+        }();
+        return *registry;
+    }
+
+    inline bool Enabled() {
+        return GetRegistry().prefix != nullptr;
+    }
+
+    inline uint64_t NowUs() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                         std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    inline ThreadBuffer &GetThreadBuffer() {
+        static thread_local ThreadBuffer *buffer = nullptr;
+        if (buffer == nullptr) {
+            Registry &registry = GetRegistry();
+            buffer = new ThreadBuffer();
+            buffer->tid = static_cast<uint32_t>(syscall(SYS_gettid));
+            buffer->head = new Chunk();
+            buffer->tail.store(buffer->head);
+            ThreadBuffer *top = registry.threads.load();
+            do {
+                buffer->next = top;
+            } while (!registry.threads.compare_exchange_weak(top, buffer));
+        }
+        return *buffer;
+    }
+
+    // Appends one complete ("X") event to the calling thread's buffer.
+    inline void Record(const char *name, uint64_t ts, uint64_t dur, const char *args) {
+        ThreadBuffer &buffer = GetThreadBuffer();
+        Chunk *chunk = buffer.tail.load(std::memory_order_relaxed);
+        size_t index = chunk->count.load(std::memory_order_relaxed);
+        if (index == TRACE_CHUNK_EVENTS) {
+            Chunk *fresh = new Chunk();
+            chunk->next = fresh;
+            buffer.tail.store(fresh, std::memory_order_release);
+            chunk = fresh;
+            index = 0;
+        }
+        Event &event = chunk->events[index];
+        std::snprintf(event.name, TRACE_NAME_BYTES, "%s", name);
+        std::snprintf(event.args, TRACE_ARGS_BYTES, "%s", args == nullptr ? "" : args);
+        event.ts = ts;
+        event.dur = dur;
+        chunk->count.store(index + 1, std::memory_order_release);
+    }
+
+    // Times its own lifetime as one complete event; Args() attaches "key": value pairs in printf style.
+    class Scope {
+    public:
+        explicit Scope(const char *name) : name_(name), enabled_(Enabled()), start_(0) {
+            args_[0] = '\0';
+            if (enabled_) {
+                start_ = NowUs();
+            }
+        }
+        ~Scope() {
+            if (enabled_) {
+                Record(name_, start_, NowUs() - start_, args_);
+            }
+        }
+        void Args(const char *format, ...) {
+            if (!enabled_) {
+                return;
+            }
+            va_list list;
+            va_start(list, format);
+            std::vsnprintf(args_, TRACE_ARGS_BYTES, format, list);
+            va_end(list);
+        }
+
+    private:
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+        const char *name_;
+        bool enabled_;
+        uint64_t start_;
+        char args_[TRACE_ARGS_BYTES];
+    };
+
+    inline void Flush() {
+        Registry &registry = GetRegistry();
+        if (registry.prefix == nullptr) {
+            return;
+        }
+        char path[1024];
+        std::snprintf(path, sizeof(path), "%s.%d.%s.json", registry.prefix, static_cast<int>(getpid()),
+                      MSDA_TRACE_MODULE);
+        FILE *file = std::fopen(path, "w");
+        if (file == nullptr) {
+            return;
+        }
+        std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        bool first = true;
+        for (ThreadBuffer *buffer = registry.threads.load(); buffer != nullptr; buffer = buffer->next) {
+            Chunk *tail = buffer->tail.load(std::memory_order_acquire);
+            for (Chunk *chunk = buffer->head;; chunk = chunk->next) {
+                size_t count = chunk->count.load(std::memory_order_acquire);
+                for (size_t i = 0; i < count; i++) {
+                    const Event &event = chunk->events[i];
+                    std::fprintf(file,
+                                 "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+                                 "\"pid\":%d,\"tid\":%u,\"args\":{%s}}",
+                                 first ? "" : ",\n", event.name, MSDA_TRACE_MODULE,
+                                 static_cast<unsigned long long>(event.ts),
+                                 static_cast<unsigned long long>(event.dur), static_cast<int>(getpid()),
+                                 buffer->tid, event.args);
+                    first = false;
+                }
+                if (chunk == tail) {
+                    break;
+                }
+            }
+        }
+        std::fprintf(file, "\n]}\n");
+        std::fclose(file);
+    }
+}
+#endif  // MULTI_SCALE_DEFORMABLE_ATTN_V2_TRACE_H
@@ -1,6 +1,23 @@
 #include "kernel_operator.h"
+#include "lib/matmul_intf.h"
 using namespace AscendC;
 
+constexpr uint32_t CACHE_MODE_STREAM = 1;
+constexpr uint32_t MAX_DATA_COPY_STRIDE = 65535;
+constexpr uint32_t SCHEDULE_DYNAMIC = 1;
+constexpr uint32_t FORWARD_ORDER_SLICE = 1;
+constexpr uint32_t MAX_LEVELS = 16;
+
+// fused output projection: sampled rows (M = queries, K = H * E) @ output_proj_weight^T (N = D, stored (D, K))
+using ProjMatmul = matmul::Matmul<matmul::MatmulType<TPosition::GM, CubeFormat::ND, float>,
+                                  matmul::MatmulType<TPosition::GM, CubeFormat::ND, float, true>,
+                                  matmul::MatmulType<TPosition::GM, CubeFormat::ND, float>,
+                                  matmul::MatmulType<TPosition::GM, CubeFormat::ND, float>>;
+
+// EMBED_DIMS / NUM_POINTS != 0 fold the shape into the instantiation (see the tiling keys at the kernel entry),
+// 0 keeps the runtime value from tiling data. OFFSET_T carries GM element offsets: int32_t, or int64_t on the
+// large-tensor path for tensors past 2^31 elements.
+template <uint32_t EMBED_DIMS, uint32_t NUM_POINTS, typename OFFSET_T>
 class KernelMultiScaleDeformableAttnFuncV2 {
 public:
     __aicore__ inline KernelMultiScaleDeformableAttnFuncV2() {}
@@ -11,6 +28,7 @@ public:
         ASSERT(GetBlockNum() != 0 && "block dim can not be zero!");
         dataAlign = blockNum / sizeof(DTYPE_VALUE);
         batchSize = tiling_data->batchSize;
+        numSources = tiling_data->numSources;
         numKeys = tiling_data->numKeys;
         numHeads = tiling_data->numHeads;
         embedDims = tiling_data->embedDims;
@@ -21,15 +39,51 @@ public:
         coreNum = tiling_data->coreNum;
 
         tailNum = numHeads * embedDims;
-
-        taskNum = numQueries;
-        taskNumPerCore = DivCeil(taskNum, coreNum);
+        outputRowStride = tiling_data->outputRowStride;
+        locationRowStride = tiling_data->locationRowStride;
+        weightRowStride = tiling_data->weightRowStride;
+        weightThreshold = tiling_data->weightThreshold;
+        prunePoints = weightThreshold > (DTYPE_VALUE)0;
+        renormalizeWeights = tiling_data->renormalizeWeights != 0;
+
+        // latency mode: task = (query, part), part p covering (head, level) pairs [p, p + 1) * pairs / split
+        querySplit = tiling_data->querySplit;
+        pairEnd = numHeads * numLevels;
+        taskNum = numQueries * querySplit;
+        taskNumPerCore = tiling_data->taskNumPerCore;
+        forwardOrder = tiling_data->forwardOrder;
 
         numPointsAlign = AlignUp(numPoints, dataAlign);
         numLevelsAlign = AlignUp(numLevels, dataAlign);
+        shapesAlign = AlignUp(numLevels * 2, dataAlign);
+        locationAlign = AlignUp(numHeads * numLevels * numPoints * 2, dataAlign);
 
         batchOffset = numPoints * embedDims;
 
+        // head-packed mode runs one lane per (point, head), otherwise one per point
+        headPacked = tiling_data->headPacked;
+        // levels baked into the tiling data by the host; otherwise read from the two shape inputs per query
+        levelTable = tiling_data->levelTable != 0;
+        for (uint32_t level = 0; levelTable && level < numLevels; level++) {
+            levelHeight[level] = tiling_data->levelHeight[level];
+            levelWidth[level] = tiling_data->levelWidth[level];
+            levelStart[level] = tiling_data->levelStart[level];
+        }
+        laneNum = headPacked ? numHeads : 1;
+        lanePointsAlign = AlignUp(laneNum * numPoints, dataAlign);
+
+        // 2x2 patch: 2 rows of (left, right) corners into the top / bottom halves of valueUb
+        patchParams.blockCount = 2;
+        patchParams.blockLen = 2 * embedDims / dataAlign;
+        patchParams.dstStride = (2 * laneNum * batchOffset - 2 * embedDims) / dataAlign;
+
+        // location / weight rows are read with DataCopyPad: a view row need not be 32 B aligned, and the read
+        // stops at the row end instead of running into whatever follows it in the source buffer
+        locationRowParams = {1, (uint16_t)(numHeads * numLevels * numPoints * 2 * sizeof(DTYPE_VALUE)), 0, 0};
+        weightRowParams = {1, (uint16_t)(numHeads * numLevels * numPoints * sizeof(DTYPE_VALUE)), 0, 0};
+        pointWeightParams = {1, (uint16_t)(numPoints * sizeof(DTYPE_VALUE)), 0, 0};
+        pointLocationParams = {1, (uint16_t)(numPoints * 2 * sizeof(DTYPE_VALUE)), 0, 0};
+
         curBlockIdx = GetBlockIdx();
         startOffset = curBlockIdx * taskNumPerCore;
         endOffset = (curBlockIdx + 1) * taskNumPerCore;
@@ -37,250 +91,849 @@ public:
             endOffset = taskNum;
         }
 
-        valueGm.SetGlobalBuffer(
-            reinterpret_cast<__gm__ DTYPE_VALUE*>(value), batchSize * numKeys * numHeads * embedDims);
-        locationGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE*>(samplingLocations),
-            batchSize * numQueries * numHeads * numLevels * numPoints * 2);
-        attentionWeightsGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE*>(attentionWeights),
-            batchSize * numQueries * numHeads * numLevels * numPoints);
-        outputGm.SetGlobalBuffer(
-            reinterpret_cast<__gm__ DTYPE_VALUE*>(output), batchSize * numQueries * numHeads * embedDims);
+        // value / output stack numSources batches of batchSize, source-major, all sampled with the same locations
+        valueSourceStride = (OFFSET_T)batchSize * numHeads * numKeys * embedDims;
+        valueGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE*>(value), (uint64_t)numSources * valueSourceStride);
+        // location / weight rows sit locationRowStride / weightRowStride apart, so both can be column slices of
+        // one fused projection output
+        locationGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE*>(samplingLocations) + tiling_data->locationOffset,
+            (uint64_t)batchSize * numQueries * locationRowStride);
+        attentionWeightsGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE*>(attentionWeights) + tiling_data->weightOffset,
+            (uint64_t)batchSize * numQueries * weightRowStride);
+        // output rows sit outputRowStride apart from outputOffset, so it can be a slice of a wider buffer
+        outputGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE*>(output) + tiling_data->outputOffset,
+            (uint64_t)numSources * batchSize * numQueries * outputRowStride);
+
+        if (tiling_data->cacheMode == CACHE_MODE_STREAM) {
+            locationGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+            attentionWeightsGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+            outputGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+        }
 
         valueSpatialShapesGm.SetGlobalBuffer(
             reinterpret_cast<__gm__ DTYPE_VALUE_SPATIAL_SHAPES*>(valueSpatialShapes), numLevels * 2);
         valueLevelStartIndexGm.SetGlobalBuffer(
             reinterpret_cast<__gm__ DTYPE_VALUE_SPATIAL_SHAPES*>(valuLevelStartIndex), numLevels);
 
-        pipe->InitBuffer(shapeQueue, AlignUp(numLevels * 2, dataAlign) * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(shapeQueue, shapesAlign * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(offsetQueue, numLevelsAlign * sizeof(DTYPE_VALUE));
 
-        pipe->InitBuffer(locationQueue, AlignUp(numHeads * numLevels * numPoints * 2, dataAlign) * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(locationQueue, locationAlign * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(
             attentionWeightsUb, AlignUp(numHeads * numLevels * numPoints, dataAlign) * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(outputQueue, embedDims * sizeof(DTYPE_VALUE));
 
         pipe->InitBuffer(emptyUb, embedDims * sizeof(DTYPE_VALUE));
 
+        pipe->InitBuffer(validMaskUb, AlignUp(numPoints, 256) / 8);
+        pipe->InitBuffer(headScaleUb, AlignUp(numHeads, dataAlign) * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(intOneUb, numPointsAlign * sizeof(DTYPE_VALUE_SPATIAL_SHAPES));
-        pipe->InitBuffer(floatOneUb, numPointsAlign * 2 * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(floatOneUb, lanePointsAlign * 2 * sizeof(DTYPE_VALUE));
 
-        pipe->InitBuffer(tmpXUb, numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(tmpYUb, numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(tmpParamUb, numPointsAlign * 2 * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(tmpXUb, lanePointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(tmpYUb, lanePointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(tmpParamUb, lanePointsAlign * 2 * sizeof(DTYPE_VALUE));
 
-        pipe->InitBuffer(tmpIntUb, 4 * numPointsAlign * sizeof(DTYPE_VALUE_SPATIAL_SHAPES));
-        pipe->InitBuffer(tmpFloatUb, 4 * numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(weightQueue, 4 * numPointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(tmpIntUb, 4 * lanePointsAlign * sizeof(DTYPE_VALUE_SPATIAL_SHAPES));
+        pipe->InitBuffer(tmpFloatUb, 4 * lanePointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(weightQueue, 4 * lanePointsAlign * sizeof(DTYPE_VALUE));
 
-        pipe->InitBuffer(valueUb, batchOffset * 8 * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(cornerWeightUb, batchOffset * 8 * sizeof(DTYPE_VALUE));
+        // valueUb: 4 weighted corners + 4 gathered corners, cornerWeightUb: 4 corners, per lane. Unpacked, the
+        // bottom corner broadcast runs on whole 8-point groups and spills up to numPointsAlign rows past its half
+        uint32_t cornerWeightSize =
+            headPacked ? laneNum * batchOffset * 4 : (batchOffset + numPointsAlign * embedDims) * 2;
+        pipe->InitBuffer(valueUb, laneNum * batchOffset * 8 * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(cornerWeightUb, cornerWeightSize * sizeof(DTYPE_VALUE));
 
-        pipe->InitBuffer(tmpResUb, batchOffset * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(tmpResUb2, batchOffset * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(tmpResUb, laneNum * batchOffset * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(tmpResUb3, numHeads * batchOffset * sizeof(DTYPE_VALUE));
     }
 
+    // Fused projection: the sampled rows of this AIV core go to its own workspace slab instead of output, one
+    // query chunk (for every batch) at a time, and the cube core projects each chunk into output. With projSampled
+    // the slab rows are also copied to sampled, the operand the projection's backward needs.
+    __aicore__ inline void InitProjection(GM_ADDR projWeight, GM_ADDR projBias, GM_ADDR output, GM_ADDR sampled,
+                                          GM_ADDR workspace,
+                                          const MultiScaleDeformableAttnFuncV2TilingData* tiling_data,
+                                          ProjMatmul* mm) {
+        projMatmul = mm;
+        projDims = tiling_data->projDims;
+        projChunk = tiling_data->projChunk;
+        projBias = tiling_data->projBias != 0;
+        projSampled = tiling_data->projSampled != 0;
+        uint64_t slabSize = (uint64_t)batchSize * projChunk * tailNum;
+        outputGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE*>(GetUserWorkspace(workspace)) + curBlockIdx * slabSize, slabSize);
+        // the slab is re-read by the cube right away: keep it in L2 even when the inputs stream
+        outputGm.SetL2CacheHint(CacheMode::CACHE_MODE_NORMAL);
+        projWeightGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE*>(projWeight), (uint64_t)projDims * tailNum);
+        projBiasGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE*>(projBias), projDims);
+        projOutputGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE*>(output), (uint64_t)batchSize * numQueries * projDims);
+        sampledGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE*>(sampled), (uint64_t)batchSize * numQueries * tailNum);
+    }
+
+    // Dynamic schedule: block 0 zeroes the task counter at the start of the user workspace and every core waits
+    // for it, then the cores claim scheduleChunk queries at a time until they run out.
+    __aicore__ inline void InitSchedule(GM_ADDR workspace,
+                                        const MultiScaleDeformableAttnFuncV2TilingData* tiling_data) {
+        scheduleChunk = tiling_data->scheduleMode == SCHEDULE_DYNAMIC ? tiling_data->scheduleChunk : 0;
+        if (scheduleChunk == 0) {
+            return;
+        }
+        taskCounterGm.SetGlobalBuffer(reinterpret_cast<__gm__ int32_t*>(GetUserWorkspace(workspace)), 1);
+        if (curBlockIdx == 0) {
+            taskCounterGm.SetValue(0, 0);
+            DataCacheCleanAndInvalid<int32_t, CacheLine::SINGLE_CACHE_LINE>(taskCounterGm);
+        }
+        SyncAll();
+    }
+
     __aicore__ inline void Process()
     {
-        for (uint32_t taskIdx = startOffset; taskIdx < endOffset; taskIdx++) {
-            Compute(taskIdx);
+        if (projMatmul != nullptr) {
+            ProcessProjected();
+            return;
+        }
+        if (querySplit > 1) {
+            ClearSplitOutput();
+        }
+        if (forwardOrder == FORWARD_ORDER_SLICE) {
+            // static ranges only: the host never pairs the slice order with the dynamic schedule
+            ComputeSliced(startOffset, endOffset);
+            return;
+        }
+        if (scheduleChunk == 0) {
+            ComputeRange(startOffset, endOffset);
+            return;
+        }
+        for (uint32_t begin = ClaimChunk(); begin < taskNum; begin = ClaimChunk()) {
+            ComputeRange(begin, begin + scheduleChunk < taskNum ? begin + scheduleChunk : taskNum);
         }
     }
 
 private:
+    __aicore__ inline void ComputeRange(uint32_t begin, uint32_t end) {
+        for (uint32_t taskIdx = begin; taskIdx < end; taskIdx++) {
+            ComputeTask(taskIdx);
+        }
+    }
+
+    // First query of the next unclaimed chunk; taskNum or past it once the queries run out.
+    __aicore__ inline uint32_t ClaimChunk() {
+        return (uint32_t)AtomicAdd(
+            reinterpret_cast<__gm__ int32_t*>(taskCounterGm.GetPhyAddr()), (int32_t)scheduleChunk);
+    }
+
+    // Latency mode: the parts of a query add into its output row from different cores, so every row is zeroed
+    // before any core starts and the zeros are published with SyncAll.
+    __aicore__ inline void ClearSplitOutput() {
+        LocalTensor<DTYPE_VALUE> emptyUbLocal = emptyUb.Get<DTYPE_VALUE>();
+        event_t eventIdVToMte3 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_MTE3>());
+        Duplicate<DTYPE_VALUE>(emptyUbLocal, DTYPE_VALUE(0), EmbedDims());
+        SetFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+        WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+        for (uint32_t row = curBlockIdx; row < batchSize * numQueries; row += coreNum) {
+            for (uint32_t head = 0; head < numHeads; head++) {
+                DataCopy(outputGm[(OFFSET_T)row * outputRowStride + head * EmbedDims()], emptyUbLocal, EmbedDims());
+            }
+        }
+        GetTPipePtr()->ReleaseEventID<HardEvent::V_MTE3>(eventIdVToMte3);
+        pipe_barrier(PIPE_ALL);
+        SyncAll();
+    }
+
+    __aicore__ inline void ComputeTask(uint32_t taskIdx) {
+        if (querySplit > 1) {
+            uint32_t part = taskIdx % querySplit;
+            pairBegin = part * numHeads * numLevels / querySplit;
+            pairEnd = (part + 1) * numHeads * numLevels / querySplit;
+            Compute(taskIdx / querySplit);
+            return;
+        }
+        if (headPacked) {
+            ComputeHeadPacked(taskIdx);
+        } else {
+            Compute(taskIdx);
+        }
+    }
+
+    __aicore__ inline void ProcessProjected() {
+        for (chunkStart = startOffset; chunkStart < endOffset; chunkStart += projChunk) {
+            uint32_t chunkEnd = chunkStart + projChunk < endOffset ? chunkStart + projChunk : endOffset;
+            for (uint32_t taskIdx = chunkStart; taskIdx < chunkEnd; taskIdx++) {
+                ComputeTask(taskIdx);
+            }
+            // the slab rows must have landed before the cube reads them; IterateAll blocks until the chunk is
+            // projected, so the next chunk can overwrite the slab
+            pipe_barrier(PIPE_ALL);
+            if (projSampled) {
+                CopySlabToSampled(chunkEnd);
+            }
+            for (uint32_t batch = 0; batch < batchSize; batch++) {
+                projMatmul->SetTensorA(outputGm[(uint64_t)batch * projChunk * tailNum]);
+                projMatmul->SetTensorB(projWeightGm, true);
+                if (projBias) {
+                    projMatmul->SetBias(projBiasGm);
+                }
+                projMatmul->SetTail(chunkEnd - chunkStart, projDims, tailNum);
+                projMatmul->IterateAll(projOutputGm[((OFFSET_T)batch * numQueries + chunkStart) * projDims]);
+            }
+        }
+        projMatmul->End();
+    }
+
+    // The chunk's slab rows are contiguous per batch, as are their rows of sampled: copy them through valueUb,
+    // which is free between chunks, in pieces of its size.
+    __aicore__ inline void CopySlabToSampled(uint32_t chunkEnd) {
+        LocalTensor<DTYPE_VALUE> bounceLocal = valueUb.Get<DTYPE_VALUE>();
+        uint32_t bounceSize = laneNum * batchOffset * 8;
+        uint32_t chunkSize = (chunkEnd - chunkStart) * tailNum;
+        event_t eventIdMte2ToMte3 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE2_MTE3>());
+        event_t eventIdMte3ToMte2 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE3_MTE2>());
+        for (uint32_t batch = 0; batch < batchSize; batch++) {
+            for (uint32_t done = 0; done < chunkSize; done += bounceSize) {
+                uint32_t count = chunkSize - done < bounceSize ? chunkSize - done : bounceSize;
+                DataCopy(bounceLocal, outputGm[(uint64_t)batch * projChunk * tailNum + done], count);
+                SetFlag<HardEvent::MTE2_MTE3>(eventIdMte2ToMte3);
+                WaitFlag<HardEvent::MTE2_MTE3>(eventIdMte2ToMte3);
+                DataCopy(sampledGm[((uint64_t)batch * numQueries + chunkStart) * tailNum + done], bounceLocal, count);
+                SetFlag<HardEvent::MTE3_MTE2>(eventIdMte3ToMte2);
+                WaitFlag<HardEvent::MTE3_MTE2>(eventIdMte3ToMte2);
+            }
+        }
+        GetTPipePtr()->ReleaseEventID<HardEvent::MTE2_MTE3>(eventIdMte2ToMte3);
+        GetTPipePtr()->ReleaseEventID<HardEvent::MTE3_MTE2>(eventIdMte3ToMte2);
+        // the next chunk's gathers reuse valueUb
+        pipe_barrier(PIPE_ALL);
+    }
+
+    // output row of (batch, query): the strided output view, or the row in the current slab chunk when fused
+    __aicore__ inline OFFSET_T OutputRowOffset(uint32_t batch, uint32_t query) const {
+        if (projMatmul != nullptr) {
+            return ((OFFSET_T)batch * projChunk + query - chunkStart) * outputRowStride;
+        }
+        return ((OFFSET_T)batch * numQueries + query) * outputRowStride;
+    }
+
+    static constexpr uint32_t DATA_ALIGN = 32 / sizeof(DTYPE_VALUE);
+    // compare results per repeat: one bit for each element of a 256 B vector
+    static constexpr uint32_t POINT_MASK_REPEAT = 256 / sizeof(DTYPE_VALUE);
+
+    __aicore__ inline uint32_t EmbedDims() const {
+        return EMBED_DIMS != 0 ? EMBED_DIMS : embedDims;
+    }
+
+    // Sets h / w of a level and returns its first key: from the level table, or the UB copies of the inputs.
+    __aicore__ inline DTYPE_VALUE_SPATIAL_SHAPES SetLevel(const LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> &shapesLocal,
+                                                         const LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> &offsetLocal,
+                                                         uint32_t level) {
+        if (levelTable) {
+            h = levelHeight[level];
+            w = levelWidth[level];
+            return levelStart[level];
+        }
+        h = shapesLocal.GetValue(level * 2);
+        w = shapesLocal.GetValue(level * 2 + 1);
+        return offsetLocal.GetValue(level);
+    }
+
+    __aicore__ inline uint32_t NumPoints() const {
+        return NUM_POINTS != 0 ? NUM_POINTS : numPoints;
+    }
+
+    __aicore__ inline uint32_t NumPointsAlign() const {
+        return NUM_POINTS != 0 ? (NUM_POINTS + DATA_ALIGN - 1) / DATA_ALIGN * DATA_ALIGN : numPointsAlign;
+    }
+
+    __aicore__ inline uint32_t BatchOffset() const {
+        return (EMBED_DIMS != 0 && NUM_POINTS != 0) ? EMBED_DIMS * NUM_POINTS : batchOffset;
+    }
+
     __aicore__ inline bool isInRange(DTYPE_VALUE_SPATIAL_SHAPES x, DTYPE_VALUE_SPATIAL_SHAPES upper) {
         return -1 < x && x < upper;
     }
 
+    // 1 / (sum of the kept attention weights) of every head over all levels and points, from the whole
+    // (batch, query) weight row. A head with nothing kept gets 0 and contributes nothing.
+    __aicore__ inline void ComputeHeadScales(const LocalTensor<DTYPE_VALUE>& attentionWeightLocal,
+                                             const LocalTensor<DTYPE_VALUE>& headScaleLocal) {
+        uint32_t headPoints = numLevels * NumPoints();
+        for (uint32_t head = 0; head < numHeads; head++) {
+            DTYPE_VALUE keptSum = 0;
+            for (uint32_t idx = head * headPoints; idx < (head + 1) * headPoints; idx++) {
+                attnWeight = attentionWeightLocal.GetValue(idx);
+                if (!prunePoints || attnWeight >= weightThreshold) {
+                    keptSum += attnWeight;
+                }
+            }
+            headScaleLocal.SetValue(head, keptSum > (DTYPE_VALUE)0 ? (DTYPE_VALUE)1 / keptSum : (DTYPE_VALUE)0);
+        }
+    }
+
+    // Range test of one (head, level) on the vector unit: a point touches the map iff its bottom-right corner
+    // (x1, y1) = floor(pos + 0.5) has 0 <= x1 <= w and 0 <= y1 <= h, i.e. min(x1, w - x1, y1, h - y1) >= 0.
+    // GatherMask then packs the per-point operands of the in-range points to the front, so gather, corner
+    // weights and accumulation only run over those. floorLocal holds x1 / y1 as float and is overwritten.
+    __aicore__ inline uint32_t CompactValidPoints(const LocalTensor<DTYPE_VALUE>& floorLocal,
+        const LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES>& intLocal, const LocalTensor<DTYPE_VALUE>& paramLocal,
+        const LocalTensor<DTYPE_VALUE>& attentionWeightLocal, const LocalTensor<DTYPE_VALUE>& xLocal,
+        const LocalTensor<DTYPE_VALUE>& yLocal, const LocalTensor<uint8_t>& maskLocal) {
+        Muls(xLocal, floorLocal, (DTYPE_VALUE)-1, NumPointsAlign());
+        Adds(xLocal, xLocal, (DTYPE_VALUE)w, NumPointsAlign());
+        Min(xLocal, xLocal, floorLocal, NumPointsAlign());
+        Muls(yLocal, floorLocal[NumPointsAlign()], (DTYPE_VALUE)-1, NumPointsAlign());
+        Adds(yLocal, yLocal, (DTYPE_VALUE)h, NumPointsAlign());
+        Min(yLocal, yLocal, floorLocal[NumPointsAlign()], NumPointsAlign());
+        Min(xLocal, xLocal, yLocal, NumPointsAlign());
+        if (prunePoints) {
+            // weight - threshold >= 0 joins the same min: pruned points drop out with the out-of-range ones
+            Adds(yLocal, attentionWeightLocal, -weightThreshold, NumPointsAlign());
+            Min(xLocal, xLocal, yLocal, NumPointsAlign());
+        }
+        CompareScalar(maskLocal, xLocal, (DTYPE_VALUE)0, CMPMODE::GE,
+            NumPoints() < POINT_MASK_REPEAT ? NumPoints() : POINT_MASK_REPEAT,
+            uint8_t((NumPoints() + POINT_MASK_REPEAT - 1) / POINT_MASK_REPEAT), {1, 1, 8, 8});
+
+        uint64_t validCount = 0;
+        GatherMaskParams params = {1, 1, 8, 0};
+        LocalTensor<uint32_t> pattern = maskLocal.ReinterpretCast<uint32_t>();
+        LocalTensor<uint32_t> intBits = intLocal.template ReinterpretCast<uint32_t>();
+        GatherMask(intBits[NumPointsAlign() * 2], intBits, pattern, true, NumPoints(), params, validCount);
+        GatherMask(intBits[NumPointsAlign() * 3], intBits[NumPointsAlign()], pattern, true, NumPoints(), params,
+                   validCount);
+        GatherMask(floorLocal, paramLocal, pattern, true, NumPoints(), params, validCount);
+        GatherMask(floorLocal[NumPointsAlign()], paramLocal[NumPointsAlign()], pattern, true, NumPoints(), params,
+                   validCount);
+        GatherMask(floorLocal[NumPointsAlign() * 2], attentionWeightLocal, pattern, true, NumPoints(), params,
+                   validCount);
+        return static_cast<uint32_t>(validCount);
+    }
+
     __aicore__ inline void Compute(uint32_t query) {
         LocalTensor<DTYPE_VALUE> locationLocal = locationQueue.Get<DTYPE_VALUE>();
         LocalTensor<DTYPE_VALUE> attentionWeightLocal = attentionWeightsUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> shapesLocal = shapeQueue.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
+        LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> offsetLocal = offsetQueue.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
+        LocalTensor<DTYPE_VALUE> emptyUbLocal = emptyUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> headScaleLocal = headScaleUb.Get<DTYPE_VALUE>();
+        BeginSample(shapesLocal, offsetLocal);
 
+        for (uint32_t batch = 0; batch < batchSize; batch++) {
+            locationRowOffset = ((OFFSET_T)batch * numQueries + query) * locationRowStride;
+            weightRowOffset = ((OFFSET_T)batch * numQueries + query) * weightRowStride;
+            DataCopyPad(locationLocal, locationGm[locationRowOffset], locationRowParams, padParams);
+
+            // a split query's row was zeroed by ClearSplitOutput
+            for (uint32_t source = 0; querySplit == 1 && source < numSources; source++) {
+                moveOffset = OutputRowOffset(source * batchSize + batch, query);
+                for (uint32_t head = 0; head < numHeads; head++) {
+                    DataCopy(outputGm[moveOffset + head * EmbedDims()], emptyUbLocal, EmbedDims());
+                }
+            }
+            if (renormalizeWeights) {
+                // the per-level weight loads below reuse the front of attentionWeightsUb
+                DataCopyPad(attentionWeightLocal, attentionWeightsGm[weightRowOffset], weightRowParams, padParams);
+            }
+            pipe_barrier(PIPE_ALL);
+            if (renormalizeWeights) {
+                ComputeHeadScales(attentionWeightLocal, headScaleLocal);
+                pipe_barrier(PIPE_ALL);
+            }
+
+            for (uint32_t level = 0; level < numLevels; level++) {
+                BeginLevel(shapesLocal, offsetLocal, batch, level);
+                SetAtomicAdd<DTYPE_VALUE>();
+                for (uint32_t head = 0; head < numHeads; head++) {
+                    if (head * numLevels + level < pairBegin || head * numLevels + level >= pairEnd) {
+                        continue;
+                    }
+                    SampleHeadLevel(locationLocal, (head * numLevels + level) * NumPoints() * 2, batch, query, head,
+                                    level);
+                }
+                SetAtomicNone();
+            }
+        }
+        EndSample();
+    }
+
+    // Level-outer order (forwardOrder SLICE) for value tensors that overflow L2: the core sweeps its whole query
+    // range once per (batch, level, head) slice of value instead of visiting every slice per query, so the
+    // gathers of a stretch stay inside one slice and find it in L2. The slices meet in the output rows through
+    // the atomic adds the kernel uses per point anyway; only the slice's part of each location row is fetched.
+    __aicore__ inline void ComputeSliced(uint32_t begin, uint32_t end) {
+        LocalTensor<DTYPE_VALUE> locationLocal = locationQueue.Get<DTYPE_VALUE>();
         LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> shapesLocal = shapeQueue.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
         LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> offsetLocal = offsetQueue.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
+        LocalTensor<DTYPE_VALUE> emptyUbLocal = emptyUb.Get<DTYPE_VALUE>();
+        event_t eventIdMte2ToS = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE2_S>());
+        BeginSample(shapesLocal, offsetLocal);
 
-        DataCopy(shapesLocal, valueSpatialShapesGm, AlignUp(numLevels * 2, dataAlign));
-        DataCopy(offsetLocal, valueLevelStartIndexGm, numLevelsAlign);
+        for (uint32_t batch = 0; batch < batchSize; batch++) {
+            for (uint32_t query = begin; query < end; query++) {
+                moveOffset = OutputRowOffset(batch, query);
+                for (uint32_t head = 0; head < numHeads; head++) {
+                    DataCopy(outputGm[moveOffset + head * EmbedDims()], emptyUbLocal, EmbedDims());
+                }
+            }
+        }
+        pipe_barrier(PIPE_ALL);
 
-        LocalTensor<DTYPE_VALUE> valueLocal = valueUb.Get<DTYPE_VALUE>();
-        LocalTensor<DTYPE_VALUE> cornerWeightLocal = cornerWeightUb.Get<DTYPE_VALUE>();
+        SetAtomicAdd<DTYPE_VALUE>();
+        for (uint32_t batch = 0; batch < batchSize; batch++) {
+            for (uint32_t level = 0; level < numLevels; level++) {
+                BeginLevel(shapesLocal, offsetLocal, batch, level);
+                for (uint32_t head = 0; head < numHeads; head++) {
+                    OFFSET_T sliceLocation = (OFFSET_T)(head * numLevels + level) * NumPoints() * 2;
+                    for (uint32_t query = begin; query < end; query++) {
+                        locationRowOffset = ((OFFSET_T)batch * numQueries + query) * locationRowStride;
+                        weightRowOffset = ((OFFSET_T)batch * numQueries + query) * weightRowStride;
+                        DataCopyPad(locationLocal, locationGm[locationRowOffset + sliceLocation], pointLocationParams,
+                                    padParams);
+                        SetFlag<HardEvent::MTE2_S>(eventIdMte2ToS);
+                        WaitFlag<HardEvent::MTE2_S>(eventIdMte2ToS);
+                        SampleHeadLevel(locationLocal, 0, batch, query, head, level);
+                    }
+                }
+            }
+        }
+        SetAtomicNone();
+        EndSample();
+        GetTPipePtr()->ReleaseEventID<HardEvent::MTE2_S>(eventIdMte2ToS);
+    }
 
-        event_t eventIdVToMte3 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_MTE3>());
-        event_t eventIdMte2ToV = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE2_V>());
-        event_t eventIdMte2ToV_ = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE2_V>());
+    // Per-call setup of the atomic path: level inputs (when not baked into the tiling data), the events of
+    // SampleHeadLevel and its constant operands.
+    __aicore__ inline void BeginSample(const LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> &shapesLocal,
+                                       const LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> &offsetLocal) {
+        if (!levelTable) {
+            DataCopy(shapesLocal, valueSpatialShapesGm, shapesAlign);
+            DataCopy(offsetLocal, valueLevelStartIndexGm, numLevelsAlign);
+        }
+        eventIdSampleVToMte3 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_MTE3>());
+        eventIdSampleMte2ToV = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE2_V>());
+        eventIdGatherMte2ToV = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE2_V>());
+        eventIdSampleVToS = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_S>());
+        eventIdSampleVToMte2 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_MTE2>());
+        eventIdSampleMte3ToV = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE3_V>());
+        SetFlag<HardEvent::MTE3_V>(eventIdSampleMte3ToV);
 
         LocalTensor<DTYPE_VALUE> emptyUbLocal = emptyUb.Get<DTYPE_VALUE>();
         LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> intOneLocal = intOneUb.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
         LocalTensor<DTYPE_VALUE> floatOneLocal = floatOneUb.Get<DTYPE_VALUE>();
+        Duplicate<DTYPE_VALUE>(emptyUbLocal, DTYPE_VALUE(0), EmbedDims());
+        SetFlag<HardEvent::V_MTE3>(eventIdSampleVToMte3);
+        WaitFlag<HardEvent::V_MTE3>(eventIdSampleVToMte3);
+        Duplicate<DTYPE_VALUE_SPATIAL_SHAPES>(intOneLocal, (DTYPE_VALUE_SPATIAL_SHAPES)1, NumPointsAlign());
+        Duplicate<DTYPE_VALUE>(floatOneLocal, (DTYPE_VALUE)1, NumPointsAlign() * 2);
+    }
 
-        Duplicate<DTYPE_VALUE>(emptyUbLocal, DTYPE_VALUE(0), embedDims);
-        SetFlag<HardEvent::V_MTE3>(eventIdVToMte3);
-        WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+    __aicore__ inline void EndSample() {
+        WaitFlag<HardEvent::MTE3_V>(eventIdSampleMte3ToV);
+        GetTPipePtr()->ReleaseEventID<HardEvent::V_MTE3>(eventIdSampleVToMte3);
+        GetTPipePtr()->ReleaseEventID<HardEvent::MTE2_V>(eventIdSampleMte2ToV);
+        GetTPipePtr()->ReleaseEventID<HardEvent::MTE2_V>(eventIdGatherMte2ToV);
+        GetTPipePtr()->ReleaseEventID<HardEvent::V_S>(eventIdSampleVToS);
+        GetTPipePtr()->ReleaseEventID<HardEvent::V_MTE2>(eventIdSampleVToMte2);
+        GetTPipePtr()->ReleaseEventID<HardEvent::MTE3_V>(eventIdSampleMte3ToV);
+    }
 
-        Duplicate<DTYPE_VALUE_SPATIAL_SHAPES>(intOneLocal, (DTYPE_VALUE_SPATIAL_SHAPES)1, numPointsAlign);
-        Duplicate<DTYPE_VALUE>(floatOneLocal, (DTYPE_VALUE)1, numPointsAlign * 2);
+    // h / w, the value offset and the patch DMA stride of (batch, level).
+    __aicore__ inline void BeginLevel(const LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> &shapesLocal,
+                                      const LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> &offsetLocal, uint32_t batch,
+                                      uint32_t level) {
+        DTYPE_VALUE_SPATIAL_SHAPES levelKey = SetLevel(shapesLocal, offsetLocal, level);
+        oriOffset = ((OFFSET_T)batch * numHeads * numKeys + levelKey) * EmbedDims();
+        patchGather = w > 1 && (w - 2) * EmbedDims() / DATA_ALIGN <= MAX_DATA_COPY_STRIDE;
+        patchParams.srcStride = patchGather ? (w - 2) * EmbedDims() / DATA_ALIGN : 0;
+    }
 
-        for (uint32_t batch = 0; batch < batchSize; batch++) {
-            LocalTensor<DTYPE_VALUE> weightLocal = weightQueue.Get<DTYPE_VALUE>();
-            LocalTensor<DTYPE_VALUE> xLocal = tmpXUb.Get<DTYPE_VALUE>();
-            LocalTensor<DTYPE_VALUE> yLocal = tmpYUb.Get<DTYPE_VALUE>();
+    // The points of one (batch, query, head, level) on the atomic path, their locations at
+    // locationLocal[locationBase]: coordinates, range compaction and corner weights, then every source's gathers
+    // and atomic adds into its output row. Needs BeginLevel of the level and atomic add mode.
+    __aicore__ inline void SampleHeadLevel(const LocalTensor<DTYPE_VALUE> &locationLocal, uint32_t locationBase,
+                                           uint32_t batch, uint32_t query, uint32_t head, uint32_t level) {
+        LocalTensor<DTYPE_VALUE> attentionWeightLocal = attentionWeightsUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> valueLocal = valueUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> cornerWeightLocal = cornerWeightUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> floatOneLocal = floatOneUb.Get<DTYPE_VALUE>();
+        LocalTensor<uint8_t> validMaskLocal = validMaskUb.Get<uint8_t>();
+        LocalTensor<DTYPE_VALUE> headScaleLocal = headScaleUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> weightLocal = weightQueue.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> xLocal = tmpXUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> yLocal = tmpYUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> tmpResLocal3 = tmpResUb3.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> paramLocal = tmpParamUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> tmpIntLocal = tmpIntUb.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
+        LocalTensor<DTYPE_VALUE> tmpFloatLocal = tmpFloatUb.Get<DTYPE_VALUE>();
+        uint8_t pointRepeat;
+        uint16_t cornerStride = 2 * EmbedDims() / DATA_ALIGN;
+
+        weightOffset = (head * numLevels + level) * NumPoints();
+        srcOffset = head * BatchOffset();
+        for (uint32_t point = 0; point < NumPoints(); point++) {
+            tmpOffset1 = locationBase + point * 2;
+            tmp1 = locationLocal.GetValue(tmpOffset1) * (DTYPE_VALUE)w + (DTYPE_VALUE)0.5;
+            tmp2 = locationLocal.GetValue(tmpOffset1 + 1) * (DTYPE_VALUE)h + (DTYPE_VALUE)0.5;
+
+            tmpFloatLocal.SetValue(point, tmp1);
+            tmpFloatLocal.SetValue(point + NumPointsAlign(), tmp2);
+        }
+        Cast(tmpIntLocal, tmpFloatLocal, RoundMode::CAST_FLOOR, 2 * NumPointsAlign());
+
+        DataCopyPad(attentionWeightLocal, attentionWeightsGm[weightRowOffset + weightOffset],
+                    pointWeightParams, padParams);
+        SetFlag<HardEvent::MTE2_V>(eventIdSampleMte2ToV);
+
+        Sub(tmpFloatLocal[NumPointsAlign() * 2], tmpFloatLocal, floatOneLocal, 2 * NumPointsAlign());
+        Cast(tmpFloatLocal, tmpIntLocal, RoundMode::CAST_NONE, 2 * NumPointsAlign());
+        Sub(paramLocal, tmpFloatLocal, tmpFloatLocal[NumPointsAlign() * 2], 2 * NumPointsAlign());
+
+        WaitFlag<HardEvent::MTE2_V>(eventIdSampleMte2ToV);
+        // from here on slot j holds the j-th in-range point: x1 / y1 in tmpIntLocal[2 / 3 * align],
+        // fractions in tmpFloatLocal[0 / align], attention weight in tmpFloatLocal[2 * align]
+        validNum = CompactValidPoints(tmpFloatLocal, tmpIntLocal, paramLocal, attentionWeightLocal, xLocal,
+                                      yLocal, validMaskLocal);
+        if (validNum == 0) {
+            return;
+        }
+        if (renormalizeWeights) {
+            Muls(tmpFloatLocal[NumPointsAlign() * 2], tmpFloatLocal[NumPointsAlign() * 2],
+                 headScaleLocal.GetValue(head), NumPointsAlign());
+        }
+        // every source gathers at the same corners and reuses the corner weights computed while the
+        // first source's gathers are in flight
+        for (uint32_t source = 0; source < numSources; source++) {
+            valueOffset = oriOffset + source * valueSourceStride + (OFFSET_T)head * numKeys * EmbedDims();
+            dstOffset = OutputRowOffset(source * batchSize + batch, query) + head * EmbedDims();
+            Duplicate<DTYPE_VALUE>(valueLocal[4 * BatchOffset()], DTYPE_VALUE(0),
+                                   2 * validNum * EmbedDims());
+            Duplicate<DTYPE_VALUE>(valueLocal[6 * BatchOffset()], DTYPE_VALUE(0),
+                                   2 * validNum * EmbedDims());
+            SetFlag<HardEvent::V_S>(eventIdSampleVToS);
+            SetFlag<HardEvent::V_MTE2>(eventIdSampleVToMte2);
+            WaitFlag<HardEvent::V_S>(eventIdSampleVToS);
+            WaitFlag<HardEvent::V_MTE2>(eventIdSampleVToMte2);
+
+            for (uint32_t point = 0; point < validNum; point++) {
+                x1 = tmpIntLocal.GetValue(point + NumPointsAlign() * 2);
+                y1 = tmpIntLocal.GetValue(point + NumPointsAlign() * 3);
+
+                x0 = x1 - 1;
+                y0 = y1 - 1;
+
+                if (patchGather && isInRange(y0, h) && isInRange(y1, h) && 0 < x1 && x1 < w) {
+                    // interior patch: both rows in one strided DMA, row pitch w * embedDims in valueGm
+                    DataCopy(valueLocal[BatchOffset() * 4 + point * EmbedDims() * 2],
+                        valueGm[valueOffset + (y0 * w + x0) * EmbedDims()], patchParams);
+                } else {
+                    if (isInRange(y0, h)) {
+                        if (0 < x1 && x1 < w) {
+                            DataCopy(valueLocal[BatchOffset() * 4 + point * EmbedDims() * 2],
+                                valueGm[valueOffset + (y0 * w + x0) * EmbedDims()], 2 * EmbedDims());
+                        } else if (isInRange(x0, w)) {
+                            DataCopy(valueLocal[BatchOffset() * 4 + point * EmbedDims() * 2],
+                                valueGm[valueOffset + (y0 * w + x0) * EmbedDims()], EmbedDims());
+                        } else if (isInRange(x1, w)) {
+                            DataCopy(valueLocal[BatchOffset() * 4 + point * EmbedDims() * 2 + EmbedDims()],
+                                valueGm[valueOffset + (y0 * w + x1) * EmbedDims()], EmbedDims());
+                        }
+                    }
+                    if (isInRange(y1, h)) {
+                        if (0 < x1 && x1 < w) {
+                            DataCopy(valueLocal[BatchOffset() * 6 + point * EmbedDims() * 2],
+                                valueGm[valueOffset + (y1 * w + x0) * EmbedDims()], 2 * EmbedDims());
+                        } else if (isInRange(x0, w)) {
+                            DataCopy(valueLocal[BatchOffset() * 6 + point * EmbedDims() * 2],
+                                valueGm[valueOffset + (y1 * w + x0) * EmbedDims()], EmbedDims());
+                        } else if (isInRange(x1, w)) {
+                            DataCopy(valueLocal[BatchOffset() * 6 + point * EmbedDims() * 2 + EmbedDims()],
+                                valueGm[valueOffset + (y1 * w + x1) * EmbedDims()], EmbedDims());
+                        }
+                    }
+                }
+            }
+            SetFlag<HardEvent::MTE2_V>(eventIdGatherMte2ToV);
+
+            if (source == 0) {
+                Mul(weightLocal[NumPointsAlign() * 3], tmpFloatLocal, tmpFloatLocal[NumPointsAlign()],
+                    NumPointsAlign());
+
+                Sub(xLocal, floatOneLocal, tmpFloatLocal, NumPointsAlign());
+                Sub(weightLocal[NumPointsAlign() * 2], tmpFloatLocal, weightLocal[NumPointsAlign() * 3],
+                    NumPointsAlign());
+                Sub(weightLocal[NumPointsAlign()], tmpFloatLocal[NumPointsAlign()],
+                    weightLocal[NumPointsAlign() * 3], NumPointsAlign());
+                Sub(weightLocal, xLocal, weightLocal[NumPointsAlign()], NumPointsAlign());
+
+                Mul(weightLocal, weightLocal, tmpFloatLocal[NumPointsAlign() * 2], NumPointsAlign(), 4,
+                    {1, 1, 1, uint8_t(NumPointsAlign() / DATA_ALIGN),
+                     uint8_t(NumPointsAlign() / DATA_ALIGN), 0});
+
+                // broadcast each point's corner weights over its embed_dims, laid out like the gathered
+                // patches. The last 8-point group spills past validNum, so the top half goes first and
+                // the bottom half overwrites whatever spilled into it
+                pointRepeat = (validNum + DATA_ALIGN - 1) / DATA_ALIGN;
+                for (uint32_t embed = 0; embed < EmbedDims(); embed += DATA_ALIGN) {
+                    Brcb(cornerWeightLocal[embed], weightLocal[NumPointsAlign() * 3], pointRepeat,
+                        {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                    Brcb(cornerWeightLocal[EmbedDims() + embed], weightLocal[NumPointsAlign()], pointRepeat,
+                        {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                }
+                for (uint32_t embed = 0; embed < EmbedDims(); embed += DATA_ALIGN) {
+                    Brcb(cornerWeightLocal[BatchOffset() * 2 + embed], weightLocal[NumPointsAlign() * 2],
+                        pointRepeat, {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                    Brcb(cornerWeightLocal[BatchOffset() * 2 + EmbedDims() + embed], weightLocal,
+                        pointRepeat, {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                }
+            }
 
-            LocalTensor<DTYPE_VALUE> tmpResLocal = tmpResUb.Get<DTYPE_VALUE>();
-            LocalTensor<DTYPE_VALUE> tmpResLocal2 = tmpResUb2.Get<DTYPE_VALUE>();
-            LocalTensor<DTYPE_VALUE> tmpResLocal3 = tmpResUb3.Get<DTYPE_VALUE>();
+            WaitFlag<HardEvent::MTE2_V>(eventIdGatherMte2ToV);
+            Mul(valueLocal, valueLocal[BatchOffset() * 4], cornerWeightLocal, 2 * validNum * EmbedDims());
+            Mul(valueLocal[BatchOffset() * 2], valueLocal[BatchOffset() * 6],
+                cornerWeightLocal[BatchOffset() * 2], 2 * validNum * EmbedDims());
 
-            LocalTensor<DTYPE_VALUE> paramLocal = tmpParamUb.Get<DTYPE_VALUE>();
+            if (EmbedDims() != 32) {
+                pipe_barrier(PIPE_ALL);
+            }
 
-            LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> tmpIntLocal = tmpIntUb.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
-            LocalTensor<DTYPE_VALUE> tmpFloatLocal = tmpFloatUb.Get<DTYPE_VALUE>();
+            // top + bottom rows, then the two halves of the [point][left / right] row: validNum chunks of
+            // embedDims left for the atomic adds
+            Add(valueLocal, valueLocal, valueLocal[BatchOffset() * 2], 2 * validNum * EmbedDims());
+            // the previous stores out of tmpResLocal3 (this head's last source, or the last call) have drained
+            WaitFlag<HardEvent::MTE3_V>(eventIdSampleMte3ToV);
+            Add(tmpResLocal3[srcOffset], valueLocal, valueLocal[validNum * EmbedDims()],
+                validNum * EmbedDims());
 
-            moveOffset = (batch * numQueries + query) * numHeads * embedDims;
-            dataOffset = (batch * numQueries + query) * numHeads * numLevels * numPoints;
-            DataCopy(
-                locationLocal, locationGm[dataOffset * 2], AlignUp(numHeads * numLevels * numPoints * 2, dataAlign));
+            SetFlag<HardEvent::V_MTE3>(eventIdSampleVToMte3);
+            WaitFlag<HardEvent::V_MTE3>(eventIdSampleVToMte3);
 
-            for (uint32_t head = 0; head < numHeads; head++) {
-                DataCopy(outputGm[moveOffset + head * embedDims], emptyUbLocal, embedDims);
+            for (uint32_t point = 0; point < validNum; point++) {
+                DataCopy(outputGm[dstOffset], tmpResLocal3[srcOffset + point * EmbedDims()], EmbedDims());
             }
-            pipe_barrier(PIPE_ALL);
+            SetFlag<HardEvent::MTE3_V>(eventIdSampleMte3ToV);
+        }
+    }
 
-            for (uint32_t level = 0; level < numLevels; level++) {
-                h = shapesLocal.GetValue(level * 2);
-                w = shapesLocal.GetValue(level * 2 + 1);
-                oriOffset = (batch * numHeads * numKeys + offsetLocal.GetValue(level)) * embedDims;
+    // Small embed_dims: one lane per (point, head), so each vector instruction covers every head of the query.
+    // Lanes are ordered [point][head]; the per-lane sums accumulate over levels in tmpResUb3 and the points of
+    // each head are folded at the end, so the output row is written once without atomics.
+    __aicore__ inline void ComputeHeadPacked(uint32_t query) {
+        LocalTensor<DTYPE_VALUE> locationLocal = locationQueue.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> attentionWeightLocal = attentionWeightsUb.Get<DTYPE_VALUE>();
 
-                SetAtomicAdd<DTYPE_VALUE>();
-                for (uint32_t head = 0; head < numHeads; head++) {
-                    weightOffset = (head * numLevels + level) * numPoints;
-                    Duplicate<DTYPE_VALUE>(valueLocal[4 * batchOffset], DTYPE_VALUE(0), 4 * batchOffset);
-                    srcOffset = head * batchOffset;
-                    dstOffset = moveOffset + head * embedDims;
-
-                    locationOffset = weightOffset * 2;
-                    valueOffset = oriOffset + (head * numKeys) * embedDims;
-                    for (uint32_t point = 0; point < numPoints; point++) {
-                        tmpOffset1 = locationOffset + point * 2;
-                        tmp1 = locationLocal.GetValue(tmpOffset1) * (DTYPE_VALUE)w + (DTYPE_VALUE)0.5;
-                        tmp2 = locationLocal.GetValue(tmpOffset1 + 1) * (DTYPE_VALUE)h + (DTYPE_VALUE)0.5;
-
-                        tmpFloatLocal.SetValue(point, tmp1);
-                        tmpFloatLocal.SetValue(point + numPointsAlign, tmp2);
-                    }
-                    Cast(tmpIntLocal, tmpFloatLocal, RoundMode::CAST_FLOOR, 2 * numPointsAlign);
+        LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> shapesLocal = shapeQueue.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
+        LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> offsetLocal = offsetQueue.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
 
-                    DataCopy(attentionWeightLocal, attentionWeightsGm[dataOffset + weightOffset],
-                        AlignUp(numPoints, dataAlign));
-                    SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
+        if (!levelTable) {
+            DataCopy(shapesLocal, valueSpatialShapesGm, shapesAlign);
+            DataCopy(offsetLocal, valueLevelStartIndexGm, numLevelsAlign);
+        }
 
-                    for (uint32_t point = 0; point < numPoints; point++) {
-                        y1 = tmpIntLocal.GetValue(point + numPointsAlign);
-                        x1 = tmpIntLocal.GetValue(point);
+        LocalTensor<DTYPE_VALUE> valueLocal = valueUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> cornerWeightLocal = cornerWeightUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> floatOneLocal = floatOneUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> weightLocal = weightQueue.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> xLocal = tmpXUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> laneWeightLocal = tmpYUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> paramLocal = tmpParamUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> tmpResLocal = tmpResUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> tmpResLocal3 = tmpResUb3.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE_SPATIAL_SHAPES> tmpIntLocal = tmpIntUb.Get<DTYPE_VALUE_SPATIAL_SHAPES>();
+        LocalTensor<DTYPE_VALUE> tmpFloatLocal = tmpFloatUb.Get<DTYPE_VALUE>();
+        LocalTensor<DTYPE_VALUE> headScaleLocal = headScaleUb.Get<DTYPE_VALUE>();
+
+        event_t eventIdVToMte2 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_MTE2>());
+        event_t eventIdVToMte3 = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_MTE3>());
+        event_t eventIdMte2ToV = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE2_V>());
+        event_t eventIdMte3ToV = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::MTE3_V>());
+        event_t eventIdVToS = static_cast<event_t>(GetTPipePtr()->AllocEventID<HardEvent::V_S>());
+
+        uint32_t laneAlign = lanePointsAlign;
+        uint32_t headEmbed = numHeads * EmbedDims();
+        uint32_t laneOffset = numHeads * BatchOffset();
+        uint8_t laneRepeat = laneAlign / DATA_ALIGN;
+        uint16_t cornerStride = 2 * EmbedDims() / DATA_ALIGN;
+
+        Duplicate<DTYPE_VALUE>(floatOneLocal, (DTYPE_VALUE)1, laneAlign * 2);
+
+        for (uint32_t batch = 0; batch < batchSize; batch++) {
+            moveOffset = OutputRowOffset(batch, query);
+            locationRowOffset = ((OFFSET_T)batch * numQueries + query) * locationRowStride;
+            weightRowOffset = ((OFFSET_T)batch * numQueries + query) * weightRowStride;
+            DataCopyPad(locationLocal, locationGm[locationRowOffset], locationRowParams, padParams);
+            DataCopyPad(attentionWeightLocal, attentionWeightsGm[weightRowOffset], weightRowParams, padParams);
+            pipe_barrier(PIPE_ALL);
+            if (renormalizeWeights) {
+                ComputeHeadScales(attentionWeightLocal, headScaleLocal);
+            }
+
+            for (uint32_t level = 0; level < numLevels; level++) {
+                DTYPE_VALUE_SPATIAL_SHAPES levelKey = SetLevel(shapesLocal, offsetLocal, level);
+                oriOffset = ((OFFSET_T)batch * numHeads * numKeys + levelKey) * EmbedDims();
+                patchGather = w > 1 && (w - 2) * EmbedDims() / DATA_ALIGN <= MAX_DATA_COPY_STRIDE;
+                patchParams.srcStride = patchGather ? (w - 2) * EmbedDims() / DATA_ALIGN : 0;
+
+                Duplicate<DTYPE_VALUE>(valueLocal[4 * laneOffset], DTYPE_VALUE(0), 4 * laneOffset);
+                SetFlag<HardEvent::V_MTE2>(eventIdVToMte2);
+                // the previous level's vector reads of tmpFloatLocal / laneWeightLocal are done before the
+                // scalar writes below
+                SetFlag<HardEvent::V_S>(eventIdVToS);
+                WaitFlag<HardEvent::V_S>(eventIdVToS);
+
+                for (uint32_t point = 0; point < NumPoints(); point++) {
+                    for (uint32_t head = 0; head < numHeads; head++) {
+                        lane = point * numHeads + head;
+                        weightOffset = (head * numLevels + level) * NumPoints() + point;
+                        tmp1 = locationLocal.GetValue(weightOffset * 2) * (DTYPE_VALUE)w + (DTYPE_VALUE)0.5;
+                        tmp2 = locationLocal.GetValue(weightOffset * 2 + 1) * (DTYPE_VALUE)h + (DTYPE_VALUE)0.5;
+
+                        tmpFloatLocal.SetValue(lane, tmp1);
+                        tmpFloatLocal.SetValue(lane + laneAlign, tmp2);
+                        // a pruned lane keeps weight 0 and its value gather is skipped below
+                        attnWeight = attentionWeightLocal.GetValue(weightOffset);
+                        if (prunePoints && attnWeight < weightThreshold) {
+                            attnWeight = 0;
+                        } else if (renormalizeWeights) {
+                            attnWeight = attnWeight * headScaleLocal.GetValue(head);
+                        }
+                        laneWeightLocal.SetValue(lane, attnWeight);
+                    }
+                }
+                Cast(tmpIntLocal, tmpFloatLocal, RoundMode::CAST_FLOOR, 2 * laneAlign);
+                SetFlag<HardEvent::V_S>(eventIdVToS);
+                WaitFlag<HardEvent::V_S>(eventIdVToS);
+
+                WaitFlag<HardEvent::V_MTE2>(eventIdVToMte2);
+                for (uint32_t point = 0; point < NumPoints(); point++) {
+                    for (uint32_t head = 0; head < numHeads; head++) {
+                        lane = point * numHeads + head;
+                        if (prunePoints && laneWeightLocal.GetValue(lane) == (DTYPE_VALUE)0) {
+                            continue;
+                        }
+                        y1 = tmpIntLocal.GetValue(lane + laneAlign);
+                        x1 = tmpIntLocal.GetValue(lane);
 
                         x0 = x1 - 1;
                         y0 = y1 - 1;
-
+                        valueOffset = oriOffset + (OFFSET_T)head * numKeys * EmbedDims();
+                        tmpOffset1 = laneOffset * 4 + lane * EmbedDims() * 2;
+                        tmpOffset2 = laneOffset * 6 + lane * EmbedDims() * 2;
+
+                        if (patchGather && isInRange(y0, h) && isInRange(y1, h) && 0 < x1 && x1 < w) {
+                            DataCopy(valueLocal[tmpOffset1], valueGm[valueOffset + (y0 * w + x0) * EmbedDims()],
+                                patchParams);
+                            continue;
+                        }
                         if (isInRange(y0, h)) {
                             if (0 < x1 && x1 < w) {
-                                DataCopy(valueLocal[batchOffset * 4 + point * embedDims * 2],
-                                    valueGm[valueOffset + (y0 * w + x0) * embedDims], 2 * embedDims);
+                                DataCopy(valueLocal[tmpOffset1],
+                                    valueGm[valueOffset + (y0 * w + x0) * EmbedDims()], 2 * EmbedDims());
                             } else if (isInRange(x0, w)) {
-                                DataCopy(valueLocal[batchOffset * 4 + point * embedDims * 2],
-                                    valueGm[valueOffset + (y0 * w + x0) * embedDims], embedDims);
+                                DataCopy(valueLocal[tmpOffset1],
+                                    valueGm[valueOffset + (y0 * w + x0) * EmbedDims()], EmbedDims());
                             } else if (isInRange(x1, w)) {
-                                DataCopy(valueLocal[batchOffset * 4 + point * embedDims * 2 + embedDims],
-                                    valueGm[valueOffset + (y0 * w + x1) * embedDims], embedDims);
+                                DataCopy(valueLocal[tmpOffset1 + EmbedDims()],
+                                    valueGm[valueOffset + (y0 * w + x1) * EmbedDims()], EmbedDims());
                             }
                         }
                         if (isInRange(y1, h)) {
                             if (0 < x1 && x1 < w) {
-                                DataCopy(valueLocal[batchOffset * 6 + point * embedDims * 2],
-                                    valueGm[valueOffset + (y1 * w + x0) * embedDims], 2 * embedDims);
+                                DataCopy(valueLocal[tmpOffset2],
+                                    valueGm[valueOffset + (y1 * w + x0) * EmbedDims()], 2 * EmbedDims());
                             } else if (isInRange(x0, w)) {
-                                DataCopy(valueLocal[batchOffset * 6 + point * embedDims * 2],
-                                    valueGm[valueOffset + (y1 * w + x0) * embedDims], embedDims);
+                                DataCopy(valueLocal[tmpOffset2],
+                                    valueGm[valueOffset + (y1 * w + x0) * EmbedDims()], EmbedDims());
                             } else if (isInRange(x1, w)) {
-                                DataCopy(valueLocal[batchOffset * 6 + point * embedDims * 2 + embedDims],
-                                    valueGm[valueOffset + (y1 * w + x1) * embedDims], embedDims);
+                                DataCopy(valueLocal[tmpOffset2 + EmbedDims()],
+                                    valueGm[valueOffset + (y1 * w + x1) * EmbedDims()], EmbedDims());
                             }
                         }
                     }
-                    SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV_);
-
-                    Sub(tmpFloatLocal[numPointsAlign * 2], tmpFloatLocal, floatOneLocal, 2 * numPointsAlign);
-                    Cast(tmpFloatLocal, tmpIntLocal, RoundMode::CAST_NONE, 2 * numPointsAlign);
-
-                    Sub(paramLocal, tmpFloatLocal, tmpFloatLocal[numPointsAlign * 2], 2 * numPointsAlign);
-                    Mul(weightLocal[numPointsAlign * 3], paramLocal, paramLocal[numPointsAlign], numPointsAlign);
-
-                    Sub(xLocal, floatOneLocal, paramLocal, numPointsAlign);
-                    Sub(weightLocal[numPointsAlign * 2], paramLocal, weightLocal[numPointsAlign * 3], numPointsAlign);
-                    Sub(weightLocal[numPointsAlign], paramLocal[numPointsAlign], weightLocal[numPointsAlign * 3],
-                        numPointsAlign);
-                    Sub(weightLocal, xLocal, weightLocal[numPointsAlign], numPointsAlign);
-
-                    WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
-                    Mul(weightLocal, weightLocal, attentionWeightLocal, numPointsAlign, 4,
-                        {1, 1, 1, uint8_t(numPointsAlign / dataAlign), uint8_t(numPointsAlign / dataAlign), 0});
-
-                    for (uint32_t point = 0; point < numPoints; point++) {
-                        tmpOffset1 = 2 * point * embedDims;
-                        tmpOffset2 = batchOffset * 2 + tmpOffset1;
-
-                        leftTopWeight = weightLocal.GetValue(numPointsAlign * 3 + point);
-                        rightTopWeight = weightLocal.GetValue(numPointsAlign + point);
-
-                        leftBottomWeight = weightLocal.GetValue(numPointsAlign * 2 + point);
-                        rightBottomWeight = weightLocal.GetValue(point);
-
-                        Duplicate<DTYPE_VALUE>(cornerWeightLocal[tmpOffset1], leftTopWeight, embedDims);
-                        Duplicate<DTYPE_VALUE>(cornerWeightLocal[tmpOffset1 + embedDims], rightTopWeight, embedDims);
-                        Duplicate<DTYPE_VALUE>(cornerWeightLocal[tmpOffset2], leftBottomWeight, embedDims);
-                        Duplicate<DTYPE_VALUE>(cornerWeightLocal[tmpOffset2 + embedDims], rightBottomWeight, embedDims);
-                    }
+                }
+                SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
 
-                    WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV_);
-                    Mul(valueLocal, valueLocal[batchOffset * 4], cornerWeightLocal, 4 * batchOffset);
+                Sub(tmpFloatLocal[laneAlign * 2], tmpFloatLocal, floatOneLocal, 2 * laneAlign);
+                Cast(tmpFloatLocal, tmpIntLocal, RoundMode::CAST_NONE, 2 * laneAlign);
 
-                    if (embedDims != 32) {
-                        pipe_barrier(PIPE_ALL);
-                    }
+                Sub(paramLocal, tmpFloatLocal, tmpFloatLocal[laneAlign * 2], 2 * laneAlign);
+                Mul(weightLocal[laneAlign * 3], paramLocal, paramLocal[laneAlign], laneAlign);
 
-                    Add(tmpResLocal, valueLocal, valueLocal[batchOffset], batchOffset);
-                    Add(tmpResLocal2, valueLocal[batchOffset * 2], valueLocal[batchOffset * 3], batchOffset);
-                    Add(tmpResLocal3[srcOffset], tmpResLocal, tmpResLocal2, batchOffset);
+                Sub(xLocal, floatOneLocal, paramLocal, laneAlign);
+                Sub(weightLocal[laneAlign * 2], paramLocal, weightLocal[laneAlign * 3], laneAlign);
+                Sub(weightLocal[laneAlign], paramLocal[laneAlign], weightLocal[laneAlign * 3], laneAlign);
+                Sub(weightLocal, xLocal, weightLocal[laneAlign], laneAlign);
+                for (uint32_t corner = 0; corner < 4; corner++) {
+                    Mul(weightLocal[corner * laneAlign], weightLocal[corner * laneAlign], laneWeightLocal, laneAlign);
+                }
 
-                    SetFlag<HardEvent::V_MTE3>(eventIdVToMte3);
-                    WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+                // broadcast each lane's corner weight over its embed_dims, laid out like the gathered patches
+                for (uint32_t embed = 0; embed < EmbedDims(); embed += DATA_ALIGN) {
+                    Brcb(cornerWeightLocal[embed], weightLocal[laneAlign * 3], laneRepeat,
+                        {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                    Brcb(cornerWeightLocal[EmbedDims() + embed], weightLocal[laneAlign], laneRepeat,
+                        {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                    Brcb(cornerWeightLocal[laneOffset * 2 + embed], weightLocal[laneAlign * 2], laneRepeat,
+                        {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                    Brcb(cornerWeightLocal[laneOffset * 2 + EmbedDims() + embed], weightLocal, laneRepeat,
+                        {cornerStride, uint16_t(cornerStride * DATA_ALIGN)});
+                }
 
-                    for (uint32_t point = 0; point < numPoints; point++) {
-                        DataCopy(outputGm[dstOffset], tmpResLocal3[srcOffset + point * embedDims], embedDims);
-                    }
+                WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
+                Mul(valueLocal, valueLocal[laneOffset * 4], cornerWeightLocal, 4 * laneOffset);
+                Add(valueLocal, valueLocal, valueLocal[laneOffset * 2], 2 * laneOffset);
+                // left + right column of every lane, one repeat per lane
+                Add(level == 0 ? tmpResLocal3 : tmpResLocal, valueLocal, valueLocal[EmbedDims()], EmbedDims(),
+                    uint8_t(laneAlign), {1, 1, 1, uint8_t(EmbedDims() / DATA_ALIGN), uint8_t(cornerStride),
+                    uint8_t(cornerStride)});
+                if (level > 0) {
+                    Add(tmpResLocal3, tmpResLocal3, tmpResLocal, laneOffset);
                 }
-                SetAtomicNone();
             }
+
+            for (uint32_t point = 1; point < NumPoints(); point++) {
+                Add(tmpResLocal3, tmpResLocal3, tmpResLocal3[point * headEmbed], headEmbed);
+            }
+            SetFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+            WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+            DataCopy(outputGm[moveOffset], tmpResLocal3, headEmbed);
+            SetFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
+            WaitFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
         }
+        GetTPipePtr()->ReleaseEventID<HardEvent::V_MTE2>(eventIdVToMte2);
         GetTPipePtr()->ReleaseEventID<HardEvent::V_MTE3>(eventIdVToMte3);
         GetTPipePtr()->ReleaseEventID<HardEvent::MTE2_V>(eventIdMte2ToV);
-        GetTPipePtr()->ReleaseEventID<HardEvent::MTE2_V>(eventIdMte2ToV_);
+        GetTPipePtr()->ReleaseEventID<HardEvent::MTE3_V>(eventIdMte3ToV);
+        GetTPipePtr()->ReleaseEventID<HardEvent::V_S>(eventIdVToS);
     }
 
 private:
     TPipe* pipe;
     GlobalTensor<DTYPE_VALUE> valueGm, locationGm, attentionWeightsGm, outputGm;
+    GlobalTensor<DTYPE_VALUE> projWeightGm, projBiasGm, projOutputGm, sampledGm;
+    GlobalTensor<int32_t> taskCounterGm;
+    ProjMatmul* projMatmul = nullptr;
     GlobalTensor<DTYPE_VALUE_SPATIAL_SHAPES> valueSpatialShapesGm, valueLevelStartIndexGm;
 
     TBuf<TPosition::VECCALC> locationQueue, attentionWeightsUb, shapeQueue, offsetQueue;
     TBuf<TPosition::VECCALC> outputQueue;
 
-    TBuf<TPosition::VECCALC> tmpResUb, tmpResUb2, tmpResUb3, tmpXUb, tmpYUb, tmpParamUb, tmpIntUb, tmpFloatUb;
+    TBuf<TPosition::VECCALC> tmpResUb, tmpResUb3, tmpXUb, tmpYUb, tmpParamUb, tmpIntUb, tmpFloatUb;
     TBuf<TPosition::VECCALC> intOneUb, floatOneUb, weightQueue, emptyUb;
-    TBuf<TPosition::VECCALC> valueUb, tmpValueUb, cornerWeightUb;
+    TBuf<TPosition::VECCALC> valueUb, tmpValueUb, cornerWeightUb, validMaskUb, headScaleUb;
 
     uint32_t batchSize;
+    uint32_t numSources;
     uint32_t numKeys;
     uint32_t numHeads;
     uint32_t embedDims;
     uint32_t tailNum;
+    uint32_t outputRowStride;
+    uint32_t locationRowStride;
+    uint32_t weightRowStride;
 
     uint32_t numLevels;
     uint32_t numQueries;
@@ -289,6 +942,11 @@ private:
 
     uint32_t numPointsAlign;
     uint32_t numLevelsAlign;
+    uint32_t laneNum;
+    uint32_t lanePointsAlign;
+    uint32_t validNum;
+    uint32_t shapesAlign;
+    uint32_t locationAlign;
 
     uint32_t batch;
     uint32_t query;
@@ -301,22 +959,112 @@ private:
     uint32_t endOffset;
     uint32_t dataAlign;
     uint32_t blockNum = 32;
-
-    DTYPE_VALUE tmp1, tmp2, leftTopWeight, rightTopWeight, leftBottomWeight, rightBottomWeight, attnWeight;
+    uint32_t projDims;
+    uint32_t projChunk;
+    uint32_t chunkStart;
+    uint32_t scheduleChunk = 0;
+    uint32_t querySplit;
+    uint32_t forwardOrder;
+    uint32_t pairBegin = 0;
+    uint32_t pairEnd;
+    bool projBias;
+    bool projSampled = false;
+    bool patchGather;
+    bool headPacked;
+    bool prunePoints;
+    bool renormalizeWeights;
+    bool levelTable;
+    DTYPE_VALUE_SPATIAL_SHAPES levelHeight[MAX_LEVELS], levelWidth[MAX_LEVELS], levelStart[MAX_LEVELS];
+    DTYPE_VALUE weightThreshold;
+    DataCopyParams patchParams, locationRowParams, weightRowParams, pointWeightParams, pointLocationParams;
+    DataCopyPadParams padParams = {false, 0, 0, 0};
+
+    DTYPE_VALUE tmp1, tmp2, attnWeight;
     DTYPE_VALUE_SPATIAL_SHAPES h, w, x0, y0, x1, y1, tmpOffset1, tmpOffset2;
-    DTYPE_VALUE_SPATIAL_SHAPES valueOffset, weightOffset, oriOffset, pointOffset, dataOffset, locationOffset,
-        moveOffset, batchOffset, dstOffset, srcOffset, headOffset;
+    DTYPE_VALUE_SPATIAL_SHAPES weightOffset, pointOffset, batchOffset, srcOffset, headOffset, lane;
+    OFFSET_T valueOffset, oriOffset, locationRowOffset, weightRowOffset, moveOffset, dstOffset;
+    OFFSET_T valueSourceStride;
 };
 
+template <uint32_t EMBED_DIMS, uint32_t NUM_POINTS, typename OFFSET_T = int32_t>
+__aicore__ inline void RunMultiScaleDeformableAttnFuncV2(GM_ADDR value, GM_ADDR valueSpatialShapes,
+                                                         GM_ADDR valueLevelStartIndex, GM_ADDR samplingLocations,
+                                                         GM_ADDR attentionWeights, GM_ADDR output, GM_ADDR workspace,
+                                                         const MultiScaleDeformableAttnFuncV2TilingData* tilingData,
+                                                         TPipe* pipe) {
+    KernelMultiScaleDeformableAttnFuncV2<EMBED_DIMS, NUM_POINTS, OFFSET_T> op;
+    op.Init(value, valueSpatialShapes, valueLevelStartIndex, samplingLocations, attentionWeights, output,
+        tilingData, pipe);
+    op.InitSchedule(workspace, tilingData);
+    op.Process();
+}
+
+__aicore__ inline void RunMultiScaleDeformableAttnFuncV2Projected(GM_ADDR value, GM_ADDR valueSpatialShapes,
+    GM_ADDR valueLevelStartIndex, GM_ADDR samplingLocations, GM_ADDR attentionWeights, GM_ADDR projWeight,
+    GM_ADDR projBias, GM_ADDR output, GM_ADDR sampled, GM_ADDR workspace,
+    const MultiScaleDeformableAttnFuncV2TilingData* tilingData, TPipe* pipe) {
+    SetSysWorkspace(workspace);
+    if (GetSysWorkSpacePtr() == nullptr) {
+        return;
+    }
+    ProjMatmul mm;
+    // the AIC side serves the matmul requests of its two AIV cores inside the registration and returns there
+    REGIST_MATMUL_OBJ(pipe, GetSysWorkSpacePtr(), mm, &tilingData->projTiling);
+    KernelMultiScaleDeformableAttnFuncV2<0, 0, int32_t> op;
+    op.Init(value, valueSpatialShapes, valueLevelStartIndex, samplingLocations, attentionWeights, output,
+        tilingData, pipe);
+    op.InitProjection(projWeight, projBias, output, sampled, workspace, tilingData, &mm);
+    op.Process();
+}
+
 extern "C" __global__ __aicore__ void multi_scale_deformable_attn_func_v2(GM_ADDR value, GM_ADDR value_spatial_shapes, 
                                                                           GM_ADDR value_level_start_index, 
                                                                           GM_ADDR sampling_locations,
-                                                                          GM_ADDR attention_weights, GM_ADDR output,
-                                                                          GM_ADDR workspace, GM_ADDR tiling) {
+                                                                          GM_ADDR attention_weights,
+                                                                          GM_ADDR output_proj_weight,
+                                                                          GM_ADDR output_proj_bias, GM_ADDR output,
+                                                                          GM_ADDR sampled, GM_ADDR workspace,
+                                                                          GM_ADDR tiling) {
     TPipe pipe;
     GET_TILING_DATA(tiling_data, tiling);
-    KernelMultiScaleDeformableAttnFuncV2 op;
-    op.Init(value, value_spatial_shapes, value_level_start_index, sampling_locations, attention_weights, output,
-        &tiling_data, &pipe);
-    op.Process();
+    // tiling key = embed_dims * 100 + num_points for the specialised shapes, 0 for the generic kernel,
+    // 100000 for the generic kernel with 64-bit GM offsets, 200000 for the generic kernel with the output
+    // projection fused in (one AIC per two AIV cores)
+    KERNEL_TASK_TYPE_DEFAULT(KERNEL_TYPE_AIV_ONLY);
+    KERNEL_TASK_TYPE(200000, KERNEL_TYPE_MIX_AIC_1_2);
+    if (TILING_KEY_IS(3204)) {
+        RunMultiScaleDeformableAttnFuncV2<32, 4>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(3208)) {
+        RunMultiScaleDeformableAttnFuncV2<32, 8>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(6404)) {
+        RunMultiScaleDeformableAttnFuncV2<64, 4>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(6408)) {
+        RunMultiScaleDeformableAttnFuncV2<64, 8>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(12804)) {
+        RunMultiScaleDeformableAttnFuncV2<128, 4>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(12808)) {
+        RunMultiScaleDeformableAttnFuncV2<128, 8>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(25604)) {
+        RunMultiScaleDeformableAttnFuncV2<256, 4>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(25608)) {
+        RunMultiScaleDeformableAttnFuncV2<256, 8>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(0)) {
+        RunMultiScaleDeformableAttnFuncV2<0, 0>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(100000)) {
+        RunMultiScaleDeformableAttnFuncV2<0, 0, int64_t>(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output, workspace, &tiling_data, &pipe);
+    } else if (TILING_KEY_IS(200000)) {
+        RunMultiScaleDeformableAttnFuncV2Projected(value, value_spatial_shapes, value_level_start_index,
+            sampling_locations, attention_weights, output_proj_weight, output_proj_bias, output, sampled, workspace,
+            &tiling_data, &pipe);
+    }
 }
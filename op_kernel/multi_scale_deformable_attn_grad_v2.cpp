@@ -2,12 +2,29 @@
 #include "kernel_tiling/kernel_tiling.h"
 using namespace AscendC;
 
+constexpr uint32_t CACHE_MODE_STREAM = 1;
+constexpr uint32_t MAX_DATA_COPY_STRIDE = 65535;
+constexpr uint32_t GRAD_VALUE_ATOMIC = 0;
+constexpr uint32_t GRAD_VALUE_BUCKET = 1;
+constexpr uint32_t GRAD_VALUE_SPARSE = 2;
+constexpr uint32_t SCHEDULE_DYNAMIC = 1;
+constexpr uint32_t MAX_LEVELS = 16;
+// gradMask bits: which of grad_value / grad_sampling_loc / grad_attn_weight the caller needs
+constexpr uint32_t GRAD_MASK_VALUE = 1;
+constexpr uint32_t GRAD_MASK_LOCATION = 2;
+constexpr uint32_t GRAD_MASK_WEIGHT = 4;
+
+// EMBED_DIMS / NUM_POINTS != 0 fold the shape into the instantiation (see the tiling keys at the kernel entry),
+// 0 keeps the runtime value from tiling data. OFFSET_T carries GM element offsets: int32_t, or int64_t on the
+// large-tensor path for tensors past 2^31 elements.
+template <uint32_t EMBED_DIMS, uint32_t NUM_POINTS, typename OFFSET_T>
 class MultiScaleDeformableAttnGradV2 {
 public:
     __aicore__ inline MultiScaleDeformableAttnGradV2(){};
     __aicore__ inline void Init(GM_ADDR value_gm, GM_ADDR spatial_shapes_gm, GM_ADDR level_start_index_gm,
                                 GM_ADDR sampling_loc_gm, GM_ADDR attn_weight_gm, GM_ADDR grad_output_gm,
                                 GM_ADDR grad_value_gm, GM_ADDR grad_sampling_loc_gm, GM_ADDR grad_attn_weight_gm,
+                                GM_ADDR grad_value_index_gm, GM_ADDR workspace,
                                 const MultiScaleDeformableAttnGradV2TilingData *tiling_data, TPipe *tmpPipe) {
         pipe = tmpPipe;
         curBlockIdx = GetBlockIdx();
@@ -21,10 +38,32 @@ public:
         numQueries = tiling_data->numQueries;
         numPoints = tiling_data->numPoints;
         batchSize = tiling_data->batchSize;
+        numSources = tiling_data->numSources;
         coreNum = tiling_data->coreNum;
 
         taskNum = numQueries;
-        taskNumPerCore = DivCeil(taskNum, coreNum);
+        taskNumPerCore = tiling_data->taskNumPerCore;
+
+        needGradValue = (tiling_data->gradMask & GRAD_MASK_VALUE) != 0;
+        needGradLocation = (tiling_data->gradMask & GRAD_MASK_LOCATION) != 0;
+        needGradWeight = (tiling_data->gradMask & GRAD_MASK_WEIGHT) != 0;
+        bucketMode = needGradValue && tiling_data->gradValueMode != GRAD_VALUE_ATOMIC;
+        sparseMode = needGradValue && tiling_data->gradValueMode == GRAD_VALUE_SPARSE;
+        sparseRows = tiling_data->sparseRows;
+        needValueSample = needGradLocation || needGradWeight;
+        bucketTileRows = tiling_data->bucketTileRows;
+        bucketTileNum = tiling_data->bucketTileNum;
+        bucketTileNumAlign = tiling_data->bucketTileNumAlign;
+        bucketChunk = tiling_data->bucketChunk;
+        bucketCapacity = tiling_data->bucketCapacity;
+        scheduleChunk = tiling_data->scheduleMode == SCHEDULE_DYNAMIC ? tiling_data->scheduleChunk : 0;
+        // levels baked into the tiling data by the host; otherwise read from the two shape inputs once per core
+        levelTable = tiling_data->levelTable != 0;
+        for (uint32_t level = 0; levelTable && level < numLevels; level++) {
+            levelHeight[level] = tiling_data->levelHeight[level];
+            levelWidth[level] = tiling_data->levelWidth[level];
+            levelStart[level] = tiling_data->levelStart[level];
+        }
 
         numPointsAlign = AlignUp(numPoints, dataAlign);
         numLevelsAlign = AlignUp(numLevels, dataAlign);
@@ -37,16 +76,20 @@ public:
 
         // offsets
         gradOutStride0 = embedDims;
-        gradOutStride1 = numHeads * gradOutStride0;
-        gradOutStride2 = numQueries * gradOutStride1;
+        gradOutStride1 = tiling_data->gradOutputRowStride;
+        gradOutStride2 = (OFFSET_T)numQueries * gradOutStride1;
         weightStride0 = numLevels * numPoints;
-        weightStride1 = numHeads * weightStride0;
-        weightStride2 = numQueries * weightStride1;
+        weightStride1 = (OFFSET_T)numHeads * weightStride0;
+        weightStride2 = (OFFSET_T)numQueries * weightStride1;
+        locationRowStride = tiling_data->locationRowStride;
+        weightRowStride = tiling_data->weightRowStride;
         valueStride0 = embedDims;
-        valueStride1 = numKeys * valueStride0;
-        valueStride2 = numHeads * valueStride1;
+        valueStride1 = (OFFSET_T)numKeys * valueStride0;
+        valueStride2 = (OFFSET_T)numHeads * valueStride1;
+        // value / grad_value / grad_output stack numSources batches of batchSize, source-major
+        valueSourceStride = (OFFSET_T)batchSize * valueStride2;
+        gradOutSourceStride = (OFFSET_T)batchSize * gradOutStride2;
 
-        hOffsetUb = numPointsAlign;
         baseOffsetUb = numPoints * embedDims;
 
         eventIdMte2ToV = static_cast<event_t>(pipe->AllocEventID<HardEvent::MTE2_V>());
@@ -56,45 +99,106 @@ public:
         eventIdVToMteWeight = static_cast<event_t>(pipe->AllocEventID<HardEvent::V_MTE3>());
         eventIdVToMte3X = static_cast<event_t>(pipe->AllocEventID<HardEvent::V_MTE3>());
         eventIdVToMte3Y = static_cast<event_t>(pipe->AllocEventID<HardEvent::V_MTE3>());
+        eventIdVToS = static_cast<event_t>(pipe->AllocEventID<HardEvent::V_S>());
+        eventIdSToMte3 = static_cast<event_t>(pipe->AllocEventID<HardEvent::S_MTE3>());
+        eventIdMte3ToS = static_cast<event_t>(pipe->AllocEventID<HardEvent::MTE3_S>());
+        if (bucketMode) {
+            eventIdMte2ToS = static_cast<event_t>(pipe->AllocEventID<HardEvent::MTE2_S>());
+        }
+        for (uint32_t slot = 0; slot < 2; slot++) {
+            eventIdInputMte2ToV[slot] = static_cast<event_t>(pipe->AllocEventID<HardEvent::MTE2_V>());
+            eventIdInputVToMte2[slot] = static_cast<event_t>(pipe->AllocEventID<HardEvent::V_MTE2>());
+            eventIdOutputMte3ToV[slot] = static_cast<event_t>(pipe->AllocEventID<HardEvent::MTE3_V>());
+        }
 
         copyParams = {1, (uint16_t)(numPoints * sizeof(DTYPE_VALUE)), 0, 0};
+        // every level's W and H rows (weights: every level's row) of a head in one DMA, each row padded to
+        // numPointsAlign in UB
+        locationCopyParams = {(uint16_t)(2 * numLevels), (uint16_t)(numPoints * sizeof(DTYPE_VALUE)), 0, 0};
+        weightCopyParams = {(uint16_t)numLevels, (uint16_t)(numPoints * sizeof(DTYPE_VALUE)), 0, 0};
+        patchGatherParams = {2, (uint16_t)(2 * embedDims / dataAlign), 0, 0};
+        patchScatterParams = {2, (uint16_t)(2 * embedDims / dataAlign), 0, 0};
         sumParams = {numPoints, embedDims, embedDims};
 
         valueGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE *>(value_gm),
-                                batchSize * numKeys * numHeads * embedDims);
+                                (uint64_t)numSources * valueSourceStride);
         valueSpatialShapesGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_SPATIAL_SHAPES *>(spatial_shapes_gm),
                                              numLevels * 2);
         valueLevelStartIndexGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_SPATIAL_SHAPES *>(level_start_index_gm),
                                                numLevels);
-        locationGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE *>(sampling_loc_gm),
-                                   batchSize * numQueries * numHeads * numLevels * numPoints * 2);
-        attentionWeightsGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE *>(attn_weight_gm),
-                                           batchSize * numQueries * numHeads * numLevels * numPoints);
-        gradOutputGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE *>(grad_output_gm),
-                                     batchSize * numQueries * numHeads * embedDims);
+        // sampling_loc / attn_weight rows sit locationRowStride / weightRowStride apart (views into a fused
+        // projection output); their grads are written dense
+        locationGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE *>(sampling_loc_gm) + tiling_data->locationOffset,
+            (uint64_t)batchSize * numQueries * locationRowStride);
+        attentionWeightsGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE *>(attn_weight_gm) + tiling_data->weightOffset,
+            (uint64_t)batchSize * numQueries * weightRowStride);
+        // grad_output rows sit gradOutStride1 apart from gradOutputOffset, so it can be a slice of a wider buffer
+        gradOutputGm.SetGlobalBuffer(
+            reinterpret_cast<__gm__ DTYPE_VALUE *>(grad_output_gm) + tiling_data->gradOutputOffset,
+            (uint64_t)numSources * gradOutSourceStride);
 
+        // sparse grad_value: sparseRows compacted rows, grad_value_index holds their dense row numbers
         gradValueGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE *>(grad_value_gm),
-                                    batchSize * numKeys * numHeads * embedDims);
+                                    sparseMode ? (uint64_t)sparseRows * embedDims :
+                                                 (uint64_t)numSources * valueSourceStride);
         gradLocationGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE *>(grad_sampling_loc_gm),
-                                       batchSize * numQueries * numHeads * numLevels * 2 * numPoints);
+                                       (uint64_t)batchSize * numQueries * numHeads * numLevels * 2 * numPoints);
         gradWeightGm.SetGlobalBuffer(reinterpret_cast<__gm__ DTYPE_VALUE *>(grad_attn_weight_gm),
-                                     batchSize * numQueries * numHeads * numLevels * numPoints);
+                                     (uint64_t)batchSize * numQueries * numHeads * numLevels * numPoints);
+
+        if (tiling_data->cacheMode == CACHE_MODE_STREAM) {
+            locationGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+            attentionWeightsGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+            gradOutputGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+            gradLocationGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+            gradWeightGm.SetL2CacheHint(CacheMode::CACHE_MODE_DISABLE);
+        }
+
+        // bucket workspace: per core, the run offsets of every key tile (tileNum + 1 entries), then one 32 B
+        // row-index block and embed_dims contributions per corner sample, sorted by key tile
+        if (bucketMode) {
+            GM_ADDR userWorkspace = GetUserWorkspace(workspace);
+            uint64_t offsetBytes = (uint64_t)coreNum * bucketTileNumAlign * sizeof(int32_t);
+            uint64_t rowBytes = (uint64_t)coreNum * bucketCapacity * DATA_ALIGN * sizeof(int32_t);
+            bucketOffsetGm.SetGlobalBuffer(reinterpret_cast<__gm__ int32_t *>(userWorkspace),
+                                           coreNum * bucketTileNumAlign);
+            bucketRowGm.SetGlobalBuffer(reinterpret_cast<__gm__ int32_t *>(userWorkspace + offsetBytes),
+                                        coreNum * bucketCapacity * DATA_ALIGN);
+            bucketValueGm.SetGlobalBuffer(
+                reinterpret_cast<__gm__ DTYPE_VALUE *>(userWorkspace + offsetBytes + rowBytes),
+                coreNum * bucketCapacity * embedDims);
+            bucketBase = curBlockIdx * bucketCapacity;
+            // sparse mode: the compacted-row slot counter sits right after the bucket regions
+            if (sparseMode) {
+                gradValueIndexGm.SetGlobalBuffer(reinterpret_cast<__gm__ int32_t *>(grad_value_index_gm), sparseRows);
+                rowCounterGm.SetGlobalBuffer(
+                    reinterpret_cast<__gm__ int32_t *>(userWorkspace + offsetBytes + rowBytes +
+                                                       (uint64_t)coreNum * bucketCapacity * embedDims *
+                                                           sizeof(DTYPE_VALUE)),
+                    1);
+            }
+        }
+        // dynamic schedule: the task counter is the first word of the user workspace (never with buckets)
+        if (scheduleChunk != 0) {
+            taskCounterGm.SetGlobalBuffer(reinterpret_cast<__gm__ int32_t *>(GetUserWorkspace(workspace)), 1);
+        }
     }
 
     __aicore__ inline void InitBuffer() {
         pipe->InitBuffer(shapeUb, 2 * numLevelsAlign * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(offsetUb, numLevelsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(locationUb, numHeads * numLevels * numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(attentionWeightsUb, numHeads * numLevels * numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(topGradUb, embedDims * sizeof(DTYPE_VALUE));
+        // per-head inputs and per-level sums come in two slots each, see LoadInputs / the level loop of Compute
+        pipe->InitBuffer(locationUb, 2 * 2 * numLevels * numPointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(attentionWeightsUb, 2 * numLevels * numPointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(topGradUb, 2 * numSources * embedDims * sizeof(DTYPE_VALUE));
         
         pipe->InitBuffer(floatOneUb, 2 * numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(tmpXUb, numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(tmpYUb, numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(weightSumUb, numPointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(tmpXUb, 2 * numPointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(tmpYUb, 2 * numPointsAlign * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(weightSumUb, 2 * numPointsAlign * sizeof(DTYPE_VALUE));
 
-        pipe->InitBuffer(locWUb, numPointsAlign * sizeof(DTYPE_VALUE));
-        pipe->InitBuffer(locHUb, numPointsAlign * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(imUb, 2 * numPointsAlign * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(lowUb, 2 * numPointsAlign * sizeof(DTYPE_SPATIAL_SHAPES));
         pipe->InitBuffer(lowFloatUb, 2 * numPointsAlign * sizeof(DTYPE_VALUE));
@@ -114,6 +218,22 @@ public:
 
         pipe->InitBuffer(gradSampleXLocUb, numPoints * embedDims * sizeof(DTYPE_VALUE));
         pipe->InitBuffer(gradSampleYLocUb, numPoints * embedDims * sizeof(DTYPE_VALUE));
+        pipe->InitBuffer(pointIndexUb, numPointsAlign * sizeof(int32_t));
+        pipe->InitBuffer(validPointUb, numPointsAlign * sizeof(uint32_t));
+        pipe->InitBuffer(validMaskUb, AlignUp(numPoints, 256) / 8);
+        pipe->InitBuffer(rangeUb, 2 * numPointsAlign * sizeof(DTYPE_VALUE));
+
+        if (bucketMode) {
+            pipe->InitBuffer(tileCursorUb, bucketTileNumAlign * sizeof(int32_t));
+            pipe->InitBuffer(bucketRowUb, 4 * numPoints * dataAlign * sizeof(int32_t));
+            pipe->InitBuffer(bucketSpanUb, coreNum * dataAlign * sizeof(int32_t));
+            pipe->InitBuffer(tileAccUb, bucketTileRows * embedDims * sizeof(DTYPE_VALUE));
+            pipe->InitBuffer(chunkRowUb, bucketChunk * dataAlign * sizeof(int32_t));
+            pipe->InitBuffer(chunkValueUb, bucketChunk * embedDims * sizeof(DTYPE_VALUE));
+            if (sparseMode) {
+                pipe->InitBuffer(touchedUb, AlignUp(bucketTileRows, dataAlign) * sizeof(int32_t));
+            }
+        }
     }
 
     __aicore__ inline void GetLocalTensor() {
@@ -126,8 +246,6 @@ public:
         weightSumLocal = weightSumUb.Get<DTYPE_VALUE>();
         floatOneLocal = floatOneUb.Get<DTYPE_VALUE>();
         topGradLocal = topGradUb.Get<DTYPE_VALUE>();
-        locWLocal = locWUb.Get<DTYPE_VALUE>();
-        locHLocal = locHUb.Get<DTYPE_VALUE>();
 
         imLocal = imUb.Get<DTYPE_VALUE>();
         lowLocal = lowUb.Get<DTYPE_SPATIAL_SHAPES>();
@@ -149,38 +267,116 @@ public:
 
         gradSampleXLocLocal = gradSampleXLocUb.Get<DTYPE_VALUE>();
         gradSampleYLocLocal = gradSampleYLocUb.Get<DTYPE_VALUE>();
+        pointIndexLocal = pointIndexUb.Get<int32_t>();
+        validPointLocal = validPointUb.Get<uint32_t>();
+        validMaskLocal = validMaskUb.Get<uint8_t>();
+        rangeLocal = rangeUb.Get<DTYPE_VALUE>();
+        CreateVecIndex(pointIndexLocal, (int32_t)0, numPointsAlign);
+
+        if (bucketMode) {
+            tileCursorLocal = tileCursorUb.Get<int32_t>();
+            bucketRowLocal = bucketRowUb.Get<int32_t>();
+            bucketSpanLocal = bucketSpanUb.Get<int32_t>();
+            tileAccLocal = tileAccUb.Get<DTYPE_VALUE>();
+            chunkRowLocal = chunkRowUb.Get<int32_t>();
+            chunkValueLocal = chunkValueUb.Get<DTYPE_VALUE>();
+            if (sparseMode) {
+                touchedLocal = touchedUb.Get<int32_t>();
+            }
+        }
     }
     
     __aicore__ inline void ClearOutput() {
+        // bucketed grad_value writes every output element exactly once, nothing to clear. Sparse grad_value only
+        // writes the touched rows: the unused tail of grad_value_index reads -1. Both are published by the
+        // SyncAll between the two bucket passes.
+        if (bucketMode) {
+            if (sparseMode && curBlockIdx == 0) {
+                InitOutput<int32_t>(gradValueIndexGm, sparseRows, -1);
+                rowCounterGm.SetValue(0, 0);
+                DataCacheCleanAndInvalid<int32_t, CacheLine::SINGLE_CACHE_LINE>(rowCounterGm);
+            }
+            return;
+        }
         switch (curBlockIdx) {
             case 0:
-                InitOutput<DTYPE_VALUE>(gradValueGm, batchSize * numKeys * numHeads * embedDims, 0);
+                if (needGradValue) {
+                    InitOutput<DTYPE_VALUE>(gradValueGm, (uint64_t)numSources * valueSourceStride, 0);
+                }
                 break;
             case 1:
-                InitOutput<DTYPE_VALUE>(gradLocationGm, 2 * batchSize * numQueries * numHeads * numLevels * numPoints);
+                if (needGradLocation) {
+                    InitOutput<DTYPE_VALUE>(gradLocationGm,
+                                            2ULL * batchSize * numQueries * numHeads * numLevels * numPoints);
+                }
                 break;
             case 2:
-                InitOutput<DTYPE_VALUE>(gradWeightGm, batchSize * numQueries * numHeads * numLevels * numPoints);
+                if (needGradWeight) {
+                    InitOutput<DTYPE_VALUE>(gradWeightGm,
+                                            (uint64_t)batchSize * numQueries * numHeads * numLevels * numPoints);
+                }
                 break;
             default:
                 break;
         }
+        // the counter reset is published by the same barrier as the cleared outputs
+        if (scheduleChunk != 0 && curBlockIdx == 0) {
+            taskCounterGm.SetValue(0, 0);
+            DataCacheCleanAndInvalid<int32_t, CacheLine::SINGLE_CACHE_LINE>(taskCounterGm);
+        }
         if ASCEND_IS_AIV {
             SyncAll();
         }
     }
 
     __aicore__ inline void Process() {
-        DataCopy(shapesLocal, valueSpatialShapesGm, 2 * numLevelsAlign);
-        DataCopy(offsetLocal, valueLevelStartIndexGm, numLevelsAlign);
+        if (!levelTable) {
+            DataCopy(shapesLocal, valueSpatialShapesGm, 2 * numLevelsAlign);
+            DataCopy(offsetLocal, valueLevelStartIndexGm, numLevelsAlign);
+        }
         Duplicate<DTYPE_VALUE>(floatOneLocal, (DTYPE_VALUE)1, 2 * numPointsAlign);
-        for (uint32_t taskIdx = startOffset; taskIdx < endOffset; taskIdx++) {
+        // both input slots start free, both output slots start stored
+        for (uint32_t slot = 0; slot < 2; slot++) {
+            SetFlag<HardEvent::V_MTE2>(eventIdInputVToMte2[slot]);
+            SetFlag<HardEvent::MTE3_V>(eventIdOutputMte3ToV[slot]);
+        }
+        if (bucketMode) {
+            CountBuckets();
+            for (uint32_t taskIdx = startOffset; taskIdx < endOffset; taskIdx++) {
+                Compute(taskIdx);
+            }
+        } else if (scheduleChunk == 0) {
+            ComputeRange(startOffset, endOffset);
+        } else {
+            for (uint32_t begin = ClaimChunk(); begin < taskNum; begin = ClaimChunk()) {
+                ComputeRange(begin, begin + scheduleChunk < taskNum ? begin + scheduleChunk : taskNum);
+            }
+        }
+        for (uint32_t slot = 0; slot < 2; slot++) {
+            WaitFlag<HardEvent::V_MTE2>(eventIdInputVToMte2[slot]);
+            WaitFlag<HardEvent::MTE3_V>(eventIdOutputMte3ToV[slot]);
+        }
+        if (bucketMode) {
+            pipe_barrier(PIPE_ALL);
+            SyncAll();
+            ReduceBuckets();
+        }
+    }
+
+    __aicore__ inline void ComputeRange(uint32_t begin, uint32_t end) {
+        for (uint32_t taskIdx = begin; taskIdx < end; taskIdx++) {
             SetAtomicAdd<DTYPE_VALUE>();
             Compute(taskIdx);
             SetAtomicNone();
         }
     }
 
+    // First task of the next unclaimed chunk; taskNum or past it once the queries run out.
+    __aicore__ inline uint32_t ClaimChunk() {
+        return (uint32_t)AtomicAdd(
+            reinterpret_cast<__gm__ int32_t *>(taskCounterGm.GetPhyAddr()), (int32_t)scheduleChunk);
+    }
+
     __aicore__ inline void ReleaseEventID() {
         pipe->ReleaseEventID<HardEvent::MTE2_V>(eventIdMte2ToV);
         pipe->ReleaseEventID<HardEvent::MTE3_V>(eventIdMte3ToV);
@@ -189,158 +385,587 @@ public:
         pipe->ReleaseEventID<HardEvent::V_MTE3>(eventIdVToMteWeight);
         pipe->ReleaseEventID<HardEvent::V_MTE3>(eventIdVToMte3X);
         pipe->ReleaseEventID<HardEvent::V_MTE3>(eventIdVToMte3Y);
+        pipe->ReleaseEventID<HardEvent::V_S>(eventIdVToS);
+        pipe->ReleaseEventID<HardEvent::S_MTE3>(eventIdSToMte3);
+        pipe->ReleaseEventID<HardEvent::MTE3_S>(eventIdMte3ToS);
+        if (bucketMode) {
+            pipe->ReleaseEventID<HardEvent::MTE2_S>(eventIdMte2ToS);
+        }
+        for (uint32_t slot = 0; slot < 2; slot++) {
+            pipe->ReleaseEventID<HardEvent::MTE2_V>(eventIdInputMte2ToV[slot]);
+            pipe->ReleaseEventID<HardEvent::V_MTE2>(eventIdInputVToMte2[slot]);
+            pipe->ReleaseEventID<HardEvent::MTE3_V>(eventIdOutputMte3ToV[slot]);
+        }
     }
 
 private:
+    // compare results per repeat: one bit for each element of a 256 B vector
+    static constexpr uint32_t POINT_MASK_REPEAT = 256 / sizeof(DTYPE_VALUE);
+    static constexpr uint32_t DATA_ALIGN = 32 / sizeof(DTYPE_VALUE);
+
+    __aicore__ inline uint32_t EmbedDims() const {
+        return EMBED_DIMS != 0 ? EMBED_DIMS : embedDims;
+    }
+
+    __aicore__ inline uint32_t NumPoints() const {
+        return NUM_POINTS != 0 ? NUM_POINTS : numPoints;
+    }
+
+    __aicore__ inline uint32_t NumPointsAlign() const {
+        return NUM_POINTS != 0 ? (NUM_POINTS + DATA_ALIGN - 1) / DATA_ALIGN * DATA_ALIGN : numPointsAlign;
+    }
+
+    __aicore__ inline uint32_t BaseOffsetUb() const {
+        return (EMBED_DIMS != 0 && NUM_POINTS != 0) ? EMBED_DIMS * NUM_POINTS : baseOffsetUb;
+    }
+
+    // Corner c of the current point's 2x2 patch sits at patchOffset + c * embedDims, in the order
+    // top-left, top-right, bottom-left, bottom-right: value in zerosLocal[valuePatchId], grad in midLocal.
     template <bool AddH, bool AddW>
-    __aicore__ inline void ComputeGrad(uint32_t midId, uint32_t vId, DTYPE_VALUE distH, DTYPE_VALUE distW, 
-                                       uint32_t hPtrOffset, uint32_t wPtrOffset, DTYPE_VALUE w) {
-        uint32_t offsetMid = (point + midId * numPoints) * embedDims;
-        uint32_t offsetV = vId * baseOffsetUb;
-        uint32_t offsetGradHWeight = pointOffset + gradHWeightId * baseOffsetUb;
-        uint32_t offsetGradWWeight = pointOffset + gradWWeightId * baseOffsetUb;
-        uint32_t ptr = hPtrOffset + wPtrOffset;
-        DataCopy(zerosLocal[pointOffset + offsetV], valueGm[offsetValue + ptr], embedDims);
-        SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
-
-        Muls(midLocal[offsetMid], zerosLocal[pointOffset + topGradValueId * baseOffsetUb], w, embedDims);
-        SetFlag<HardEvent::V_MTE3>(eventIdVToMte3);
-
-        WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
-        Muls(tmpALocal, zerosLocal[pointOffset + offsetV], distW, embedDims);
-        Muls(tmpBLocal, zerosLocal[pointOffset + offsetV], distH, embedDims);
+    __aicore__ inline void ComputeGrad(uint32_t corner, DTYPE_VALUE distH, DTYPE_VALUE distW, DTYPE_VALUE w) {
+        uint32_t offsetCorner = patchOffset + corner * EmbedDims();
+        uint32_t offsetV = valuePatchId * BaseOffsetUb() + offsetCorner;
+        uint32_t offsetGradHWeight = pointOffset + gradHWeightId * BaseOffsetUb();
+        uint32_t offsetGradWWeight = pointOffset + gradWWeightId * BaseOffsetUb();
+
+        if (needGradValue) {
+            Muls(midLocal[offsetCorner], zerosLocal[pointOffset + topGradValueId * BaseOffsetUb()], w, EmbedDims());
+        }
+        if (!needGradLocation) {
+            return;
+        }
+        Muls(tmpALocal, zerosLocal[offsetV], distW, EmbedDims());
+        Muls(tmpBLocal, zerosLocal[offsetV], distH, EmbedDims());
         if (AddH) {
-            Add(zerosLocal[offsetGradHWeight], zerosLocal[offsetGradHWeight], tmpALocal, embedDims);
+            Add(zerosLocal[offsetGradHWeight], zerosLocal[offsetGradHWeight], tmpALocal, EmbedDims());
         } else {
-            Sub(zerosLocal[offsetGradHWeight], zerosLocal[offsetGradHWeight], tmpALocal, embedDims);
+            Sub(zerosLocal[offsetGradHWeight], zerosLocal[offsetGradHWeight], tmpALocal, EmbedDims());
         }
         if (AddW) {
-            Add(zerosLocal[offsetGradWWeight], zerosLocal[offsetGradWWeight], tmpBLocal, embedDims);
+            Add(zerosLocal[offsetGradWWeight], zerosLocal[offsetGradWWeight], tmpBLocal, EmbedDims());
         } else {
-            Sub(zerosLocal[offsetGradWWeight], zerosLocal[offsetGradWWeight], tmpBLocal, embedDims);
+            Sub(zerosLocal[offsetGradWWeight], zerosLocal[offsetGradWWeight], tmpBLocal, EmbedDims());
         }
+    }
 
-        WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3);
-        DataCopy(gradValueGm[offsetValue + ptr], midLocal[offsetMid], embedDims);
+    // Interior patches take one strided DMA (2 rows of 2 corners, row pitch hStride); edge patches copy
+    // only the in-range corners and zero the others on the vector unit.
+    __aicore__ inline void GatherPatch(bool hasTop, bool hasBottom, bool hasLeft, bool hasRight) {
+        LocalTensor<DTYPE_VALUE> patchLocal = zerosLocal[valuePatchId * BaseOffsetUb() + patchOffset];
+        OFFSET_T ptr = offsetValue + hLowPtrOffset + wLowPtrOffset;
+        if (patchCopy && hasTop && hasBottom && hasLeft && hasRight) {
+            DataCopy(patchLocal, valueGm[ptr], patchGatherParams);
+            return;
+        }
+        bool present[4] = {hasTop && hasLeft, hasTop && hasRight, hasBottom && hasLeft, hasBottom && hasRight};
+        for (uint32_t corner = 0; corner < 4; corner++) {
+            if (!present[corner]) {
+                Duplicate(patchLocal[corner * EmbedDims()], (DTYPE_VALUE)0, EmbedDims());
+            }
+        }
+        if (hasTop) {
+            GatherRow(patchLocal, ptr, hasLeft, hasRight);
+        }
+        if (hasBottom) {
+            GatherRow(patchLocal[2 * EmbedDims()], ptr + hStride, hasLeft, hasRight);
+        }
+    }
+
+    __aicore__ inline void GatherRow(const LocalTensor<DTYPE_VALUE> &rowLocal, OFFSET_T ptr, bool hasLeft,
+                                     bool hasRight) {
+        if (hasLeft && hasRight) {
+            DataCopy(rowLocal, valueGm[ptr], 2 * EmbedDims());
+        } else if (hasLeft) {
+            DataCopy(rowLocal, valueGm[ptr], EmbedDims());
+        } else if (hasRight) {
+            DataCopy(rowLocal[EmbedDims()], valueGm[ptr + wStride], EmbedDims());
+        }
+    }
+
+    __aicore__ inline void ScatterPatch(bool hasTop, bool hasBottom, bool hasLeft, bool hasRight) {
+        LocalTensor<DTYPE_VALUE> patchLocal = midLocal[patchOffset];
+        OFFSET_T ptr = offsetValue + hLowPtrOffset + wLowPtrOffset;
+        if (patchCopy && hasTop && hasBottom && hasLeft && hasRight) {
+            DataCopy(gradValueGm[ptr], patchLocal, patchScatterParams);
+            return;
+        }
+        if (hasTop) {
+            ScatterRow(patchLocal, ptr, hasLeft, hasRight);
+        }
+        if (hasBottom) {
+            ScatterRow(patchLocal[2 * EmbedDims()], ptr + hStride, hasLeft, hasRight);
+        }
+    }
+
+    __aicore__ inline void ScatterRow(const LocalTensor<DTYPE_VALUE> &rowLocal, OFFSET_T ptr, bool hasLeft,
+                                      bool hasRight) {
+        if (hasLeft && hasRight) {
+            DataCopy(gradValueGm[ptr], rowLocal, 2 * EmbedDims());
+        } else if (hasLeft) {
+            DataCopy(gradValueGm[ptr], rowLocal, EmbedDims());
+        } else if (hasRight) {
+            DataCopy(gradValueGm[ptr + wStride], rowLocal[EmbedDims()], EmbedDims());
+        }
+    }
+
+    // Inputs of one (batch, query, head): every source's grad_output row and every level's locations and weights.
+    // Two slots: BeginHead queues the next (batch, head) of the query into the other slot while the current one
+    // computes.
+    __aicore__ inline void LoadInputs(uint32_t query, uint32_t loadBatch, uint32_t loadHead, uint32_t slot) {
+        OFFSET_T row = (OFFSET_T)loadBatch * numQueries + query;
+        WaitFlag<HardEvent::V_MTE2>(eventIdInputVToMte2[slot]);
+        for (uint32_t source = 0; source < numSources; source++) {
+            DataCopy(topGradUb.Get<DTYPE_VALUE>()[(slot * numSources + source) * EmbedDims()],
+                     gradOutputGm[source * gradOutSourceStride + (OFFSET_T)loadBatch * gradOutStride2 +
+                                  query * gradOutStride1 + loadHead * gradOutStride0],
+                     EmbedDims());
+        }
+        DataCopyPad(locationUb.Get<DTYPE_VALUE>()[slot * 2 * numLevels * NumPointsAlign()],
+                    locationGm[row * locationRowStride + 2 * loadHead * weightStride0], locationCopyParams, padParams);
+        DataCopyPad(attentionWeightsUb.Get<DTYPE_VALUE>()[slot * numLevels * NumPointsAlign()],
+                    attentionWeightsGm[row * weightRowStride + loadHead * weightStride0], weightCopyParams, padParams);
+        SetFlag<HardEvent::MTE2_V>(eventIdInputMte2ToV[slot]);
+    }
+
+    __aicore__ inline void BeginHead(uint32_t query) {
+        if (head + 1 < numHeads) {
+            LoadInputs(query, batch, head + 1, inputSlot ^ 1);
+        } else if (batch + 1 < batchSize) {
+            LoadInputs(query, batch + 1, 0, inputSlot ^ 1);
+        }
+        topGradLocal = topGradUb.Get<DTYPE_VALUE>()[inputSlot * numSources * EmbedDims()];
+        locationLocal = locationUb.Get<DTYPE_VALUE>()[inputSlot * 2 * numLevels * NumPointsAlign()];
+        attentionWeightLocal = attentionWeightsUb.Get<DTYPE_VALUE>()[inputSlot * numLevels * NumPointsAlign()];
+        WaitFlag<HardEvent::MTE2_V>(eventIdInputMte2ToV[inputSlot]);
+    }
+
+    __aicore__ inline void EndHead() {
+        SetFlag<HardEvent::V_MTE2>(eventIdInputVToMte2[inputSlot]);
+        inputSlot ^= 1;
+    }
+
+    // Sampling coordinates of the current (batch, head, level): imLocal / lowLocal / distLowLocal / distHighLocal
+    // hold W in the first numPointsAlign lanes and H in the second.
+    __aicore__ inline void LoadLevel() {
+        if (levelTable) {
+            levelStartId = levelStart[level];
+            h = levelHeight[level];
+            w = levelWidth[level];
+        } else {
+            levelStartId = offsetLocal.GetValue(level);
+            h = shapesLocal.GetValue(level * 2);
+            w = shapesLocal.GetValue(level * 2 + 1);
+        }
+        offsetValue = (OFFSET_T)batch * valueStride2 + head * valueStride1 + levelStartId * valueStride0;
+        wStride = EmbedDims();
+        hStride = w * wStride;
+        Muls(imLocal[NumPointsAlign()], locationLocal[(2 * level + 1) * NumPointsAlign()], (DTYPE_VALUE)h,
+             NumPointsAlign());
+        Muls(imLocal, locationLocal[2 * level * NumPointsAlign()], (DTYPE_VALUE)w, NumPointsAlign());
+        Adds(imLocal, imLocal, DTYPE_VALUE(-0.5), 2 * NumPointsAlign());
+        Cast(lowLocal, imLocal, RoundMode::CAST_FLOOR, 2 * NumPointsAlign());
+        Cast(lowFloatLocal, lowLocal, RoundMode::CAST_NONE, 2 * NumPointsAlign());
+
+        Sub(distLowLocal, imLocal, lowFloatLocal, 2 * NumPointsAlign());
+        Sub(distHighLocal, floatOneLocal, distLowLocal, 2 * NumPointsAlign());
+    }
+
+    // The level's range test -1 < wIm < w, -1 < hIm < h on the vector unit, as min(wIm + 1, w - wIm, hIm + 1,
+    // h - hIm) > 0. GatherMask packs the in-range point indices into validPointLocal (validNum of them), so the
+    // point loops and the per-level vector work only visit points that touch the map.
+    __aicore__ inline void CompactValidPoints() {
+        LocalTensor<DTYPE_VALUE> boundLocal = rangeLocal[NumPointsAlign()];
+        Adds(rangeLocal, imLocal, (DTYPE_VALUE)1, NumPointsAlign());
+        Muls(boundLocal, imLocal, (DTYPE_VALUE)-1, NumPointsAlign());
+        Adds(boundLocal, boundLocal, (DTYPE_VALUE)w, NumPointsAlign());
+        Min(rangeLocal, rangeLocal, boundLocal, NumPointsAlign());
+        Adds(boundLocal, imLocal[NumPointsAlign()], (DTYPE_VALUE)1, NumPointsAlign());
+        Min(rangeLocal, rangeLocal, boundLocal, NumPointsAlign());
+        Muls(boundLocal, imLocal[NumPointsAlign()], (DTYPE_VALUE)-1, NumPointsAlign());
+        Adds(boundLocal, boundLocal, (DTYPE_VALUE)h, NumPointsAlign());
+        Min(rangeLocal, rangeLocal, boundLocal, NumPointsAlign());
+        CompareScalar(validMaskLocal, rangeLocal, (DTYPE_VALUE)0, CMPMODE::GT,
+                      NumPoints() < POINT_MASK_REPEAT ? NumPoints() : POINT_MASK_REPEAT,
+                      uint8_t((NumPoints() + POINT_MASK_REPEAT - 1) / POINT_MASK_REPEAT), {1, 1, 8, 8});
+
+        uint64_t validCount = 0;
+        GatherMask(validPointLocal, pointIndexLocal.ReinterpretCast<uint32_t>(),
+                   validMaskLocal.ReinterpretCast<uint32_t>(), true, NumPoints(), {1, 1, 8, 0}, validCount);
+        validNum = static_cast<uint32_t>(validCount);
+        SetFlag<HardEvent::V_S>(eventIdVToS);
+        WaitFlag<HardEvent::V_S>(eventIdVToS);
+    }
+
+    // Spreads the compacted per-point sums back to point order in place, zero for out-of-range points. Walking
+    // down keeps every source slot (at or below its point) unread-before-overwritten.
+    __aicore__ inline void ExpandValidPoints() {
+        int32_t slot = static_cast<int32_t>(validNum) - 1;
+        for (int32_t idx = static_cast<int32_t>(NumPoints()) - 1; idx >= 0; idx--) {
+            bool valid = slot >= 0 && validPointLocal.GetValue(slot) == static_cast<uint32_t>(idx);
+            if (needGradWeight) {
+                weightSumLocal.SetValue(idx, valid ? weightSumLocal.GetValue(slot) : (DTYPE_VALUE)0);
+            }
+            if (needGradLocation) {
+                xLocal.SetValue(idx, valid ? xLocal.GetValue(slot) : (DTYPE_VALUE)0);
+                yLocal.SetValue(idx, valid ? yLocal.GetValue(slot) : (DTYPE_VALUE)0);
+            }
+            if (valid) {
+                slot--;
+            }
+        }
+    }
+
+    // Bucketed grad_value, pass one: count this core's corner samples per key tile and turn the counts into
+    // run offsets in its workspace region (a counting sort local to the core), published for the tile owners.
+    __aicore__ inline void CountBuckets() {
+        Duplicate<int32_t>(tileCursorLocal, 0, bucketTileNumAlign);
+        SetFlag<HardEvent::V_S>(eventIdVToS);
+        WaitFlag<HardEvent::V_S>(eventIdVToS);
+        for (query = startOffset; query < endOffset; query++) {
+            LoadInputs(query, 0, 0, inputSlot);
+            for (batch = 0; batch < batchSize; batch++) {
+                for (head = 0; head < numHeads; head++) {
+                    BeginHead(query);
+                    for (level = 0; level < numLevels; level++) {
+                        LoadLevel();
+                        CompactValidPoints();
+                        for (uint32_t slot = 0; slot < validNum; slot++) {
+                            point = validPointLocal.GetValue(slot);
+                            hLow = lowLocal.GetValue(NumPointsAlign() + point);
+                            wLow = lowLocal.GetValue(point);
+                            DTYPE_SPATIAL_SHAPES row = offsetValue / EmbedDims() + hLow * w + wLow;
+                            CountCorner(row, hLow >= 0 && wLow >= 0);
+                            CountCorner(row + 1, hLow >= 0 && wLow < w - 1);
+                            CountCorner(row + w, hLow < h - 1 && wLow >= 0);
+                            CountCorner(row + w + 1, hLow < h - 1 && wLow < w - 1);
+                        }
+                    }
+                    EndHead();
+                }
+            }
+        }
+        int32_t runOffset = 0;
+        for (uint32_t tile = 0; tile < bucketTileNum; tile++) {
+            int32_t count = tileCursorLocal.GetValue(tile);
+            tileCursorLocal.SetValue(tile, runOffset);
+            runOffset += count;
+        }
+        tileCursorLocal.SetValue(bucketTileNum, runOffset);
+        SetFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+        WaitFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+        DataCopy(bucketOffsetGm[curBlockIdx * bucketTileNumAlign], tileCursorLocal, bucketTileNumAlign);
+        SetFlag<HardEvent::MTE3_S>(eventIdMte3ToS);
+        WaitFlag<HardEvent::MTE3_S>(eventIdMte3ToS);
+    }
+
+    __aicore__ inline void CountCorner(DTYPE_SPATIAL_SHAPES row, bool present) {
+        if (present) {
+            uint32_t tile = row / bucketTileRows;
+            tileCursorLocal.SetValue(tile, tileCursorLocal.GetValue(tile) + 1);
+        }
+    }
+
+    // Appends the present corners of the patch to their key tiles' runs: a 32 B block with the grad_value
+    // row index and the embed_dims contributions from midLocal. Visit order matches CountBuckets.
+    __aicore__ inline void BucketPatch(bool hasTop, bool hasBottom, bool hasLeft, bool hasRight) {
+        DTYPE_SPATIAL_SHAPES row = (offsetValue + hLowPtrOffset + wLowPtrOffset) / EmbedDims();
+        bool present[4] = {hasTop && hasLeft, hasTop && hasRight, hasBottom && hasLeft, hasBottom && hasRight};
+        DTYPE_SPATIAL_SHAPES cornerRow[4] = {row, row + 1, row + w, row + w + 1};
+        int32_t cursor[4];
+        for (uint32_t corner = 0; corner < 4; corner++) {
+            if (present[corner]) {
+                uint32_t tile = cornerRow[corner] / bucketTileRows;
+                cursor[corner] = tileCursorLocal.GetValue(tile);
+                tileCursorLocal.SetValue(tile, cursor[corner] + 1);
+                bucketRowLocal.SetValue((point * 4 + corner) * DATA_ALIGN, cornerRow[corner]);
+            }
+        }
+        SetFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+        WaitFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+        for (uint32_t corner = 0; corner < 4; corner++) {
+            if (present[corner]) {
+                DataCopy(bucketRowGm[(bucketBase + cursor[corner]) * DATA_ALIGN],
+                         bucketRowLocal[(point * 4 + corner) * DATA_ALIGN], DATA_ALIGN);
+                DataCopy(bucketValueGm[(bucketBase + cursor[corner]) * EmbedDims()],
+                         midLocal[patchOffset + corner * EmbedDims()], EmbedDims());
+            }
+        }
+    }
+
+    // Bucketed grad_value, pass two: core c owns key tiles c, c + coreNum, ..., folds the runs every core
+    // appended for the tile into UB (in core order, so the result is deterministic) and writes its rows once.
+    __aicore__ inline void ReduceBuckets() {
+        uint32_t totalRows = batchSize * numHeads * numKeys;
+        for (uint32_t tile = curBlockIdx; tile < bucketTileNum; tile += coreNum) {
+            uint32_t rowStart = tile * bucketTileRows;
+            uint32_t tileRows = totalRows - rowStart < bucketTileRows ? totalRows - rowStart : bucketTileRows;
+            for (uint32_t src = 0; src < coreNum; src++) {
+                DataCopy(bucketSpanLocal[src * DATA_ALIGN], bucketOffsetGm[src * bucketTileNumAlign + tile],
+                         DATA_ALIGN);
+            }
+            Duplicate(tileAccLocal, (DTYPE_VALUE)0, tileRows * EmbedDims());
+            if (sparseMode) {
+                Duplicate(touchedLocal, 0, AlignUp(tileRows, dataAlign));
+                SetFlag<HardEvent::V_S>(eventIdVToS);
+                WaitFlag<HardEvent::V_S>(eventIdVToS);
+            }
+            SetFlag<HardEvent::MTE2_S>(eventIdMte2ToS);
+            WaitFlag<HardEvent::MTE2_S>(eventIdMte2ToS);
+            for (uint32_t src = 0; src < coreNum; src++) {
+                int32_t runEnd = bucketSpanLocal.GetValue(src * DATA_ALIGN + 1);
+                for (int32_t cursor = bucketSpanLocal.GetValue(src * DATA_ALIGN); cursor < runEnd;
+                     cursor += bucketChunk) {
+                    uint32_t records = runEnd - cursor < (int32_t)bucketChunk ? runEnd - cursor : bucketChunk;
+                    uint32_t recordBase = src * bucketCapacity + cursor;
+                    DataCopy(chunkRowLocal, bucketRowGm[recordBase * DATA_ALIGN], records * DATA_ALIGN);
+                    DataCopy(chunkValueLocal, bucketValueGm[recordBase * EmbedDims()], records * EmbedDims());
+                    SetFlag<HardEvent::MTE2_S>(eventIdMte2ToS);
+                    SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
+                    WaitFlag<HardEvent::MTE2_S>(eventIdMte2ToS);
+                    WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
+                    for (uint32_t record = 0; record < records; record++) {
+                        uint32_t tileRow = chunkRowLocal.GetValue(record * DATA_ALIGN) - rowStart;
+                        uint32_t accOffset = tileRow * EmbedDims();
+                        Add(tileAccLocal[accOffset], tileAccLocal[accOffset], chunkValueLocal[record * EmbedDims()],
+                            EmbedDims());
+                        if (sparseMode) {
+                            touchedLocal.SetValue(tileRow, 1);
+                        }
+                    }
+                    SetFlag<HardEvent::V_MTE2>(eventIdVToMte2);
+                    WaitFlag<HardEvent::V_MTE2>(eventIdVToMte2);
+                }
+            }
+            SetFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+            WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+            if (sparseMode) {
+                WriteTouchedRows(rowStart, tileRows);
+            } else {
+                DataCopy(gradValueGm[rowStart * EmbedDims()], tileAccLocal, tileRows * EmbedDims());
+            }
+            SetFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
+            WaitFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
+        }
+    }
+
+    // Sparse grad_value: compacts the touched-row flags of the tile into dense row numbers, claims that many
+    // output slots from the row counter and writes the indices and the rows, a run of adjacent rows per DMA.
+    // Rows of a tile stay in order, tiles land in claim order.
+    __aicore__ inline void WriteTouchedRows(uint32_t rowStart, uint32_t tileRows) {
+        uint32_t touched = 0;
+        for (uint32_t row = 0; row < tileRows; row++) {
+            if (touchedLocal.GetValue(row) != 0) {
+                touchedLocal.SetValue(touched, rowStart + row);
+                touched++;
+            }
+        }
+        if (touched == 0) {
+            return;
+        }
+        uint32_t slot = (uint32_t)AtomicAdd(reinterpret_cast<__gm__ int32_t *>(rowCounterGm.GetPhyAddr()),
+                                            (int32_t)touched);
+        SetFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+        WaitFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+        DataCopyPad(gradValueIndexGm[slot], touchedLocal, {1, (uint16_t)(touched * sizeof(int32_t)), 0, 0});
+        uint32_t runStart = 0;
+        for (uint32_t i = 1; i <= touched; i++) {
+            if (i == touched || touchedLocal.GetValue(i) != touchedLocal.GetValue(i - 1) + 1) {
+                DataCopy(gradValueGm[(slot + runStart) * EmbedDims()],
+                         tileAccLocal[(touchedLocal.GetValue(runStart) - rowStart) * EmbedDims()],
+                         (i - runStart) * EmbedDims());
+                runStart = i;
+            }
+        }
+        SetFlag<HardEvent::MTE3_S>(eventIdMte3ToS);
+        WaitFlag<HardEvent::MTE3_S>(eventIdMte3ToS);
     }
 
     __aicore__ inline void Compute(uint32_t query) {
+        LoadInputs(query, 0, 0, inputSlot);
         for (batch = 0; batch < batchSize; batch++) {
             for (head = 0; head < numHeads; head++) {
-                offsetWeight = batch * weightStride2 + query * weightStride1 + head * weightStride0;
+                offsetWeight = (OFFSET_T)batch * weightStride2 + query * weightStride1 + head * weightStride0;
                 offsetLocation = 2 * offsetWeight;
-                DataCopy(topGradLocal,
-                         gradOutputGm[batch * gradOutStride2 + query * gradOutStride1 + head * gradOutStride0],
-                         embedDims);
+                BeginHead(query);
                 for (level = 0; level < numLevels; level++) {
-                    levelStartId = offsetLocal.GetValue(level);
-                    h = shapesLocal.GetValue(level * 2);
-                    w = shapesLocal.GetValue(level * 2 + 1);
-                    offsetValue = batch * valueStride2 + head * valueStride1 + levelStartId * valueStride0;
-                    wStride = embedDims;
-                    hStride = w * wStride;
-                    DataCopy(locWLocal, locationGm[offsetLocation + level * numPoints * 2], numPointsAlign);
-                    DataCopy(locHLocal, locationGm[offsetLocation + level * numPoints * 2 + numPoints], numPointsAlign);
-                    SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
-                    WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
-                    DataCopy(attentionWeightLocal, attentionWeightsGm[offsetWeight + level * numPoints],
-                             numPointsAlign);
-                    Muls(imLocal[hOffsetUb], locHLocal, (DTYPE_VALUE)h, numPointsAlign);
-                    Muls(imLocal, locWLocal, (DTYPE_VALUE)w, numPointsAlign);
-                    Adds(imLocal, imLocal, DTYPE_VALUE(-0.5), 2 * numPointsAlign);
-                    Cast(lowLocal, imLocal, RoundMode::CAST_FLOOR, 2 * numPointsAlign);
-                    Cast(lowFloatLocal, lowLocal, RoundMode::CAST_NONE, 2 * numPointsAlign);
+                    LoadLevel();
 
-                    Sub(distLowLocal, imLocal, lowFloatLocal, 2 * numPointsAlign);
-                    Sub(distHighLocal, floatOneLocal, distLowLocal, 2 * numPointsAlign);
+                    // slot j of every zerosLocal region belongs to the j-th in-range point, so only validNum slots
+                    // are reduced. The point loop writes each slot once except the location-grad accumulators;
+                    // GatherPatch zeroes the absent corners of edge patches itself.
+                    CompactValidPoints();
+                    patchCopy = w > 1 && (w - 2) * EmbedDims() / DATA_ALIGN <= MAX_DATA_COPY_STRIDE;
+                    patchGatherParams.srcStride = patchCopy ? (w - 2) * EmbedDims() / DATA_ALIGN : 0;
+                    patchScatterParams.dstStride = patchGatherParams.srcStride;
 
-                    Duplicate(zerosLocal, (DTYPE_VALUE)0, 8 * numPoints * embedDims);
+                    // the sources share the level's coordinates and corner weights; each reads its own
+                    // grad_output row and value batch and adds into the same grad_sampling_loc / grad_attn_weight
+                    levelValueOffset = offsetValue;
+                    for (uint32_t source = 0; source < numSources; source++) {
+                        offsetValue = levelValueOffset + source * valueSourceStride;
+                        topGradLocal = topGradUb.Get<DTYPE_VALUE>()[(inputSlot * numSources + source) * EmbedDims()];
+                        if (needGradLocation) {
+                            Duplicate(zerosLocal[gradHWeightId * BaseOffsetUb()], (DTYPE_VALUE)0,
+                                      validNum * EmbedDims());
+                            Duplicate(zerosLocal[gradWWeightId * BaseOffsetUb()], (DTYPE_VALUE)0,
+                                      validNum * EmbedDims());
+                        }
 
-                    SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
-                    WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
+                        SetFlag<HardEvent::V_MTE2>(eventIdVToMte2);
+                        WaitFlag<HardEvent::V_MTE2>(eventIdVToMte2);
 
-                    for (point = 0; point < numPoints; point++) {
-                        pointOffset = point * embedDims;
-                        hIm = imLocal.GetValue(hOffsetUb + point);
-                        wIm = imLocal.GetValue(point);
-                        if (hIm > -1 && wIm > -1 && hIm < h && wIm < w) {
-                            hLow = lowLocal.GetValue(hOffsetUb + point);
+                        for (uint32_t slot = 0; slot < validNum; slot++) {
+                            point = validPointLocal.GetValue(slot);
+                            pointOffset = slot * EmbedDims();
+                            patchOffset = 4 * pointOffset;
+                            hLow = lowLocal.GetValue(NumPointsAlign() + point);
                             wLow = lowLocal.GetValue(point);
                             hLowPtrOffset = hLow * hStride;
                             wLowPtrOffset = wLow * wStride;
-                            Muls(zerosLocal[pointOffset + topGradValueId * baseOffsetUb], topGradLocal,
-                                 attentionWeightLocal.GetValue(point), embedDims);
-                            if (hLow >= 0) {
-                                if (wLow >= 0) {
-                                    DTYPE_VALUE distH = distHighLocal.GetValue(hOffsetUb + point);
-                                    DTYPE_VALUE distW = distHighLocal.GetValue(point);
-                                    w1 = distH * distW;
-                                    ComputeGrad<false, false>(mid1Id, v1Id, distH, distW, hLowPtrOffset, wLowPtrOffset,
-                                                              w1);
-                                }
-                                if (wLow < w - 1) {
-                                    DTYPE_VALUE distH = distHighLocal.GetValue(hOffsetUb + point);
-                                    DTYPE_VALUE distW = distLowLocal.GetValue(point);
-                                    w2 = distH * distW;
-                                    ComputeGrad<false, true>(mid2Id, v2Id, distH, distW, hLowPtrOffset, wLowPtrOffset + wStride,
-                                                             w2);
-                                }
+                            bool hasTop = hLow >= 0;
+                            bool hasBottom = hLow < h - 1;
+                            bool hasLeft = wLow >= 0;
+                            bool hasRight = wLow < w - 1;
+                            // the sampled values only feed grad_sampling_loc and grad_attn_weight
+                            if (needValueSample) {
+                                GatherPatch(hasTop, hasBottom, hasLeft, hasRight);
+                                SetFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
                             }
-                            if (hLow < h - 1) {
-                                if (wLow >= 0) {
-                                    DTYPE_VALUE distH = distLowLocal.GetValue(hOffsetUb + point);
-                                    DTYPE_VALUE distW = distHighLocal.GetValue(point);
-                                    w3 = distH * distW;
-                                    ComputeGrad<true, false>(mid3Id, v3Id, distH, distW, hLowPtrOffset + hStride, wLowPtrOffset,
-                                                             w3);
-                                }
-                                if (wLow < w - 1) {
-                                    DTYPE_VALUE distH = distLowLocal.GetValue(hOffsetUb + point);
-                                    DTYPE_VALUE distW = distLowLocal.GetValue(point);
-                                    w4 = distH * distW;
-                                    ComputeGrad<true, true>(mid4Id, v4Id, distH, distW, hLowPtrOffset + hStride, wLowPtrOffset + wStride,
-                                                            w4);
+
+                            if (needGradValue || needGradLocation) {
+                                Muls(zerosLocal[pointOffset + topGradValueId * BaseOffsetUb()], topGradLocal,
+                                     attentionWeightLocal.GetValue(level * NumPointsAlign() + point), EmbedDims());
+                            }
+                            DTYPE_VALUE distHighH = distHighLocal.GetValue(NumPointsAlign() + point);
+                            DTYPE_VALUE distHighW = distHighLocal.GetValue(point);
+                            DTYPE_VALUE distLowH = distLowLocal.GetValue(NumPointsAlign() + point);
+                            DTYPE_VALUE distLowW = distLowLocal.GetValue(point);
+                            w1 = distHighH * distHighW;
+                            w2 = distHighH * distLowW;
+                            w3 = distLowH * distHighW;
+                            w4 = distLowH * distLowW;
+
+                            if (needValueSample) {
+                                WaitFlag<HardEvent::MTE2_V>(eventIdMte2ToV);
+                            }
+                            if (hasTop && hasLeft) {
+                                ComputeGrad<false, false>(topLeftId, distHighH, distHighW, w1);
+                            }
+                            if (hasTop && hasRight) {
+                                ComputeGrad<false, true>(topRightId, distHighH, distLowW, w2);
+                            }
+                            if (hasBottom && hasLeft) {
+                                ComputeGrad<true, false>(bottomLeftId, distLowH, distHighW, w3);
+                            }
+                            if (hasBottom && hasRight) {
+                                ComputeGrad<true, true>(bottomRightId, distLowH, distLowW, w4);
+                            }
+                            if (needGradValue) {
+                                SetFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+                                WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3);
+                                if (bucketMode) {
+                                    BucketPatch(hasTop, hasBottom, hasLeft, hasRight);
+                                } else {
+                                    ScatterPatch(hasTop, hasBottom, hasLeft, hasRight);
                                 }
                             }
-                            Muls(w1v1Local[pointOffset], zerosLocal[pointOffset + v1Id * baseOffsetUb],
-                                 w1, embedDims);
-                            Muls(w2v2Local[pointOffset], zerosLocal[pointOffset + v2Id * baseOffsetUb],
-                                 w2, embedDims);
-                            Muls(w3v3Local[pointOffset], zerosLocal[pointOffset + v3Id * baseOffsetUb],
-                                 w3, embedDims);
-                            Muls(w4v4Local[pointOffset], zerosLocal[pointOffset + v4Id * baseOffsetUb],
-                                 w4, embedDims);
-                            Add(w1v1Local[pointOffset], w1v1Local[pointOffset], w2v2Local[pointOffset], embedDims);
-                            Add(w1v1Local[pointOffset], w1v1Local[pointOffset], w3v3Local[pointOffset], embedDims);
-                            Add(w1v1Local[pointOffset], w1v1Local[pointOffset], w4v4Local[pointOffset], embedDims);
-                            Mul(zerosLocal[pointOffset + gradWeightId * baseOffsetUb], topGradLocal,
-                                w1v1Local[pointOffset], embedDims);
+                            if (!needGradWeight) {
+                                continue;
+                            }
+
+                            uint32_t offsetPatch = valuePatchId * BaseOffsetUb() + patchOffset;
+                            Muls(w1v1Local[pointOffset], zerosLocal[offsetPatch + topLeftId * EmbedDims()],
+                                 w1, EmbedDims());
+                            Muls(w2v2Local[pointOffset], zerosLocal[offsetPatch + topRightId * EmbedDims()],
+                                 w2, EmbedDims());
+                            Muls(w3v3Local[pointOffset], zerosLocal[offsetPatch + bottomLeftId * EmbedDims()],
+                                 w3, EmbedDims());
+                            Muls(w4v4Local[pointOffset], zerosLocal[offsetPatch + bottomRightId * EmbedDims()],
+                                 w4, EmbedDims());
+                            Add(w1v1Local[pointOffset], w1v1Local[pointOffset], w2v2Local[pointOffset], EmbedDims());
+                            Add(w1v1Local[pointOffset], w1v1Local[pointOffset], w3v3Local[pointOffset], EmbedDims());
+                            Add(w1v1Local[pointOffset], w1v1Local[pointOffset], w4v4Local[pointOffset], EmbedDims());
+                            Mul(zerosLocal[pointOffset + gradWeightId * BaseOffsetUb()], topGradLocal,
+                                w1v1Local[pointOffset], EmbedDims());
+                        }
+                        SetFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
+                        SetFlag<HardEvent::V_MTE2>(eventIdVToMte2);
+                        // the level's sums go to the output slot stored two levels ago, so this level's stores run
+                        // under the next level's math
+                        WaitFlag<HardEvent::MTE3_V>(eventIdOutputMte3ToV[outputSlot]);
+                        weightSumLocal = weightSumUb.Get<DTYPE_VALUE>()[outputSlot * NumPointsAlign()];
+                        xLocal = tmpXUb.Get<DTYPE_VALUE>()[outputSlot * NumPointsAlign()];
+                        yLocal = tmpYUb.Get<DTYPE_VALUE>()[outputSlot * NumPointsAlign()];
+                        // with points out of range the sums come out compacted and are spread back by the scalar unit
+                        bool expand = validNum < NumPoints();
+                        SumParams validSumParams = {validNum, sumParams.inner, sumParams.n};
+                        if (needGradLocation && validNum > 0) {
+                            Mul(tmpLocal, zerosLocal[topGradValueId * BaseOffsetUb()],
+                                zerosLocal[gradWWeightId * BaseOffsetUb()], validNum * EmbedDims());
+                            Muls(gradSampleXLocLocal, tmpLocal, (DTYPE_VALUE)w, validNum * EmbedDims());
+                            Mul(tmpLocal, zerosLocal[topGradValueId * BaseOffsetUb()],
+                                zerosLocal[gradHWeightId * BaseOffsetUb()], validNum * EmbedDims());
+                            Muls(gradSampleYLocLocal, tmpLocal, (DTYPE_VALUE)h, validNum * EmbedDims());
+                        }
+                        if (needGradWeight) {
+                            if (validNum > 0) {
+                                Sum(weightSumLocal, zerosLocal[gradWeightId * BaseOffsetUb()], validSumParams);
+                            }
+                            if (!expand) {
+                                SetFlag<HardEvent::V_MTE3>(eventIdVToMteWeight);
+                            }
+                        }
+                        if (needGradLocation) {
+                            if (validNum > 0) {
+                                Sum(xLocal, gradSampleXLocLocal, validSumParams);
+                            }
+                            if (!expand) {
+                                SetFlag<HardEvent::V_MTE3>(eventIdVToMte3X);
+                            }
+                            if (validNum > 0) {
+                                Sum(yLocal, gradSampleYLocLocal, validSumParams);
+                            }
+                            if (!expand) {
+                                SetFlag<HardEvent::V_MTE3>(eventIdVToMte3Y);
+                            }
+                        }
+                        if (expand && (needGradWeight || needGradLocation)) {
+                            SetFlag<HardEvent::V_S>(eventIdVToS);
+                            WaitFlag<HardEvent::V_S>(eventIdVToS);
+                            ExpandValidPoints();
+                            SetFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+                            WaitFlag<HardEvent::S_MTE3>(eventIdSToMte3);
+                        }
+
+                        if (needGradWeight) {
+                            if (!expand) {
+                                WaitFlag<HardEvent::V_MTE3>(eventIdVToMteWeight);
+                            }
+                            DataCopyPad(gradWeightGm[offsetWeight + level * NumPoints()], weightSumLocal, copyParams);
+                        }
+                        if (needGradLocation) {
+                            if (!expand) {
+                                WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3X);
+                            }
+                            DataCopyPad(gradLocationGm[offsetLocation + level * 2 * NumPoints()], xLocal, copyParams);
+                            if (!expand) {
+                                WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3Y);
+                            }
+                            DataCopyPad(gradLocationGm[offsetLocation + level * 2 * NumPoints() + NumPoints()], yLocal,
+                                        copyParams);
+                        }
+                        SetFlag<HardEvent::MTE3_V>(eventIdOutputMte3ToV[outputSlot]);
+                        outputSlot ^= 1;
+                        WaitFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
+                        WaitFlag<HardEvent::V_MTE2>(eventIdVToMte2);
+                        if (bucketMode) {
+                            // bucketRowLocal slots are rewritten by the scalar unit on the next level
+                            SetFlag<HardEvent::MTE3_S>(eventIdMte3ToS);
+                            WaitFlag<HardEvent::MTE3_S>(eventIdMte3ToS);
                         }
                     }
-                    SetFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
-                    SetFlag<HardEvent::V_MTE2>(eventIdVToMte2);
-                    Mul(tmpLocal, zerosLocal[topGradValueId * baseOffsetUb], zerosLocal[gradWWeightId * baseOffsetUb],
-                        numPoints * embedDims);
-                    Muls(gradSampleXLocLocal, tmpLocal, (DTYPE_VALUE)w, numPoints * embedDims);
-                    Mul(tmpLocal, zerosLocal[topGradValueId * baseOffsetUb], zerosLocal[gradHWeightId * baseOffsetUb],
-                        numPoints * embedDims);
-                    Muls(gradSampleYLocLocal, tmpLocal, (DTYPE_VALUE)h, numPoints * embedDims);
-                    Sum(weightSumLocal, zerosLocal[gradWeightId * baseOffsetUb], sumParams);
-                    SetFlag<HardEvent::V_MTE3>(eventIdVToMteWeight);
-                    Sum(xLocal, gradSampleXLocLocal, sumParams);
-                    SetFlag<HardEvent::V_MTE3>(eventIdVToMte3X);
-                    Sum(yLocal, gradSampleYLocLocal, sumParams);
-                    SetFlag<HardEvent::V_MTE3>(eventIdVToMte3Y);
-
-                    WaitFlag<HardEvent::V_MTE3>(eventIdVToMteWeight);
-                    DataCopyPad(gradWeightGm[offsetWeight + level * numPoints], weightSumLocal, copyParams);
-                    WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3X);
-                    DataCopyPad(gradLocationGm[offsetLocation + level * 2 * numPoints], xLocal, copyParams);
-                    WaitFlag<HardEvent::V_MTE3>(eventIdVToMte3Y);
-                    DataCopyPad(gradLocationGm[offsetLocation + level * 2 * numPoints + numPoints], yLocal, copyParams);
-                    WaitFlag<HardEvent::MTE3_V>(eventIdMte3ToV);
-                    WaitFlag<HardEvent::V_MTE2>(eventIdVToMte2);
                 }
+                EndHead();
             }
         }
     }
@@ -351,35 +976,54 @@ private:
     GlobalTensor<DTYPE_VALUE> gradOutputGm, gradValueGm, gradLocationGm, gradWeightGm;
 
     GlobalTensor<DTYPE_SPATIAL_SHAPES> valueSpatialShapesGm, valueLevelStartIndexGm;
+    GlobalTensor<int32_t> bucketOffsetGm, bucketRowGm, taskCounterGm, gradValueIndexGm, rowCounterGm;
+    GlobalTensor<DTYPE_VALUE> bucketValueGm;
 
     TBuf<TPosition::VECCALC> locationUb, attentionWeightsUb, shapeUb, offsetUb, topGradUb;
     TBuf<TPosition::VECCALC> tmpXUb, tmpYUb, weightSumUb;
     TBuf<TPosition::VECCALC> floatOneUb, zerosUb;
-    TBuf<TPosition::VECCALC> locWUb, locHUb, imUb, lowUb, lowFloatUb;
+    TBuf<TPosition::VECCALC> imUb, lowUb, lowFloatUb;
     TBuf<TPosition::VECCALC> distLowUb, distHighUb, w1Ub, w2Ub, w3Ub, w4Ub;
     TBuf<TPosition::VECCALC> w1v1Ub, w2v2Ub, w3v3Ub, w4v4Ub, tmpUb, tmpAUb, tmpBUb, midUb;
     TBuf<TPosition::VECCALC> gradSampleXLocUb, gradSampleYLocUb;
+    TBuf<TPosition::VECCALC> pointIndexUb, validPointUb, validMaskUb, rangeUb;
+    TBuf<TPosition::VECCALC> tileCursorUb, bucketRowUb, bucketSpanUb, tileAccUb, chunkRowUb, chunkValueUb, touchedUb;
 
     uint32_t coreNum;
-    uint32_t batchSize, numKeys, numHeads, embedDims, numLevels, numQueries, numPoints;
+    uint32_t batchSize, numSources, numKeys, numHeads, embedDims, numLevels, numQueries, numPoints;
     uint32_t numPointsAlign, numLevelsAlign;
     uint32_t batch, query, head, level, point;
     uint32_t curBlockIdx;
     uint32_t taskNum, taskNumPerCore;
     uint32_t startOffset, endOffset;
     uint32_t dataAlign, blockBytes;
-    uint32_t gradOutStride0, gradOutStride1, gradOutStride2;
-    uint32_t weightStride0, weightStride1, weightStride2;
-    uint32_t valueStride0, valueStride1, valueStride2;
-    uint32_t hOffsetUb, baseOffsetUb, pointOffset;
-    uint32_t mid1Id = 0, mid2Id = 1, mid3Id = 2, mid4Id = 3;
+    OFFSET_T gradOutStride0, gradOutStride1, gradOutStride2;
+    OFFSET_T weightStride0, weightStride1, weightStride2;
+    OFFSET_T valueStride0, valueStride1, valueStride2;
+    OFFSET_T valueSourceStride, gradOutSourceStride;
+    uint32_t baseOffsetUb, pointOffset;
+    uint32_t validNum;
+    uint32_t patchOffset;
+    uint32_t topLeftId = 0, topRightId = 1, bottomLeftId = 2, bottomRightId = 3;
     uint32_t gradHWeightId = 0, gradWWeightId = 1, topGradValueId = 2, gradWeightId = 3;
-    uint32_t v1Id = 4, v2Id = 5, v3Id = 6, v4Id = 7;
+    uint32_t valuePatchId = 4;
+    bool patchCopy;
+    bool bucketMode;
+    bool needGradValue, needGradLocation, needGradWeight, needValueSample;
+    uint32_t bucketTileRows, bucketTileNum, bucketTileNumAlign, bucketChunk, bucketCapacity, bucketBase;
+    uint32_t scheduleChunk;
+    uint32_t inputSlot = 0, outputSlot = 0;
+    bool levelTable;
+    DTYPE_SPATIAL_SHAPES levelHeight[MAX_LEVELS], levelWidth[MAX_LEVELS], levelStart[MAX_LEVELS];
+    uint32_t sparseRows;
+    bool sparseMode;
 
     DTYPE_VALUE hIm, wIm;
     DTYPE_VALUE w1 = 0, w2 = 0, w3 = 0, w4 = 0;
     DTYPE_SPATIAL_SHAPES h, w, levelStartId;
-    DTYPE_SPATIAL_SHAPES offsetValue, offsetWeight, offsetLocation, wStride, hStride;
+    DTYPE_SPATIAL_SHAPES wStride, hStride;
+    OFFSET_T offsetValue, offsetWeight, offsetLocation, levelValueOffset;
+    OFFSET_T locationRowStride, weightRowStride;
     DTYPE_SPATIAL_SHAPES hLowPtrOffset, wLowPtrOffset;
     DTYPE_SPATIAL_SHAPES hLow, wLow;
 
@@ -387,21 +1031,48 @@ private:
     LocalTensor<DTYPE_VALUE> floatOneLocal;
     LocalTensor<DTYPE_VALUE> xLocal, yLocal;
     LocalTensor<DTYPE_VALUE> distLowLocal, distHighLocal;
-    LocalTensor<DTYPE_VALUE> locWLocal, locHLocal;
     LocalTensor<DTYPE_VALUE> imLocal;
     LocalTensor<DTYPE_VALUE> zerosLocal;
     LocalTensor<DTYPE_VALUE> w1v1Local, w2v2Local, w3v3Local, w4v4Local;
     LocalTensor<DTYPE_VALUE> weightSumLocal, midLocal, tmpLocal, tmpALocal, tmpBLocal;
-    LocalTensor<DTYPE_VALUE> gradSampleXLocLocal, gradSampleYLocLocal;
+    LocalTensor<DTYPE_VALUE> gradSampleXLocLocal, gradSampleYLocLocal, rangeLocal;
+    LocalTensor<int32_t> pointIndexLocal;
+    LocalTensor<uint32_t> validPointLocal;
+    LocalTensor<uint8_t> validMaskLocal;
     LocalTensor<DTYPE_VALUE> topGradLocal, locationLocal, attentionWeightLocal;
     LocalTensor<DTYPE_SPATIAL_SHAPES> shapesLocal, offsetLocal;
     LocalTensor<DTYPE_SPATIAL_SHAPES> lowLocal;
+    LocalTensor<int32_t> tileCursorLocal, bucketRowLocal, bucketSpanLocal, chunkRowLocal, touchedLocal;
+    LocalTensor<DTYPE_VALUE> tileAccLocal, chunkValueLocal;
 
     SumParams sumParams;
-    DataCopyParams copyParams;
+    DataCopyParams copyParams, locationCopyParams, weightCopyParams, patchGatherParams, patchScatterParams;
+    DataCopyPadParams padParams = {false, 0, 0, 0};
     event_t eventIdVToMte2, eventIdVToMte3, eventIdMte2ToV, eventIdMte3ToV, eventIdVToMteWeight, eventIdVToMte3X, eventIdVToMte3Y;
+    event_t eventIdVToS, eventIdMte2ToS, eventIdSToMte3, eventIdMte3ToS;
+    event_t eventIdInputMte2ToV[2], eventIdInputVToMte2[2], eventIdOutputMte3ToV[2];
 };
 
+template <uint32_t EMBED_DIMS, uint32_t NUM_POINTS, typename OFFSET_T = int32_t>
+__aicore__ inline void RunMultiScaleDeformableAttnGradV2(GM_ADDR value_gm, GM_ADDR spatial_shapes_gm,
+                                                         GM_ADDR level_start_index_gm, GM_ADDR sampling_loc_gm,
+                                                         GM_ADDR attn_weight_gm, GM_ADDR grad_output_gm,
+                                                         GM_ADDR grad_value_gm, GM_ADDR grad_sampling_loc_gm,
+                                                         GM_ADDR grad_attn_weight_gm, GM_ADDR grad_value_index_gm,
+                                                         GM_ADDR workspace,
+                                                         const MultiScaleDeformableAttnGradV2TilingData *tiling_data,
+                                                         TPipe *pipe) {
+    MultiScaleDeformableAttnGradV2<EMBED_DIMS, NUM_POINTS, OFFSET_T> op;
+    op.Init(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm, attn_weight_gm, grad_output_gm,
+            grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm, grad_value_index_gm, workspace, tiling_data,
+            pipe);
+    op.InitBuffer();
+    op.GetLocalTensor();
+    op.ClearOutput();
+    op.Process();
+    op.ReleaseEventID();
+}
+
 // core func
 extern "C" __global__ __aicore__ void multi_scale_deformable_attn_grad_v2(GM_ADDR value_gm, GM_ADDR spatial_shapes_gm, 
                                                                           GM_ADDR level_start_index_gm, 
@@ -411,16 +1082,51 @@ extern "C" __global__ __aicore__ void multi_scale_deformable_attn_grad_v2(GM_ADD
                                                                           GM_ADDR grad_value_gm, 
                                                                           GM_ADDR grad_sampling_loc_gm,
                                                                           GM_ADDR grad_attn_weight_gm, 
+                                                                          GM_ADDR grad_value_index_gm,
                                                                           GM_ADDR workspace, GM_ADDR tiling_data) {
     TPipe pipe;
     GET_TILING_DATA(tiling_datas, tiling_data);
-
-    MultiScaleDeformableAttnGradV2 op;
-    op.Init(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm, attn_weight_gm, grad_output_gm,
-            grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm, &tiling_datas, &pipe);
-    op.InitBuffer();
-    op.GetLocalTensor();
-    op.ClearOutput();
-    op.Process();
-    op.ReleaseEventID();
+    // tiling key = embed_dims * 100 + num_points for the specialised shapes, 0 for the generic kernel,
+    // 100000 for the generic kernel with 64-bit GM offsets
+    if (TILING_KEY_IS(3204)) {
+        RunMultiScaleDeformableAttnGradV2<32, 4>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(3208)) {
+        RunMultiScaleDeformableAttnGradV2<32, 8>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(6404)) {
+        RunMultiScaleDeformableAttnGradV2<64, 4>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(6408)) {
+        RunMultiScaleDeformableAttnGradV2<64, 8>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(12804)) {
+        RunMultiScaleDeformableAttnGradV2<128, 4>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(12808)) {
+        RunMultiScaleDeformableAttnGradV2<128, 8>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(25604)) {
+        RunMultiScaleDeformableAttnGradV2<256, 4>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(25608)) {
+        RunMultiScaleDeformableAttnGradV2<256, 8>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(0)) {
+        RunMultiScaleDeformableAttnGradV2<0, 0>(value_gm, spatial_shapes_gm, level_start_index_gm, sampling_loc_gm,
+            attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    } else if (TILING_KEY_IS(100000)) {
+        RunMultiScaleDeformableAttnGradV2<0, 0, int64_t>(value_gm, spatial_shapes_gm, level_start_index_gm,
+            sampling_loc_gm, attn_weight_gm, grad_output_gm, grad_value_gm, grad_sampling_loc_gm, grad_attn_weight_gm,
+            grad_value_index_gm, workspace, &tiling_datas, &pipe);
+    }
 }
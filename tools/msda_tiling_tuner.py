@@ -0,0 +1,430 @@
+#!/usr/bin/env python3
+# -*- coding: UTF-8 -*-
+"""
+Offline tiling tuner for MultiScaleDeformableAttnFuncV2 / MultiScaleDeformableAttnGradV2.
+
+The tuner enumerates candidate tilings for a list of shapes, scores them with an
+analytic cost model (DMA descriptors and bytes, UB footprint, vector instructions,
+scalar accesses) and emits op_host/multi_scale_deformable_attn_v2_tiling_table.h,
+a shape-bucket -> tiling table consulted by both host tiling functions. Shapes that
+miss the table fall back to the formula in the tiling functions.
+
+Measured timings (optional) refine the model: each CSV row is one run of one
+candidate; the per-component cost scales are fitted by least squares.
+
+Usage:
+    python3 tools/msda_tiling_tuner.py --shapes shapes.json [--timings runs.csv]
+                                       [--core-num 40] [--output <header>]
+
+shapes.json is a list of objects with keys
+    batch, queries, heads, keys, embed, levels, points
+runs.csv has the header
+    op,batch,queries,heads,keys,embed,levels,points,used_cores,cache_mode,time_us[,order]
+where op is "fwd" or "grad" and the optional order is the forward order, "query"
+(default) or "slice".
+"""
+
+import argparse
+import csv
+import json
+import os
+
+OP_FWD = 0
+OP_GRAD = 1
+OP_NAMES = {"fwd": OP_FWD, "grad": OP_GRAD}
+
+CACHE_MODE_NORMAL = 0
+CACHE_MODE_STREAM = 1
+
+# forward order: QUERY visits every (batch, level, head) slice of value per query,
+# SLICE sweeps a core's queries once per slice (MsdaChooseForwardOrder)
+ORDER_QUERY = 0
+ORDER_SLICE = 1
+ORDER_NAMES = {"query": ORDER_QUERY, "slice": ORDER_SLICE}
+
+DTYPE_BYTES = 4
+BLOCK_BYTES = 32
+REPEAT_BYTES = 256
+
+DEFAULT_SHAPES = [
+    # Deformable DETR encoder / decoder
+    dict(batch=1, queries=20000, heads=8, keys=20000, embed=32, levels=4, points=4),
+    dict(batch=2, queries=900, heads=8, keys=20000, embed=32, levels=4, points=4),
+    dict(batch=2, queries=300, heads=8, keys=20000, embed=32, levels=4, points=4),
+    # BEVFormer spatial / temporal attention
+    dict(batch=1, queries=2500, heads=8, keys=30825, embed=32, levels=4, points=8),
+    dict(batch=2, queries=2500, heads=8, keys=2500, embed=32, levels=1, points=4),
+    dict(batch=1, queries=40000, heads=8, keys=40000, embed=32, levels=1, points=4),
+    # Mask2Former pixel decoder
+    dict(batch=2, queries=8400, heads=8, keys=8400, embed=32, levels=3, points=4),
+    # wide heads
+    dict(batch=1, queries=4096, heads=4, keys=16384, embed=64, levels=4, points=4),
+    dict(batch=1, queries=1024, heads=4, keys=16384, embed=128, levels=4, points=8),
+    # high-resolution BEV with wide heads: value overflows L2, one slice does not
+    dict(batch=4, queries=40000, heads=8, keys=40000, embed=64, levels=1, points=4),
+]
+
+
+class HwModel(object):
+    """Throughput figures of one AIV core and the shared memory system (Ascend 910B)."""
+
+    def __init__(self, core_num, ub_bytes, l2_bytes):
+        self.core_num = core_num
+        self.ub_bytes = ub_bytes
+        self.l2_bytes = l2_bytes
+        self.hbm_gbps = 1600.0
+        self.l2_gbps = 5000.0
+        self.core_gbps = 120.0
+        self.dma_desc_us = 0.08
+        self.miss_desc_us = 0.04
+        self.vec_issue_us = 0.012
+        self.vec_repeat_us = 0.0006
+        self.scalar_us = 0.004
+        self.core_setup_us = 1.5
+        self.launch_us = 3.0
+        self.sync_all_us = 1.0
+
+
+class Shape(object):
+    def __init__(self, batch, queries, heads, keys, embed, levels, points):
+        self.batch = batch
+        self.queries = queries
+        self.heads = heads
+        self.keys = keys
+        self.embed = embed
+        self.levels = levels
+        self.points = points
+
+    @classmethod
+    def from_dict(cls, d):
+        return cls(int(d["batch"]), int(d["queries"]), int(d["heads"]), int(d["keys"]),
+                   int(d["embed"]), int(d["levels"]), int(d["points"]))
+
+    def value_bytes(self):
+        return self.batch * self.heads * self.keys * self.embed * DTYPE_BYTES
+
+    def slice_bytes(self):
+        """One (batch, level, head) slice of value, bounded by all of a head's keys."""
+        return self.keys * self.embed * DTYPE_BYTES
+
+    def stream_bytes(self):
+        rows = self.batch * self.queries * self.heads
+        return rows * (self.levels * self.points * 3 + self.embed) * DTYPE_BYTES
+
+
+class Candidate(object):
+    def __init__(self, used_cores, cache_mode, order=ORDER_QUERY):
+        self.used_cores = used_cores
+        self.cache_mode = cache_mode
+        self.order = order
+
+
+class Cost(object):
+    """Additive cost components in microseconds; total() applies fitted scales."""
+
+    def __init__(self, dma_us, vec_us, fixed_us):
+        self.dma_us = dma_us
+        self.vec_us = vec_us
+        self.fixed_us = fixed_us
+
+    def total(self, scales=(1.0, 1.0, 1.0)):
+        return scales[0] * self.dma_us + scales[1] * self.vec_us + scales[2] * self.fixed_us
+
+
+def align_up(x, align):
+    return (x + align - 1) // align * align
+
+
+def div_ceil(x, y):
+    return (x + y - 1) // y
+
+
+def vec_cost(hw, count, elems):
+    """Issue cost plus repeat cost for `count` vector instructions of `elems` fp32 each."""
+    repeats = max(1, div_ceil(elems * DTYPE_BYTES, REPEAT_BYTES))
+    return count * (hw.vec_issue_us + repeats * hw.vec_repeat_us)
+
+
+def ub_usage(op, s):
+    align = BLOCK_BYTES // DTYPE_BYTES
+    p_align = align_up(s.points, align)
+    l_align = align_up(s.levels, align)
+    pe = s.points * s.embed
+    if op == OP_FWD:
+        words = (align_up(s.levels * 2, align) + l_align
+                 + align_up(s.heads * s.levels * s.points * 2, align)
+                 + align_up(s.heads * s.levels * s.points, align)
+                 + 2 * s.embed + 19 * p_align + align_up(s.points, 256) // 8 // DTYPE_BYTES + align_up(s.heads, align)
+                 + 12 * pe + pe + s.heads * pe)
+    else:
+        # must match MsdaGradUbBytes() in the host tiling helpers; tuned shapes have one value source
+        sources = 1
+        words = (3 * l_align + 2 * 3 * s.levels * p_align + 2 * (sources + 1) * s.embed
+                 + 22 * p_align + 19 * pe)
+        return words * DTYPE_BYTES + align_up(s.points, 256) // 8
+    return words * DTYPE_BYTES
+
+
+def head_packed(hw, s):
+    """Forward head packing as decided by MsdaUseHeadPacked(); it rules out the slice order."""
+    lanes = s.heads * s.points
+    if s.embed > 32 or s.embed % 8 != 0 or lanes % 8 != 0 or lanes > 255:
+        return False
+    return 14 * lanes * s.embed * DTYPE_BYTES + 32 * 1024 <= hw.ub_bytes
+
+
+def value_in_l2(hw, s, cand):
+    """Whether the value working set (all of value, or one slice in the slice order) stays in L2."""
+    resident = s.slice_bytes() if cand.order == ORDER_SLICE else s.value_bytes()
+    if cand.cache_mode == CACHE_MODE_NORMAL:
+        resident += s.stream_bytes()
+    return resident <= hw.l2_bytes
+
+
+def value_bandwidth(hw, s, cand):
+    """Effective bandwidth seen by value gathers, shared across the active cores."""
+    shared = hw.l2_gbps if value_in_l2(hw, s, cand) else hw.hbm_gbps
+    return min(hw.core_gbps, shared / cand.used_cores)
+
+
+def value_desc_us(hw, s, cand):
+    """Per-descriptor cost of a value gather: small gathers that miss L2 wait on HBM latency."""
+    return hw.dma_desc_us + (0.0 if value_in_l2(hw, s, cand) else hw.miss_desc_us)
+
+
+def stream_bandwidth(hw, cand):
+    return min(hw.core_gbps, hw.hbm_gbps / cand.used_cores)
+
+
+def task_cost_fwd(hw, s, cand, inner_fraction=0.9):
+    """Cost of one query task (all batches) of the forward kernel."""
+    bl = s.batch * s.levels
+    blh = bl * s.heads
+    rows_per_point = 2.0 * inner_fraction
+    value_desc = blh * s.points * rows_per_point
+    value_bytes = blh * s.points * rows_per_point * 2 * s.embed * DTYPE_BYTES
+    out_desc = s.batch * s.heads + blh * s.points
+    out_bytes = out_desc * s.embed * DTYPE_BYTES
+    # the slice order fetches the location slice per (query, slice) instead of the row per query
+    stream_desc = 2 * blh if cand.order == ORDER_SLICE else s.batch + blh
+    stream_bytes = s.batch * s.heads * s.levels * s.points * 3 * DTYPE_BYTES
+
+    dma = value_desc * value_desc_us(hw, s, cand) + (out_desc + stream_desc) * hw.dma_desc_us
+    dma += value_bytes / (value_bandwidth(hw, s, cand) * 1e3)
+    dma += (out_bytes + stream_bytes) / (stream_bandwidth(hw, cand) * 1e3)
+
+    pe = s.points * s.embed
+    vec = blh * (vec_cost(hw, 1, 4 * pe) + vec_cost(hw, 9, s.points * 2)
+                 + vec_cost(hw, 4 * s.points, s.embed) + vec_cost(hw, 1, 4 * pe)
+                 + vec_cost(hw, 3, pe))
+    vec += blh * s.points * 10 * hw.scalar_us
+    return dma, vec
+
+
+def task_cost_grad(hw, s, cand, inner_fraction=0.9):
+    """Cost of one query task (all batches) of the backward kernel."""
+    bh = s.batch * s.heads
+    bhl = bh * s.levels
+    corners = 4.0 * inner_fraction
+    value_desc = bhl * s.points * corners
+    scatter_desc = value_desc
+    value_bytes = value_desc * s.embed * DTYPE_BYTES
+    stream_desc = bh + bhl * 6
+    stream_bytes = bh * s.embed * DTYPE_BYTES + bhl * s.points * 6 * DTYPE_BYTES
+
+    dma = value_desc * value_desc_us(hw, s, cand) + (scatter_desc + stream_desc) * hw.dma_desc_us
+    dma += 2 * value_bytes / (value_bandwidth(hw, s, cand) * 1e3)
+    dma += stream_bytes / (stream_bandwidth(hw, cand) * 1e3)
+
+    pe = s.points * s.embed
+    vec = bhl * (vec_cost(hw, 1, 8 * pe) + vec_cost(hw, 9, 2 * s.points) + vec_cost(hw, 4, pe)
+                 + vec_cost(hw, 3, pe) + s.points * vec_cost(hw, 20, s.embed))
+    vec += bhl * s.points * 16 * hw.scalar_us
+    return dma, vec
+
+
+def evaluate(hw, op, s, cand):
+    tasks_per_core = div_ceil(s.queries, cand.used_cores)
+    if op == OP_FWD:
+        dma, vec = task_cost_fwd(hw, s, cand)
+        fixed = hw.launch_us + hw.core_setup_us
+    else:
+        dma, vec = task_cost_grad(hw, s, cand)
+        clear_bytes = s.value_bytes() + s.batch * s.queries * s.heads * s.levels * s.points * 3 * DTYPE_BYTES
+        fixed = hw.launch_us + hw.core_setup_us + hw.sync_all_us
+        fixed += clear_bytes / (hw.core_gbps * 1e3)
+    return Cost(tasks_per_core * dma, tasks_per_core * vec, fixed)
+
+
+def candidates(hw, op, s):
+    """One candidate per distinct task split: the fewest cores reaching each tasks-per-core. The forward also
+    tries the slice order where the host allows it (no head packing, no query split)."""
+    orders = [ORDER_QUERY]
+    if op == OP_FWD and not head_packed(hw, s) and s.queries >= hw.core_num:
+        orders.append(ORDER_SLICE)
+    seen = set()
+    cands = []
+    for used in range(1, min(hw.core_num, s.queries) + 1):
+        per_core = div_ceil(s.queries, used)
+        if per_core in seen:
+            continue
+        seen.add(per_core)
+        used_min = div_ceil(s.queries, per_core)
+        for mode in (CACHE_MODE_NORMAL, CACHE_MODE_STREAM):
+            for order in orders:
+                cands.append(Candidate(used_min, mode, order))
+    return cands
+
+
+def bucket_of(x):
+    """log2 bucket; must match MsdaTilingBucket() in the host tiling helpers."""
+    return max(0, int(x).bit_length() - 1)
+
+
+def bucket_key(op, s):
+    return (op, s.embed, s.heads, s.levels, s.points,
+            bucket_of(s.batch), bucket_of(s.queries), bucket_of(s.keys))
+
+
+def fit_scales(hw, rows):
+    """Least-squares fit of (dma, vec, fixed) scales against measured timings."""
+    ata = [[0.0] * 3 for _ in range(3)]
+    atb = [0.0] * 3
+    for op, s, cand, time_us in rows:
+        cost = evaluate(hw, op, s, cand)
+        x = (cost.dma_us, cost.vec_us, cost.fixed_us)
+        for i in range(3):
+            atb[i] += x[i] * time_us
+            for j in range(3):
+                ata[i][j] += x[i] * x[j]
+    for i in range(3):
+        ata[i][i] += 1e-6
+    scales = solve3(ata, atb)
+    if scales is None:
+        return (1.0, 1.0, 1.0)
+    return tuple(max(s, 0.05) for s in scales)
+
+
+def solve3(a, b):
+    m = [row[:] + [b[i]] for i, row in enumerate(a)]
+    for col in range(3):
+        pivot = max(range(col, 3), key=lambda r: abs(m[r][col]))
+        if abs(m[pivot][col]) < 1e-12:
+            return None
+        m[col], m[pivot] = m[pivot], m[col]
+        for r in range(3):
+            if r != col:
+                f = m[r][col] / m[col][col]
+                for c in range(col, 4):
+                    m[r][c] -= f * m[col][c]
+    return [m[i][3] / m[i][i] for i in range(3)]
+
+
+def load_timings(path):
+    rows = []
+    with open(path, newline="") as f:
+        for rec in csv.DictReader(f):
+            s = Shape.from_dict(rec)
+            cand = Candidate(int(rec["used_cores"]), int(rec["cache_mode"]),
+                             ORDER_NAMES[rec.get("order") or "query"])
+            rows.append((OP_NAMES[rec["op"]], s, cand, float(rec["time_us"])))
+    return rows
+
+
+def tune(hw, shapes, scales):
+    """Pick, per bucket, the candidate with the lowest summed cost over the bucket's shapes."""
+    buckets = {}
+    for op in (OP_FWD, OP_GRAD):
+        for s in shapes:
+            if ub_usage(op, s) > hw.ub_bytes:
+                continue
+            buckets.setdefault(bucket_key(op, s), []).append(s)
+
+    table = []
+    for key in sorted(buckets):
+        op = key[0]
+        members = buckets[key]
+        best = None
+        for cand in candidates(hw, op, min(members, key=lambda m: m.queries)):
+            cost = sum(evaluate(hw, op, s, Candidate(min(cand.used_cores, s.queries), cand.cache_mode, cand.order))
+                       .total(scales) for s in members)
+            if best is None or cost < best[0]:
+                best = (cost, cand)
+        table.append((key, best[1], best[0]))
+    return table
+
+
+def emit_header(path, hw, table, scales):
+    lines = [
+        "// Generated by tools/msda_tiling_tuner.py. Do not edit by hand.",
+        "// core num: %d, ub bytes: %d, l2 bytes: %d, scales (dma, vec, fixed): %.3f %.3f %.3f"
+        % (hw.core_num, hw.ub_bytes, hw.l2_bytes, scales[0], scales[1], scales[2]),
+        "#ifndef MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_TABLE_H",
+        "#define MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_TABLE_H",
+        "#include <cstdint>",
+        "",
+        "namespace optiling {",
+        "    struct MsdaTilingTableEntry {",
+        "        uint32_t op;",
+        "        uint32_t embedDims;",
+        "        uint32_t numHeads;",
+        "        uint32_t numLevels;",
+        "        uint32_t numPoints;",
+        "        uint32_t batchBucket;",
+        "        uint32_t queryBucket;",
+        "        uint32_t keyBucket;",
+        "        uint32_t usedCoreNum;",
+        "        uint32_t cacheMode;",
+        "        uint32_t forwardOrder;",
+        "    };",
+        "",
+        "    const uint32_t MSDA_TILING_TABLE_CORE_NUM = %d;" % hw.core_num,
+        "",
+        "    const MsdaTilingTableEntry MSDA_TILING_TABLE[] = {",
+    ]
+    for key, cand, cost in table:
+        op, embed, heads, levels, points, bb, qb, kb = key
+        lines.append("        {%d, %d, %d, %d, %d, %d, %d, %d, %d, %d, %d}, // %.1f us"
+                     % (op, embed, heads, levels, points, bb, qb, kb, cand.used_cores, cand.cache_mode, cand.order,
+                        cost))
+    if not table:
+        lines.append("        {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},")
+    lines += [
+        "    };",
+        "} // namespace optiling",
+        "#endif // MULTI_SCALE_DEFORMABLE_ATTN_V2_TILING_TABLE_H",
+        "",
+    ]
+    with open(path, "w") as f:
+        f.write("\n".join(lines))
+
+
+def main():
+    root = os.path.realpath(os.path.join(os.path.dirname(__file__), ".."))
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--shapes", help="json list of shapes to tune (default: built-in model shapes)")
+    parser.add_argument("--timings", help="csv of measured timings used to refine the cost model")
+    parser.add_argument("--core-num", type=int, default=40, help="AIV core count of the target")
+    parser.add_argument("--ub-bytes", type=int, default=192 * 1024)
+    parser.add_argument("--l2-bytes", type=int, default=192 * 1024 * 1024)
+    parser.add_argument("--output", default=os.path.join(root, "op_host",
+                                                         "multi_scale_deformable_attn_v2_tiling_table.h"))
+    args = parser.parse_args()
+
+    hw = HwModel(args.core_num, args.ub_bytes, args.l2_bytes)
+    if args.shapes:
+        with open(args.shapes) as f:
+            shapes = [Shape.from_dict(d) for d in json.load(f)]
+    else:
+        shapes = [Shape.from_dict(d) for d in DEFAULT_SHAPES]
+    scales = (1.0, 1.0, 1.0)
+    if args.timings:
+        scales = fit_scales(hw, load_timings(args.timings))
+
+    table = tune(hw, shapes, scales)
+    emit_header(args.output, hw, table, scales)
+    print("[INFO] %d table entries written to %s" % (len(table), args.output))
+
+
+if __name__ == "__main__":
+    main()
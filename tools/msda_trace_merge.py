@@ -0,0 +1,42 @@
+#!/usr/bin/env python3
+# -*- coding: UTF-8 -*-
+"""
+Merges the Chrome trace files written under MSDA_TRACE=<prefix> into one trace.
+
+Each shared object that records events (the aclnn caller, the tiling functions)
+writes its own <prefix>.<pid>.<module>.json at exit. The timestamps share the
+steady clock and the tids are OS thread ids, so joining the event lists lines the
+tiling events up under the GetWorkspaceSize spans that triggered them.
+
+Usage:
+    python3 tools/msda_trace_merge.py <prefix> [--output merged.json]
+
+Open the result in chrome://tracing or https://ui.perfetto.dev.
+"""
+
+import argparse
+import glob
+import json
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("prefix", help="value MSDA_TRACE was set to")
+    parser.add_argument("--output", help="merged trace path (default: <prefix>.json)")
+    args = parser.parse_args()
+
+    paths = sorted(glob.glob(args.prefix + ".*.json"))
+    events = []
+    for path in paths:
+        with open(path) as f:
+            events.extend(json.load(f)["traceEvents"])
+    events.sort(key=lambda e: (e["pid"], e["tid"], e["ts"]))
+
+    output = args.output or args.prefix + ".json"
+    with open(output, "w") as f:
+        json.dump({"displayTimeUnit": "ms", "traceEvents": events}, f)
+    print("[INFO] %d events from %d files written to %s" % (len(events), len(paths), output))
+
+
+if __name__ == "__main__":
+    main()